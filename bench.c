@@ -0,0 +1,900 @@
+// clock_gettime is POSIX.1-2008.
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring_log.h"
+
+// bench.c measures how fast ring_log writes and reads entries, and prints a
+// row per measurement: as CSV by default, or as one JSON object per line with
+// `json` as the first argument. With a directory as the second argument, the
+// ring log files go there (say, tmpfs or a real disk), so that runs can be
+// diffed between releases and between disks. bench_uring is the same, but
+// built with ring_log_io_uring.c instead of ring_log_io_fd.c, to compare the
+// two I/O layers.
+//
+// Usage: ./bench [csv|json] [dir]
+
+extern log_t logs[];
+extern const int n_logs;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// bench is linked with -Wl,--wrap for each of the syscalls that ring_log does
+// its I/O with, so that they get counted.
+static unsigned long syscalls;
+
+static void count_syscall(void) {
+    __atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+}
+
+ssize_t __real_pread(int, void *, size_t, off_t);
+ssize_t __real_pwrite(int, const void *, size_t, off_t);
+int __real_fdatasync(int);
+off_t __real_lseek(int, off_t, int);
+
+ssize_t __wrap_pread(int fd, void *p, size_t len, off_t off) {
+    count_syscall();
+    return __real_pread(fd, p, len, off);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *p, size_t len, off_t off) {
+    count_syscall();
+    return __real_pwrite(fd, p, len, off);
+}
+
+int __wrap_fdatasync(int fd) {
+    count_syscall();
+    return __real_fdatasync(fd);
+}
+
+off_t __wrap_lseek(int fd, off_t off, int whence) {
+    count_syscall();
+    return __real_lseek(fd, off, whence);
+}
+
+// ring_log_io_uring.c goes through syscall for io_uring_setup and
+// io_uring_enter. Only the arguments it passes are read: reading more would be
+// undefined. Nothing else here calls syscall, so anything else is passed on
+// without arguments.
+long __real_syscall(long, ...);
+
+long __wrap_syscall(long n, ...) {
+    va_list ap;
+    va_start(ap, n);
+    count_syscall();
+    long ret;
+    switch (n) {
+    case __NR_io_uring_setup: {
+        unsigned entries = va_arg(ap, unsigned);
+        void *params = va_arg(ap, void *);
+        ret = __real_syscall(n, entries, params);
+        break;
+    }
+    case __NR_io_uring_enter: {
+        int fd = va_arg(ap, int);
+        unsigned to_submit = va_arg(ap, unsigned);
+        unsigned min_complete = va_arg(ap, unsigned);
+        unsigned flags = va_arg(ap, unsigned);
+        void *sig = va_arg(ap, void *);
+        int sigsz = va_arg(ap, int);
+        ret = __real_syscall(n, fd, to_submit, min_complete, flags, sig, sigsz);
+        break;
+    }
+    default:
+        ret = __real_syscall(n);
+        break;
+    }
+    va_end(ap);
+    return ret;
+}
+
+// Latencies (in ns) are counted in buckets an eighth of a power of two wide,
+// so percentiles come out within 12.5% without keeping every latency around.
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+} hist_t;
+
+static void hist_add(hist_t *hist, uint64_t ns) {
+    int bucket = ns;
+    if (ns >= 1 << HIST_SUB_BITS) {
+        int log2 = 63 - __builtin_clzll(ns);
+        int sub = (ns >> (log2 - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+        bucket = ((log2 - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+    }
+    hist->counts[bucket]++;
+    hist->total++;
+}
+
+static void hist_merge(hist_t *into, const hist_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+}
+
+// hist_percentile returns the top of the bucket that the `p`th percentile
+// latency falls in, in us.
+static double hist_percentile(const hist_t *hist, double p) {
+    uint64_t target = hist->total * p / 100;
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (; bucket < HIST_BUCKETS - 1; bucket++) {
+        seen += hist->counts[bucket];
+        if (seen > target) {
+            break;
+        }
+    }
+    if (bucket < 1 << HIST_SUB_BITS) {
+        return bucket / 1e3;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t top = ((uint64_t)((1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift) + ((uint64_t)1 << shift) - 1;
+    return top / 1e3;
+}
+
+// A result is a row of output. The numbers that don't apply to a measurement
+// are negative, and come out empty (CSV) or null (JSON).
+typedef struct {
+    const char *bench;
+    const char *variant;
+    double entry_size;
+    double chunk;
+    double capacity;
+    double logs;
+    double threads;
+    double entries;
+    double secs;
+    double syscalls;
+    double entries_kept;
+    hist_t hist;
+} result_t;
+
+static void result_init(result_t *r, const char *bench, const char *variant) {
+    memset(r, 0, sizeof(*r));
+    r->bench = bench;
+    r->variant = variant;
+    r->entry_size = r->chunk = r->capacity = r->logs = r->threads = -1;
+    r->entries = r->secs = r->syscalls = r->entries_kept = -1;
+}
+
+static const char *columns[] = {
+    "bench", "variant", "entry_size", "chunk", "capacity", "logs", "threads", "entries", "ms",
+    "entries_per_s", "mb_per_s", "p50_us", "p99_us", "p999_us", "syscalls_per_entry", "entries_kept"
+};
+#define N_COLUMNS (sizeof(columns) / sizeof(columns[0]))
+
+static int json;
+
+static void print_header(void) {
+    if (json) {
+        return;
+    }
+    for (int i = 0; i < N_COLUMNS; i++) {
+        printf("%s%s", i ? "," : "", columns[i]);
+    }
+    printf("\n");
+}
+
+static void print_result(const result_t *r) {
+    int have_rate = r->entries > 0 && r->secs > 0;
+    int have_hist = r->hist.total > 0;
+    double values[N_COLUMNS] = {
+        0, 0, r->entry_size, r->chunk, r->capacity, r->logs, r->threads, r->entries,
+        r->secs >= 0 ? r->secs * 1e3 : -1,
+        have_rate ? r->entries / r->secs : -1,
+        have_rate && r->entry_size >= 0 ? r->entries * r->entry_size / r->secs / 1e6 : -1,
+        have_hist ? hist_percentile(&r->hist, 50) : -1,
+        have_hist ? hist_percentile(&r->hist, 99) : -1,
+        have_hist ? hist_percentile(&r->hist, 99.9) : -1,
+        r->entries > 0 && r->syscalls >= 0 ? r->syscalls / r->entries : -1,
+        r->entries_kept
+    };
+
+    if (json) {
+        printf("{\"%s\": \"%s\", \"%s\": \"%s\"", columns[0], r->bench, columns[1], r->variant);
+    } else {
+        printf("%s,%s", r->bench, r->variant);
+    }
+    for (int i = 2; i < N_COLUMNS; i++) {
+        if (json) {
+            printf(", \"%s\": ", columns[i]);
+        } else {
+            printf(",");
+        }
+        if (values[i] >= 0 && values[i] == (long long)values[i]) {
+            printf("%lld", (long long)values[i]);
+        } else if (values[i] >= 0) {
+            printf("%.3f", values[i]);
+        } else if (json) {
+            printf("null");
+        }
+    }
+    printf(json ? "}\n" : "\n");
+    fflush(stdout);
+}
+
+static int started;
+
+// reset (re)creates all of the ring log files with `capacity` (the last log
+// gets a bit less, see bench_config.c) and `provision`, and starts ring_log.
+// It returns how long that took, up to and including writing the first entry.
+static double reset(off_t capacity, ring_log_provision_t provision) {
+    if (started) {
+        ring_log_deinit();
+    }
+    for (int i = 0; i < n_logs; i++) {
+        unlink(logs[i].fn);
+        logs[i].capacity = i == n_logs - 1 ? capacity - 8 : capacity;
+        logs[i].provision = provision;
+    }
+    double start = now();
+    if (!ring_log_init()) {
+        puts("ring_log_init failed");
+        exit(1);
+    }
+    started = 1;
+    ring_log_handle_t log = ring_log_open(logs[0].fn);
+    ring_log_write_tail_h(log, "first", 5);
+    ring_log_write_tail_complete_h(log);
+    double secs = now() - start;
+    ring_log_read_head_success_h(log);
+    return secs;
+}
+
+// empty drops all of the entries in the log.
+static void empty(ring_log_handle_t log) {
+    while (ring_log_has_unread_h(log)) {
+        ring_log_read_head_success_h(log);
+    }
+}
+
+#define MAX_THREADS 8
+
+// How writer threads write each entry: with one ring_log_write_tail_h, with
+// one for a 16 byte record header and one for the rest, with a
+// ring_log_writev of those two, or by copying them into a ring_log_reserve'd
+// entry (or with ring_log_writev, if it can't be reserved).
+typedef enum {
+    WRITE_TAIL,
+    WRITE_TAIL_PARTS,
+    WRITE_V,
+    WRITE_RESERVE
+} write_how_t;
+
+#define RECORD_HEADER_SIZE 16
+
+// Each writer thread writes `entries` entries of `entry_size` bytes to its
+// log, and times each of them.
+typedef struct {
+    ring_log_handle_t log;
+    size_t entry_size;
+    long entries;
+    write_how_t how;
+    hist_t hist;
+} writer_t;
+
+static void *writer(void *arg) {
+    writer_t *w = arg;
+    char *entry = malloc(w->entry_size);
+    memset(entry, 'x', w->entry_size);
+    struct iovec iov[] = {
+        { .iov_base = entry, .iov_len = RECORD_HEADER_SIZE },
+        { .iov_base = entry + RECORD_HEADER_SIZE, .iov_len = w->entry_size - RECORD_HEADER_SIZE }
+    };
+    for (long i = 0; i < w->entries; i++) {
+        uint64_t start = now_ns();
+        switch (w->how) {
+        case WRITE_TAIL:
+            ring_log_write_tail_h(w->log, entry, w->entry_size);
+            ring_log_write_tail_complete_h(w->log);
+            break;
+        case WRITE_TAIL_PARTS:
+            ring_log_write_tail_h(w->log, iov[0].iov_base, iov[0].iov_len);
+            ring_log_write_tail_h(w->log, iov[1].iov_base, iov[1].iov_len);
+            ring_log_write_tail_complete_h(w->log);
+            break;
+        case WRITE_V:
+            ring_log_writev(w->log, iov, 2);
+            break;
+        case WRITE_RESERVE: {
+            ring_log_resv_t resv;
+            if (ring_log_reserve(w->log, w->entry_size, &resv) == NULL) {
+                ring_log_writev(w->log, iov, 2);
+                break;
+            }
+            memcpy(resv.span[0], entry, resv.len[0]);
+            memcpy(resv.span[1], entry + resv.len[0], resv.len[1]);
+            ring_log_commit(&resv);
+            break;
+        }
+        }
+        hist_add(&w->hist, now_ns() - start);
+    }
+    free(entry);
+    return NULL;
+}
+
+// run_writers starts `n_threads` writer threads, spread over the first
+// `n_logs_used` logs, that each write `entries` entries the `how` way, and
+// fills in the result. The time includes writing out what's left in async
+// queues, and if `sync`, syncing the logs at the end.
+static void run_writers(result_t *r, int n_threads, int n_logs_used, size_t entry_size, long entries, write_how_t how, int sync) {
+    static writer_t writers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    unsigned long syscalls_before = syscalls;
+    double start = now();
+    for (int i = 0; i < n_threads; i++) {
+        memset(&writers[i], 0, sizeof(writers[i]));
+        writers[i].log = ring_log_open(logs[i % n_logs_used].fn);
+        writers[i].entry_size = entry_size;
+        writers[i].entries = entries;
+        writers[i].how = how;
+        RING_LOG_EXPECT(pthread_create(&threads[i], NULL, writer, &writers[i]), 0);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        RING_LOG_EXPECT(pthread_join(threads[i], NULL), 0);
+    }
+    ring_log_flush();
+    for (int i = 0; sync && i < n_logs_used; i++) {
+        ring_log_sync_h(ring_log_open(logs[i].fn));
+    }
+    r->secs = now() - start;
+    r->syscalls = syscalls - syscalls_before;
+    r->entry_size = entry_size;
+    r->capacity = logs[0].capacity;
+    r->logs = n_logs_used;
+    r->threads = n_threads;
+    r->entries = (double)n_threads * entries;
+    for (int i = 0; i < n_threads; i++) {
+        hist_merge(&r->hist, &writers[i].hist);
+    }
+}
+
+// Write benchmarks write this many entries per thread, or fewer if they'd add
+// up to more than WRITE_BYTES.
+#define WRITE_ENTRIES 100000
+#define WRITE_BYTES (256L * 1024 * 1024)
+
+static long write_entries(size_t entry_size) {
+    return WRITE_BYTES / entry_size < WRITE_ENTRIES ? WRITE_BYTES / entry_size : WRITE_ENTRIES;
+}
+
+static const size_t entry_sizes[] = {8, 64, 512, 4096, 8192};
+#define N_ENTRY_SIZES (sizeof(entry_sizes) / sizeof(entry_sizes[0]))
+
+static const off_t capacities[] = {4096, 65536, 1 << 20};
+#define N_CAPACITIES (sizeof(capacities) / sizeof(capacities[0]))
+
+// bench_write sweeps entry sizes and ring sizes, with one thread writing to
+// one log. Entries that take up more than a quarter of the ring are skipped.
+static void bench_write(void) {
+    for (int i = 0; i < N_CAPACITIES; i++) {
+        reset(capacities[i], RING_LOG_PROVISION_FILL);
+        for (int j = 0; j < N_ENTRY_SIZES; j++) {
+            if (entry_sizes[j] * 4 > capacities[i]) {
+                continue;
+            }
+            result_t r;
+            result_init(&r, "write", "");
+            run_writers(&r, 1, 1, entry_sizes[j], write_entries(entry_sizes[j]), WRITE_TAIL, 0);
+            print_result(&r);
+        }
+    }
+}
+
+// bench_writev compares writing a record header and its payload with two
+// ring_log_write_tail_h calls, with one ring_log_writev, and into a reserved
+// entry, which only saves a copy with the mmap layer (or for entries that fit
+// in the staging buffer). Only with one thread: tasks writing tail entries bit
+// by bit to the same log would mix up each other's entries.
+static void bench_writev(void) {
+    static const struct {
+        const char *name;
+        write_how_t how;
+    } variants[] = {
+        {"write_tail", WRITE_TAIL_PARTS},
+        {"writev", WRITE_V},
+        {"reserve", WRITE_RESERVE}
+    };
+    reset(65536, RING_LOG_PROVISION_FILL);
+    for (int i = 1; i < N_ENTRY_SIZES - 1; i++) {
+        for (int j = 0; j < sizeof(variants) / sizeof(variants[0]); j++) {
+            result_t r;
+            result_init(&r, "writev", variants[j].name);
+            run_writers(&r, 1, 1, entry_sizes[i], write_entries(entry_sizes[i]), variants[j].how, 0);
+            print_result(&r);
+        }
+    }
+}
+
+// bench_threads sweeps writer threads and how many logs they're spread over.
+// With a lock per log, threads writing to their own logs shouldn't get in each
+// other's way.
+static void bench_threads(void) {
+    reset(65536, RING_LOG_PROVISION_FILL);
+    for (int n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2) {
+        for (int n_logs_used = 1; n_logs_used <= n_threads && n_logs_used < n_logs; n_logs_used *= 2) {
+            result_t r;
+            result_init(&r, "threads", "");
+            run_writers(&r, n_threads, n_logs_used, 64, WRITE_ENTRIES / 2, WRITE_TAIL, 0);
+            print_result(&r);
+        }
+    }
+}
+
+#define COMMIT_ENTRIES 2000
+
+// bench_durability has threads write to the first log with each durability.
+// The time includes a ring_log_sync_h at the end.
+static void bench_durability(void) {
+    struct {
+        const char *name;
+        ring_log_durability_t durability;
+        uint32_t group_entries;
+        size_t group_bytes;
+        uint32_t group_ms;
+    } variants[] = {
+        {"none", RING_LOG_DURABILITY_NONE, 0, 0, 0},
+        {"sync", RING_LOG_DURABILITY_SYNC, 0, 0, 0},
+        {"group_64", RING_LOG_DURABILITY_GROUP, 64, 0, 0},
+        {"group_64k", RING_LOG_DURABILITY_GROUP, 0, 65536, 0},
+        {"group_10ms", RING_LOG_DURABILITY_GROUP, 0, 0, 10}
+    };
+    reset(1 << 20, RING_LOG_PROVISION_FILL);
+    ring_log_handle_t log = ring_log_open(logs[0].fn);
+    for (int n_threads = 1; n_threads <= 4; n_threads *= 4) {
+        for (int i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+            log->durability = variants[i].durability;
+            log->group_entries = variants[i].group_entries;
+            log->group_bytes = variants[i].group_bytes;
+            log->group_ms = variants[i].group_ms;
+            result_t r;
+            result_init(&r, "durability", variants[i].name);
+            run_writers(&r, n_threads, 1, 64, COMMIT_ENTRIES, WRITE_TAIL, 1);
+            print_result(&r);
+        }
+    }
+    log->durability = RING_LOG_DURABILITY_NONE;
+}
+
+// The async queue for bench_async.
+#define ASYNC_SLOTS 1024
+#define ASYNC_ENTRY_SIZE 64
+static uint64_t async_queue[RING_LOG_ASYNC_QUEUE_WORDS(ASYNC_SLOTS, ASYNC_ENTRY_SIZE)];
+
+// bench_async has threads write entries to the first log with
+// ring_log_writev, with and without an async queue, with each log
+// durability that doesn't sync in the background anyway. The flusher writes
+// the file header (and syncs) once per batch.
+static void bench_async(void) {
+    static const struct {
+        const char *name;
+        int async;
+        ring_log_durability_t durability;
+    } variants[] = {
+        {"direct_none", 0, RING_LOG_DURABILITY_NONE},
+        {"async_none", 1, RING_LOG_DURABILITY_NONE},
+        {"direct_sync", 0, RING_LOG_DURABILITY_SYNC},
+        {"async_sync", 1, RING_LOG_DURABILITY_SYNC}
+    };
+    for (int i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        // The queue can only come or go while ring_log isn't running.
+        if (started) {
+            ring_log_deinit();
+            started = 0;
+        }
+        logs[0].async_queue = variants[i].async ? async_queue : NULL;
+        logs[0].async_queue_size = sizeof(async_queue);
+        logs[0].async_slots = ASYNC_SLOTS;
+        logs[0].async_entry_size = ASYNC_ENTRY_SIZE;
+        reset(1 << 20, RING_LOG_PROVISION_FILL);
+        logs[0].durability = variants[i].durability;
+        for (int n_threads = 1; n_threads <= 4; n_threads *= 4) {
+            result_t r;
+            result_init(&r, "async", variants[i].name);
+            long entries = variants[i].durability == RING_LOG_DURABILITY_SYNC ? COMMIT_ENTRIES : WRITE_ENTRIES / 2;
+            run_writers(&r, n_threads, 1, 64, entries, WRITE_V, 0);
+            print_result(&r);
+        }
+        logs[0].durability = RING_LOG_DURABILITY_NONE;
+    }
+    ring_log_deinit();
+    started = 0;
+    logs[0].async_queue = NULL;
+}
+
+static int spsc_stopping;
+
+// spsc_reader reads the entries in `arg`'s log as they come, until
+// spsc_stopping.
+static void *spsc_reader(void *arg) {
+    ring_log_handle_t log = arg;
+    char buffer[64];
+    while (!__atomic_load_n(&spsc_stopping, __ATOMIC_ACQUIRE)) {
+        while (ring_log_has_unread_h(log)) {
+            size_t read_total = 0;
+            while (ring_log_read_head_h(log, buffer, sizeof(buffer), &read_total) > 0) {
+            }
+            ring_log_read_head_success_h(log);
+        }
+    }
+    return NULL;
+}
+
+// bench_spsc times one writer thread while another one reads the entries as
+// they come, with the one lock for both, and as an spsc log (see log_t).
+static void bench_spsc(void) {
+    for (int spsc = 0; spsc < 2; spsc++) {
+        // The head lock is only there for logs that were spsc at
+        // ring_log_init -time.
+        if (started) {
+            ring_log_deinit();
+            started = 0;
+        }
+        logs[0].spsc = spsc;
+        reset(65536, RING_LOG_PROVISION_FILL);
+        result_t r;
+        result_init(&r, "spsc", spsc ? "spsc" : "one_lock");
+        pthread_t reader;
+        spsc_stopping = 0;
+        RING_LOG_EXPECT(pthread_create(&reader, NULL, spsc_reader, ring_log_open(logs[0].fn)), 0);
+        run_writers(&r, 1, 1, 64, WRITE_ENTRIES, WRITE_V, 0);
+        __atomic_store_n(&spsc_stopping, 1, __ATOMIC_RELEASE);
+        RING_LOG_EXPECT(pthread_join(reader, NULL), 0);
+        print_result(&r);
+    }
+    ring_log_deinit();
+    started = 0;
+    logs[0].spsc = 0;
+}
+
+// fill_log writes about as many `entry_size` entries as fit into the log
+// (leaving room for their entry headers), and returns how many that was.
+static long fill_log(ring_log_handle_t log, const char *entry, size_t entry_size) {
+    long n = log->capacity / (entry_size + 32);
+    for (long i = 0; i < n; i++) {
+        ring_log_write_tail_h(log, entry, entry_size);
+        ring_log_write_tail_complete_h(log);
+    }
+    return n;
+}
+
+// Drain benchmarks keep filling and draining the log until they've read this
+// many bytes.
+#define DRAIN_BYTES (32L * 1024 * 1024)
+
+// time_drain fills and drains the first log, `chunk` bytes at a time, with
+// ring_log_read_head or a cursor, timing how long each entry takes.
+static void time_drain(result_t *r, size_t entry_size, size_t chunk, int cursor) {
+    ring_log_handle_t log = ring_log_open(logs[0].fn);
+    char *entry = calloc(entry_size, 1);
+    char *buffer = malloc(chunk);
+    r->entry_size = entry_size;
+    r->chunk = chunk;
+    r->capacity = log->capacity;
+    r->logs = r->threads = 1;
+    r->entries = r->secs = r->syscalls = 0;
+    empty(log);
+    while (r->entries * entry_size < DRAIN_BYTES) {
+        fill_log(log, entry, entry_size);
+        unsigned long syscalls_before = syscalls;
+        double start = now();
+        while (ring_log_has_unread_h(log)) {
+            uint64_t entry_start = now_ns();
+            if (cursor) {
+                ring_log_cursor_t c;
+                RING_LOG_EXPECT(ring_log_cursor_begin(log, &c), 1);
+                while (ring_log_cursor_read(&c, buffer, chunk) > 0) {
+                }
+                ring_log_cursor_commit(&c);
+            } else {
+                size_t read_total = 0;
+                while (ring_log_read_head_h(log, buffer, chunk, &read_total) > 0) {
+                }
+                ring_log_read_head_success_h(log);
+            }
+            hist_add(&r->hist, now_ns() - entry_start);
+            r->entries++;
+        }
+        r->secs += now() - start;
+        r->syscalls += syscalls - syscalls_before;
+    }
+    free(entry);
+    free(buffer);
+}
+
+// bench_drain sweeps entry sizes and read chunk sizes. Draining an entry
+// should take time proportional to its size, no matter how small the chunks
+// are that it's read in.
+static void bench_drain(void) {
+    static const size_t chunks[] = {8, 64, 512, 4096, 8192};
+    reset(1 << 20, RING_LOG_PROVISION_FILL);
+    for (int i = 1; i < N_ENTRY_SIZES; i++) {
+        for (int j = 0; j < sizeof(chunks) / sizeof(chunks[0]) && chunks[j] <= entry_sizes[i]; j++) {
+            for (int cursor = 0; cursor < 2; cursor++) {
+                result_t r;
+                result_init(&r, "drain", cursor ? "cursor" : "read_head");
+                time_drain(&r, entry_sizes[i], chunks[j], cursor);
+                print_result(&r);
+            }
+        }
+    }
+}
+
+#define BATCH_ENTRY_SIZE 64
+
+// bench_batch fills the log with small entries, and drains them either an
+// entry at a time or in batches.
+static void bench_batch(void) {
+    static char buffer[16384];
+    static size_t entry_offsets[1025];
+    reset(1 << 20, RING_LOG_PROVISION_FILL);
+    ring_log_handle_t log = ring_log_open(logs[0].fn);
+    for (int batched = 0; batched < 2; batched++) {
+        result_t r;
+        result_init(&r, "batch", batched ? "batched" : "one_by_one");
+        r.entry_size = BATCH_ENTRY_SIZE;
+        r.chunk = batched ? sizeof(buffer) : BATCH_ENTRY_SIZE;
+        r.capacity = log->capacity;
+        r.logs = r.threads = 1;
+        r.entries = r.secs = r.syscalls = 0;
+        while (r.entries * BATCH_ENTRY_SIZE < DRAIN_BYTES) {
+            fill_log(log, buffer, BATCH_ENTRY_SIZE);
+            unsigned long syscalls_before = syscalls;
+            double start = now();
+            if (batched) {
+                int n;
+                while ((n = ring_log_read_batch(log, buffer, sizeof(buffer), entry_offsets, 1024)) > 0) {
+                    ring_log_ack(log, n);
+                    r.entries += n;
+                }
+            } else {
+                while (ring_log_has_unread_h(log)) {
+                    size_t read_total = 0;
+                    while (ring_log_read_head_h(log, buffer, BATCH_ENTRY_SIZE, &read_total) > 0) {
+                    }
+                    ring_log_read_head_success_h(log);
+                    r.entries++;
+                }
+            }
+            r.secs += now() - start;
+            r.syscalls += syscalls - syscalls_before;
+        }
+        print_result(&r);
+    }
+}
+
+// bench_wrap writes and reads back entries one at a time on the first log,
+// whose capacity is a power of two, and on the last log, whose capacity
+// isn't. A power of two wraps with a mask instead of a division.
+static void bench_wrap(void) {
+    reset(65536, RING_LOG_PROVISION_FILL);
+    for (int i = 0; i < n_logs; i += n_logs - 1) {
+        ring_log_handle_t log = ring_log_open(logs[i].fn);
+        char entry[64];
+        memset(entry, 'x', sizeof(entry));
+        result_t r;
+        result_init(&r, "wrap", i == 0 ? "pow2" : "other");
+        unsigned long syscalls_before = syscalls;
+        double start = now();
+        for (int j = 0; j < WRITE_ENTRIES; j++) {
+            uint64_t entry_start = now_ns();
+            ring_log_write_tail_h(log, entry, sizeof(entry));
+            ring_log_write_tail_complete_h(log);
+            size_t read_total = 0;
+            while (ring_log_read_head_h(log, entry, sizeof(entry), &read_total) > 0) {
+            }
+            ring_log_read_head_success_h(log);
+            hist_add(&r.hist, now_ns() - entry_start);
+        }
+        r.secs = now() - start;
+        r.syscalls = syscalls - syscalls_before;
+        r.entry_size = sizeof(entry);
+        r.capacity = log->capacity;
+        r.logs = r.threads = 1;
+        r.entries = WRITE_ENTRIES;
+        print_result(&r);
+    }
+}
+
+#define LOG_LINES 200000
+
+// Compressing needs a buffer twice the size of the staging buffer.
+static char compress_buffer[256];
+
+// log_line makes log line `i`: either a one-off message, or a dump of sensor
+// readings that mostly repeat.
+static int log_line(char *line, size_t size, int i, int dump) {
+    if (!dump) {
+        return snprintf(line, size, "2026-10-17 12:%02i:%02i.%03i sensor %i: temperature %i.%iC, humidity %i%%, ok",
+            i / 60000 % 60, i / 1000 % 60, i % 1000, i % 8, 15 + i % 10, i % 10, 30 + i % 40);
+    }
+    int len = snprintf(line, size, "sensor %i readings:", i % 8);
+    for (int j = 0; j < 12; j++) {
+        len += snprintf(line + len, size - len, " %i.%iC", 21, (i + j) / 5 % 2);
+    }
+    return len;
+}
+
+// time_compression writes LOG_LINES log lines to the first log, with or
+// without compression, and reads back the ones the log holds at the end.
+// Each entry is compressed on its own, so only entries that repeat themselves
+// get any smaller: one-off log lines mostly don't.
+static void time_compression(int dump, int compressed) {
+    static const char *variants[2][2] = {{"lines_off", "lines_on"}, {"dumps_off", "dumps_on"}};
+    ring_log_handle_t log = ring_log_open(logs[0].fn);
+    if (sizeof(compress_buffer) < 2 * log->staging_size) {
+        puts("compress buffer is too small");
+        return;
+    }
+    empty(log);
+    log->compress_buffer = compressed ? compress_buffer : NULL;
+    log->compress_buffer_size = compressed ? sizeof(compress_buffer) : 0;
+
+    char line[128];
+    result_t w;
+    result_init(&w, "compress_write", variants[dump][compressed]);
+    w.capacity = log->capacity;
+    w.logs = w.threads = 1;
+    unsigned long syscalls_before = syscalls;
+    double start = now();
+    for (int i = 0; i < LOG_LINES; i++) {
+        int len = log_line(line, sizeof(line), i, dump);
+        uint64_t entry_start = now_ns();
+        ring_log_write_tail_h(log, line, len);
+        ring_log_write_tail_complete_h(log);
+        hist_add(&w.hist, now_ns() - entry_start);
+    }
+    w.secs = now() - start;
+    w.syscalls = syscalls - syscalls_before;
+    w.entries = LOG_LINES;
+
+    result_t r;
+    result_init(&r, "compress_drain", variants[dump][compressed]);
+    r.capacity = log->capacity;
+    r.logs = r.threads = 1;
+    r.chunk = sizeof(line);
+    r.entries = 0;
+    syscalls_before = syscalls;
+    start = now();
+    while (ring_log_has_unread_h(log)) {
+        uint64_t entry_start = now_ns();
+        size_t read_total = 0;
+        while (ring_log_read_head_h(log, line, sizeof(line), &read_total) > 0) {
+        }
+        ring_log_read_head_success_h(log);
+        hist_add(&r.hist, now_ns() - entry_start);
+        r.entries++;
+    }
+    r.secs = now() - start;
+    r.syscalls = syscalls - syscalls_before;
+    w.entries_kept = r.entries_kept = r.entries;
+
+    print_result(&w);
+    print_result(&r);
+    log->compress_buffer = NULL;
+    log->compress_buffer_size = 0;
+}
+
+static void bench_compression(void) {
+    reset(65536, RING_LOG_PROVISION_FILL);
+    for (int dump = 0; dump < 2; dump++) {
+        time_compression(dump, 0);
+        time_compression(dump, 1);
+    }
+}
+
+// time_printf writes LOG_LINES log lines to the first log, formatted with
+// snprintf or with RING_LOG_PRINTF, and counts how many of them the log holds
+// at the end.
+static void time_printf(int deferred) {
+    ring_log_handle_t log = ring_log_open(logs[0].fn);
+    empty(log);
+
+    result_t r;
+    result_init(&r, "printf", deferred ? "ring_log_printf" : "snprintf");
+    r.capacity = log->capacity;
+    r.logs = r.threads = 1;
+    unsigned long syscalls_before = syscalls;
+    double start = now();
+    for (int i = 0; i < LOG_LINES; i++) {
+        uint64_t entry_start = now_ns();
+        if (deferred) {
+            RING_LOG_PRINTF(log, "2026-10-17 12:%02i:%02i.%03i sensor %i: temperature %.1fC, humidity %i%%, %s",
+                i / 60000 % 60, i / 1000 % 60, i % 1000, i % 8, 15 + i % 100 / 10.0, 30 + i % 40, "ok");
+        } else {
+            char line[128];
+            int len = snprintf(line, sizeof(line), "2026-10-17 12:%02i:%02i.%03i sensor %i: temperature %.1fC, humidity %i%%, %s",
+                i / 60000 % 60, i / 1000 % 60, i % 1000, i % 8, 15 + i % 100 / 10.0, 30 + i % 40, "ok");
+            ring_log_write_tail_h(log, line, len);
+            ring_log_write_tail_complete_h(log);
+        }
+        hist_add(&r.hist, now_ns() - entry_start);
+    }
+    r.secs = now() - start;
+    r.syscalls = syscalls - syscalls_before;
+    r.entries = LOG_LINES;
+    r.entries_kept = log->file_header.tail_seq - log->file_header.head_seq;
+    print_result(&r);
+}
+
+static void bench_printf(void) {
+    reset(65536, RING_LOG_PROVISION_FILL);
+    time_printf(0);
+    time_printf(1);
+}
+
+// bench_provision times creating all of the ring log files from scratch,
+// until the first entry is written, with each way of provisioning them.
+static void bench_provision(void) {
+    static const struct {
+        const char *name;
+        ring_log_provision_t provision;
+    } variants[] = {
+        {"fill", RING_LOG_PROVISION_FILL},
+        {"fallocate", RING_LOG_PROVISION_FALLOCATE},
+        {"sparse", RING_LOG_PROVISION_SPARSE}
+    };
+    for (int i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        result_t r;
+        result_init(&r, "provision", variants[i].name);
+        unsigned long syscalls_before = syscalls;
+        r.secs = reset(1 << 20, variants[i].provision);
+        r.syscalls = syscalls - syscalls_before;
+        r.capacity = logs[0].capacity;
+        r.logs = n_logs;
+        r.entries = 1;
+        print_result(&r);
+    }
+}
+
+int main(int argc, char **argv) {
+    json = argc > 1 && strcmp(argv[1], "json") == 0;
+    if (argc > 2 && chdir(argv[2]) != 0) {
+        perror("chdir");
+        return 1;
+    }
+
+    print_header();
+    bench_provision();
+    bench_write();
+    bench_writev();
+    bench_threads();
+    bench_durability();
+    bench_async();
+    bench_spsc();
+    bench_drain();
+    bench_batch();
+    bench_wrap();
+    bench_compression();
+    bench_printf();
+
+    ring_log_deinit();
+    for (int i = 0; i < n_logs; i++) {
+        unlink(logs[i].fn);
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "ring_log.h"
+
+// The benchmark gets a log per writer thread, all set up the same way, plus
+// one whose capacity isn't a power of two, to compare wrapping with a division
+// against wrapping with a mask. bench.c sweeps ring sizes by changing the
+// capacities before ring_log_init, up to BENCH_CAPACITY.
+#define BENCH_CAPACITY (1 << 20)
+
+#define BENCH_LOG_BUFFERS(n) \
+    static char log_##n##_staging[128]; \
+    static ring_log_index_entry_t log_##n##_index[1024];
+
+#define BENCH_LOG(n, ring_capacity) \
+    { \
+        .fn = "bench_log_" #n, \
+        .capacity = ring_capacity, \
+        .staging = log_##n##_staging, .staging_size = sizeof(log_##n##_staging), \
+        .index = log_##n##_index, .index_size = sizeof(log_##n##_index) / sizeof(log_##n##_index[0]) \
+    }
+
+BENCH_LOG_BUFFERS(0)
+BENCH_LOG_BUFFERS(1)
+BENCH_LOG_BUFFERS(2)
+BENCH_LOG_BUFFERS(3)
+BENCH_LOG_BUFFERS(4)
+BENCH_LOG_BUFFERS(5)
+BENCH_LOG_BUFFERS(6)
+BENCH_LOG_BUFFERS(7)
+BENCH_LOG_BUFFERS(8)
+
+log_t logs[] = {
+    BENCH_LOG(0, BENCH_CAPACITY),
+    BENCH_LOG(1, BENCH_CAPACITY),
+    BENCH_LOG(2, BENCH_CAPACITY),
+    BENCH_LOG(3, BENCH_CAPACITY),
+    BENCH_LOG(4, BENCH_CAPACITY),
+    BENCH_LOG(5, BENCH_CAPACITY),
+    BENCH_LOG(6, BENCH_CAPACITY),
+    BENCH_LOG(7, BENCH_CAPACITY),
+    BENCH_LOG(8, BENCH_CAPACITY - 8)
+};
+
+#define N_LOGS (sizeof(logs) / sizeof(logs[0]))
+const int n_logs = N_LOGS;
+
+#define LOGS_PARTITION_SIZE (N_LOGS * 1311000)
+const off_t logs_partition_size = LOGS_PARTITION_SIZE;
+
+// The logs only get to use 80% of the partition (see ring_log_config.c). They
+// have no header journals or consumers, so their files are just the rings and
+// file headers; ring_log_init checks that again for the capacities bench.c
+// sets.
+RING_LOG_STATIC_ASSERT(N_LOGS * RING_LOG_FILE_SIZE(BENCH_CAPACITY) <= LOGS_PARTITION_SIZE * 8 / 10, logs_fit_in_partition);
+
+const int provision_in_parallel = 1;
+
+const ring_log_msync_t msync_policy = RING_LOG_MSYNC_NONE;
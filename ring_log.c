@@ -1,37 +1,93 @@
+// pwrite is POSIX.1-2008.
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "ring_log.h"
 
+// Which CRC32C instructions there might be, see crc_update_hw.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC_ARMV8
+#include <arm_acle.h>
+#endif
+
 extern log_t logs[];
 extern const int n_logs;
-extern const int log_size;
-extern uint8_t filler_byte;
+extern const off_t logs_partition_size;
+extern const int provision_in_parallel;
+
+// With RING_LOG_STATS, the counters in `log->stats` are kept up to date (see
+// ring_log_get_stats) with relaxed atomics, so that reading them never has to
+// wait for the lock. STATS_MAX is only used with the lock taken. Without
+// RING_LOG_STATS, they compile out.
+#ifdef RING_LOG_STATS
+#define STATS_ADD(log, counter, n) __atomic_fetch_add(&(log)->stats.counter, (n), __ATOMIC_RELAXED)
+#define STATS_MAX(log, counter, v) \
+    do { \
+        uint64_t stats_v = (v); \
+        if (stats_v > __atomic_load_n(&(log)->stats.counter, __ATOMIC_RELAXED)) { \
+            __atomic_store_n(&(log)->stats.counter, stats_v, __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+#else
+#define STATS_ADD(log, counter, n) (void)0
+#define STATS_MAX(log, counter, v) (void)0
+#endif
 
-static int read_all(int fd, char *p, size_t len) {
-    ssize_t have_read = 0;
-    while (have_read < len) {
-        ssize_t ret = read(fd, p + have_read, len - have_read);
-        if (ret == -1) {
-            if (errno != EINTR) {
-                RING_LOG_ERROR("errno != EINTR");
-                return 0;
-            }
-        } else if (ret == 0) {
-            RING_LOG_ERROR("unexpected EOF");
-            return 0;
-        } else {
-            have_read += ret;
-        }
+// take_mutex takes one of the log's mutexes, and counts how long that took.
+static void take_mutex(log_t *log, void *mutex) {
+#ifdef RING_LOG_STATS
+    uint64_t start = ring_log_arch_now_us();
+    ring_log_arch_take_mutex(mutex);
+    STATS_ADD(log, lock_acquisitions, 1);
+    STATS_ADD(log, lock_wait_us, ring_log_arch_now_us() - start);
+#else
+    ring_log_arch_take_mutex(mutex);
+#endif
+}
+
+// lock takes the log's mutex.
+static void lock(log_t *log) {
+    take_mutex(log, log->mutex);
+}
+
+// lock_head takes the head_mutex of an spsc log (see log_t), which the writer
+// needs on top of the log's mutex to work with the head or the index. Other
+// logs only have the one mutex, which it has already.
+static void lock_head(log_t *log) {
+    if (log->spsc) {
+        take_mutex(log, log->head_mutex);
     }
-    return 1;
 }
 
-static int write_all(int fd, char *p, size_t len) {
+static void unlock_head(log_t *log) {
+    if (log->spsc) {
+        ring_log_arch_free_mutex(log->head_mutex);
+    }
+}
+
+// lock_read takes the mutex that readers take: the head_mutex of an spsc log,
+// and the log's mutex otherwise.
+static void lock_read(log_t *log) {
+    take_mutex(log, log->spsc ? log->head_mutex : log->mutex);
+}
+
+static void unlock_read(log_t *log) {
+    ring_log_arch_free_mutex(log->spsc ? log->head_mutex : log->mutex);
+}
+
+static int pwrite_all(int fd, off_t off, const char *p, size_t len) {
     ssize_t written = 0;
     while (written < len) {
-        ssize_t ret = write(fd, p + written, len - written);
+        ssize_t ret = pwrite(fd, p + written, len - written, off + written);
         if (ret == -1) {
             if (errno != EINTR) {
                 RING_LOG_ERROR("errno != EINTR");
@@ -44,17 +100,13 @@ static int write_all(int fd, char *p, size_t len) {
     return 1;
 }
 
-static int seek_abs(log_t *log, off_t off) {
-    if (off < 0) {
-        RING_LOG_ERROR("off < 0");
-        return 0;
-    }
-    if (off >= log_size) {
-        RING_LOG_ERROR("off >= LOG_SIZE");
+static int check_off(const log_t *log, off_t off) {
+    if (off < sizeof(file_header_t)) {
+        RING_LOG_ERROR("off < sizeof(file_header_t)");
         return 0;
     }
-    if (lseek(log->fd, off, SEEK_SET) == -1) {
-        RING_LOG_ERROR("lseek failed");
+    if (off >= RING_LOG_FILE_SIZE(log->capacity)) {
+        RING_LOG_ERROR("off >= RING_LOG_FILE_SIZE(capacity)");
         return 0;
     }
     return 1;
@@ -64,408 +116,3004 @@ static int has_unread(log_t *log) {
     return log->file_header.head != log->file_header.tail;
 }
 
-// read_wrap reads up to `len` bytes into `p`. The reads will wrap around the
-// end of the log, and skip over the file header. read_wrap will return the
-// offset after the last byte read. If there is any kind of error, it will
-// return -1.
-static int read_wrap(log_t *log, char *p, size_t len) {
-    // Find where we are in the file right now.
-    off_t off = lseek(log->fd, 0, SEEK_CUR);
-    if (off == -1) {
-        RING_LOG_ERROR("lseek failed");
-        return -1;
+// reader_tail returns where the entries that are there to be read end: for an
+// spsc log, where the writer last published the tail (see log_t), and the
+// tail itself otherwise.
+static off_t reader_tail(log_t *log) {
+    if (log->spsc) {
+        return __atomic_load_n(&log->published_tail, __ATOMIC_ACQUIRE);
     }
+    return log->file_header.tail;
+}
 
-    for (size_t i = 0; i < len || off < sizeof(file_header_t); ) {
-        // Don't read from the file header.
-        if (off >= sizeof(file_header_t)) {
-            // Read one byte..
-            ssize_t ret;
-        retry:
-            if (p == NULL) {
-                char c;
-                ret = read(log->fd, &c, 1);
-            } else {
-                ret = read(log->fd, p + i, 1);
-            }
-            if (ret == -1) {
-                if (errno != EINTR) {
-                    RING_LOG_ERROR("errno != EINTR");
-                    return -1;
-                }
-                goto retry;
-            } else if (ret == 0) {
-                RING_LOG_ERROR("got unexpected EOF");
-                return -1;
-            } else if (ret != 1) {
-                RING_LOG_ERROR("got ret != 1");
-                return -1;
-            }
-            i++;
-        }
+// has_readable is has_unread for readers, see reader_tail.
+static int has_readable(log_t *log) {
+    return log->file_header.head != reader_tail(log);
+}
 
-        off_t new_off = (off + 1) % log_size;
-        if (!seek_abs(log, new_off)) {
-            RING_LOG_ERROR("seek_abs failed");
-        }
-        off = new_off;
+// Entry lengths are stored as varints: 7 bits of the length per byte, lowest
+// bits first, with the top bit set in every byte but the last. So entries of
+// up to 127 bytes only take one byte of header. An entry that is written
+// straight into the file doesn't know its length up front, so its header is
+// padded out to VARINT_MAX bytes, with extra bytes that add zero bits.
+#define VARINT_MAX 10
+
+static int varint_len(uint64_t v) {
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
     }
+    return n;
+}
 
-    return off;
+// varint_put stores `v` in `width` bytes at `p`, where `width` is at least
+// varint_len(v).
+static void varint_put(char *p, uint64_t v, int width) {
+    for (int i = 0; i < width - 1; i++) {
+        p[i] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[width - 1] = v;
 }
 
-// write_wrap writes (unless error) `len` bytes from `p`. The writes will wrap
-// around the end of the log, and skip over the file header. If there is any
-// error, write_wrap returns -1. Otherwise, it will return the offset after the
-// last byte written.
-static off_t write_wrap(log_t *log, int is_entry, const char *p, size_t len) {
-    // Find where we are in the file right now.
-    off_t off = lseek(log->fd, 0, SEEK_CUR);
-    if (off == -1) {
-        RING_LOG_ERROR("lseek failed");
-        return -1;
+// varint_get reads the varint at `p` into `v`, and returns how many bytes it
+// took up, or 0 if it isn't a valid varint.
+static int varint_get(const char *p, uint64_t *v) {
+    *v = 0;
+    for (int i = 0; i < VARINT_MAX; i++) {
+        uint8_t b = p[i];
+        *v |= (uint64_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            return i + 1;
+        }
     }
+    return 0;
+}
 
-    for (size_t i = 0; i < len; ) {
-        // Don't write over the file header.
-        if (off >= sizeof(file_header_t)) {
-            // If we've reached the head entry and `is_entry`, then take a
-            // detour and first set the new head to the entry after current
-            // head entry.
-            if (is_entry) {
-                if ((off == log->file_header.head) && has_unread(log)) {
-                    // Figure out where the next entry starts and store that new head in the header.
-                    entry_header_t entry_header;
-                    RING_LOG_EXPECT_NOT(read_wrap(log, (void *)&entry_header, sizeof(entry_header)), -1);
-                    uint16_t old_head = log->file_header.head;
-                    log->file_header.head = read_wrap(log, NULL, entry_header.len);
-                    RING_LOG_EXPECT_NOT(lseek(log->fd, 0, SEEK_SET), -1);
-                    RING_LOG_EXPECT_NOT(write_all(log->fd, (void *)&(log->file_header), sizeof(log->file_header)), 0);
-
-                    // Seek back to the voided (old) head so we can reuse that space.
-                    RING_LOG_EXPECT(seek_abs(log, old_head), 1);
-                }
-            }
+// After the length, the entry header has the sequence number and the CRC.
+#define ENTRY_HEADER_MAX (VARINT_MAX + 2 * sizeof(uint32_t))
 
-            // Write one byte..
-            ssize_t ret;
-        retry:
-            ret = write(log->fd, p + i, 1);
-            if (ret == -1) {
-                if (errno != EINTR) {
-                    RING_LOG_ERROR("errno != EINTR");
-                    return -1;
-                }
-                goto retry;
-            } else if (ret == 0) {
-                RING_LOG_ERROR("got unexpected EOF");
-                return -1;
-            } else if (ret != 1) {
-                RING_LOG_ERROR("got ret != 1");
-                return -1;
-            }
-            i++;
-        }
+// length_field is what the entry header stores as the length: the length
+// itself, and whether the entry is compressed in the lowest bit.
+static uint64_t length_field(const entry_header_t *entry_header) {
+    return entry_header->len << 1 | (entry_header->compressed != 0);
+}
 
-        // Maybe seek around to the start of the ring file.
-        off_t new_off = (off + 1) % log_size;
-        if (!seek_abs(log, new_off)) {
-            RING_LOG_ERROR("seek_abs failed");
-            return -1;
-        }
-        off = new_off;
+// The continued bit of a piece of a chained entry (see entry_header_t) goes
+// in the last byte of a VARINT_MAX-wide length, right above the 64 bits of the
+// length field, where version 1 lengths only ever have zeroes.
+#define CONTINUED_BIT 0x02
+
+// put_entry_header stores the entry header at `p`, with the length taking up
+// `width` bytes (0 for as few as possible), and returns how many bytes the
+// whole header took up.
+static int put_entry_header(char *p, const entry_header_t *entry_header, int width) {
+    if (entry_header->continued) {
+        width = VARINT_MAX;
+    } else if (width == 0) {
+        width = varint_len(length_field(entry_header));
     }
-
-    return off;
+    varint_put(p, length_field(entry_header), width);
+    if (entry_header->continued) {
+        p[VARINT_MAX - 1] |= CONTINUED_BIT;
+    }
+    memcpy(p + width, &entry_header->seq, sizeof(entry_header->seq));
+    memcpy(p + width + sizeof(entry_header->seq), &entry_header->crc, sizeof(entry_header->crc));
+    return width + sizeof(entry_header->seq) + sizeof(entry_header->crc);
 }
 
-int ring_log_init(void) {
-    ring_log_arch_init();
+// get_entry_header reads the entry header at `p`, and returns how many bytes
+// it took up, or 0 if it isn't a valid entry header.
+static int get_entry_header(const char *p, entry_header_t *entry_header) {
+    uint64_t field;
+    int width = varint_get(p, &field);
+    if (width == 0) {
+        return 0;
+    }
+    entry_header->len = field >> 1;
+    entry_header->compressed = field & 1;
+    entry_header->continued = width == VARINT_MAX && (p[VARINT_MAX - 1] & CONTINUED_BIT);
+    memcpy(&entry_header->seq, p + width, sizeof(entry_header->seq));
+    memcpy(&entry_header->crc, p + width + sizeof(entry_header->seq), sizeof(entry_header->crc));
+    return width + sizeof(entry_header->seq) + sizeof(entry_header->crc);
+}
 
-    // For each of the logs,
-    for (int i = 0; i < n_logs; i++) {
+// Entries are checked with a CRC32C, worked out with the CPU's CRC32C
+// instructions if it has any, and with a table otherwise. While the CRC of an
+// entry is being worked out, it starts off as CRC_INIT, and gets updated with
+// crc_update and finished off with entry_crc.
+#define CRC_INIT 0xffffffff
 
-        // .. open the file.
-        int fd = open(logs[i].fn, O_RDWR);
-        if (fd == -1) {
-            // If we have to create the file, first write out the header.
-            fd = open(logs[i].fn, O_RDWR | O_CREAT | O_EXCL, 0666);
-            if (fd == -1) {
-                RING_LOG_ERROR("couldn't create ring log file");
-                return 0;
-            }
-            logs[i].file_header.head = logs[i].file_header.tail = sizeof(logs[i].file_header);
-            if (!write_all(fd, (void *)&logs[i].file_header, sizeof(logs[i].file_header))) {
-                RING_LOG_ERROR("couldn't write ring log file header");
-                return 0;
-            }
-            ssize_t written = sizeof(logs[i].file_header);
-
-            // Then write enough zeroes to get the file to the right size.
-            while (written < log_size) {
-                ssize_t ret = write(fd, &filler_byte, 1);
-                if (ret == -1) {
-                    if (errno != EINTR) {
-                        RING_LOG_ERROR("errno != EINTR");
-                        return 0;
-                    }
-                } else {
-                    written += ret;
-                }
-            }
+static uint32_t crc_table[256];
 
-            // Close the file, otherwise the fs might now actually save the file size.
-            close(fd);
-            fd = open(logs[i].fn, O_RDWR);
-            if (fd == -1) {
-                RING_LOG_ERROR("wasn't able to reopen ring log file");
-                return 0;
-            }
+static void crc_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
         }
+        crc_table[i] = crc;
+    }
+}
 
-        // Check that the file is the right size.
-        if (lseek(fd, 0, SEEK_END) != log_size) {
-            RING_LOG_ERROR("ring log file is not the right size");
-            return 0;
-        }
+static uint32_t crc_update_table(uint32_t crc, const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ (uint8_t)p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
 
-        // Read in the header and set up per-log variables.
-        logs[i].fd = fd;
-        if (lseek(logs[i].fd, 0, SEEK_SET) == -1) {
-            RING_LOG_ERROR("lseek failed");
-            return 0;
-        }
-        if (!read_all(logs[i].fd, (void *)&(logs[i].file_header), sizeof(logs[i].file_header))) {
-            RING_LOG_ERROR("couldn't read ring log file header");
-            return 0;
-        }
-        logs[i].new_tail_started = 0;
-        logs[i].new_tail_failed = 0;
+#if defined(CRC_SSE42)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_hw(uint32_t crc, const char *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = crc64;
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
     }
+    return crc;
+}
 
-    return 1;
+static int crc_have_hw(void) {
+    return __builtin_cpu_supports("sse4.2");
 }
 
-void ring_log_deinit(void) {
-    // Close each of the log files.
-    for (int i = 0; i < n_logs; i++) {
-        close(logs[i].fd);
+#elif defined(CRC_ARMV8)
+
+static uint32_t crc_update_hw(uint32_t crc, const char *p, size_t len) {
+    for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
     }
+    for (; len > 0; p++, len--) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
 
-    ring_log_arch_deinit();
+static int crc_have_hw(void) {
+    return 1;
 }
 
-static int strcmp(const char *p1, const char *p2) {
-    if (p1 == NULL || p2 == NULL) {
-        RING_LOG_ERROR("NULL inputs");
-        return -1;
-    }
+#else
 
-    while (1) {
-        if (*p1 == '\0' && *p2 == '\0') {
-            return 0;
-        }
-        if (*p1 != *p2) {
-            return (int)*p2 - (int)*p1;
-        }
-        p1++;
-        p2++;
-    }
+#define crc_update_hw crc_update_table
 
+static int crc_have_hw(void) {
     return 0;
 }
 
-static log_t *lock_and_find_log(const char *log_fn) {
-    // Lock: only one task works with the log at a time.
-    ring_log_arch_take_mutex();
+#endif
 
-    // Find the fd for this log.
-    for (int i = 0; i < n_logs; i++) {
-        if (!strcmp(logs[i].fn, log_fn)) {
-            return &logs[i];
-        }
+// Set up by ring_log_init.
+static uint32_t (*crc_update)(uint32_t, const char *, size_t) = crc_update_table;
+
+// entry_crc finishes off the CRC of an entry's contents with the length field
+// and sequence number from its header, and whether it's continued, if it is.
+static uint32_t entry_crc(uint32_t crc, const entry_header_t *entry_header) {
+    uint64_t field = length_field(entry_header);
+    crc = crc_update(crc, (void *)&field, sizeof(field));
+    crc = crc_update(crc, (void *)&entry_header->seq, sizeof(entry_header->seq));
+    if (entry_header->continued) {
+        uint8_t continued = CONTINUED_BIT;
+        crc = crc_update(crc, (void *)&continued, sizeof(continued));
     }
+    return ~crc;
+}
 
-    RING_LOG_ERROR("didn't find the struct corresponding to log");
-    return NULL;
+// The entries live in the ring between the end of the file header and the end
+// of the file, which is `log->capacity` bytes long. wrap returns where `pos`
+// bytes into the ring ends up, wrapping around the end of the ring. That's a
+// mask rather than a division if the capacity is a power of two, and with
+// RING_LOG_POW2_CAPACITY (where all capacities have to be) there isn't even a
+// branch.
+static uint64_t wrap(const log_t *log, uint64_t pos) {
+#ifdef RING_LOG_POW2_CAPACITY
+    return pos & (log->capacity - 1);
+#else
+    return log->ring_mask ? pos & log->ring_mask : pos % log->capacity;
+#endif
 }
 
-void ring_log_write_tail(const char *log_fn, const void *p, size_t len) {
-    log_t *log = lock_and_find_log(log_fn);
+// advance returns the offset `len` bytes after `off`, wrapping around the end
+// of the log and skipping over the file header.
+static off_t advance(const log_t *log, off_t off, size_t len) {
+    return sizeof(file_header_t) + wrap(log, off - sizeof(file_header_t) + len);
+}
 
-    if (log->new_tail_failed) {
-        // If we got an error earlier, stop here.
-        goto exit;
-    }
+// distance returns how many bytes have to be advanced over to get from `from`
+// to `to`.
+static off_t distance(const log_t *log, off_t from, off_t to) {
+    return wrap(log, to - from + log->capacity);
+}
 
-    // If a new tail entry has already been started,
-    if (log->new_tail_started) {
-        // .. then seek to the end of the new tail.
-        if (!seek_abs(log, log->new_tail_end_offset)) {
-            RING_LOG_ERROR("seek_abs failed");
-            goto exit;
-        }
-    } else {
-        // Otherwise, seek to the tail and start a new tail entry.
-        if (!seek_abs(log, log->file_header.tail)) {
-            RING_LOG_ERROR("seek_abs failed");
-            goto exit;
-        }
-        log->new_tail_header.len = 0;
-        log->new_tail_started = 1;
-        log->new_tail_failed = 0;
-        entry_header_t *tail_header = &(log->new_tail_header);
-        if ((log->new_tail_end_offset = write_wrap(log, 1, (void *)tail_header, sizeof(*tail_header))) == -1) {
-            log->new_tail_failed = 1;
-            goto exit;
-        }
+// pad returns where the next entry goes after one that ends at `off`: right
+// there, or with a `program_page`, at the next page boundary in the file
+// (wrapping around to the first one in the ring).
+static off_t pad(const log_t *log, off_t off) {
+    if (log->program_page == 0) {
+        return off;
     }
-
-    // Write into the new tail.
-    off_t off;
-    if ((off = write_wrap(log, 1, p, len)) == -1) {
-        log->new_tail_failed = 1;
-        goto exit;
+    off_t padded = RING_LOG_ALIGN(off, (off_t)log->program_page);
+    if (padded >= RING_LOG_FILE_SIZE(log->capacity)) {
+        padded = RING_LOG_ALIGN((off_t)sizeof(file_header_t), (off_t)log->program_page);
     }
-    log->new_tail_end_offset = off;
-    log->new_tail_header.len += len;
+    return padded;
+}
 
-exit:
-    ring_log_arch_free_mutex();
+// next_entry returns where the entry after the one whose contents start at
+// `contents` and are `len` bytes long starts.
+static off_t next_entry(const log_t *log, off_t contents, uint64_t len) {
+    return pad(log, advance(log, contents, len));
 }
 
-void ring_log_write_tail_complete(const char *log_fn) {
-    log_t *log = lock_and_find_log(log_fn);
+// header_slot_off returns where header slot `n` of a log with a header
+// journal is.
+static off_t header_slot_off(const log_t *log, uint64_t n) {
+    return RING_LOG_JOURNAL_OFF(log->capacity, (off_t)log->program_page) +
+        (off_t)(n % log->header_slots) * RING_LOG_HEADER_SLOT_SIZE((off_t)log->program_page);
+}
 
-    // We didn't start a tail entry, so don't do anything.
-    if (!log->new_tail_started) {
-        goto exit;
+static uint32_t header_slot_crc(const ring_log_header_slot_t *slot) {
+    return ~crc_update(CRC_INIT, (void *)slot, offsetof(ring_log_header_slot_t, crc));
+}
+
+// stable_tail returns where the entries are known to end, in `*off` and
+// `*seq`: the tail, or while an entry is being written in pieces (see
+// entry_header_t), where its first piece starts. Checking entries from there
+// on (see recover) then sees all of its pieces.
+static void stable_tail(const log_t *log, off_t *off, uint64_t *seq) {
+    if (log->chaining) {
+        *off = log->chain_start;
+        *seq = log->chain_seq;
+    } else {
+        *off = log->file_header.tail;
+        *seq = log->file_header.tail_seq;
     }
+}
 
-    log->new_tail_started = 0;
+// snap_head takes note of where the head is, for the file headers that the
+// writer of an spsc log writes (see write_file_header). It has to be called
+// with the head_mutex taken.
+static void snap_head(log_t *log) {
+    log->header_head = log->file_header.head;
+    log->header_head_seq = log->file_header.head_seq;
+}
 
-    // If we started a new tail entry, but we ran into an error, then just
-    // abandon the new tail entry.
-    if (log->new_tail_failed) {
-        log->new_tail_failed = 0;
-        goto exit;
+static int write_file_header(log_t *log) {
+    // Without syncs, there's nothing better to go by than the tail itself.
+    if (log->durability == RING_LOG_DURABILITY_NONE) {
+        off_t tail;
+        stable_tail(log, &tail, &log->file_header.good_seq);
+        log->file_header.good_tail = tail;
+    } else {
+        log->file_header.good_tail = log->synced_tail;
+        log->file_header.good_seq = log->synced_seq;
     }
 
-    // Update the size in the log entry's header.
-    RING_LOG_EXPECT_NOT(seek_abs(log, log->file_header.tail), 0);
-    RING_LOG_EXPECT_NOT(write_wrap(log, 0, (void *)&(log->new_tail_header), sizeof(log->new_tail_header)), -1);
-
-    // Update the tail in the log's header.
-    log->file_header.tail = log->new_tail_end_offset;
-    RING_LOG_EXPECT_NOT(lseek(log->fd, 0, SEEK_SET), -1);
-    RING_LOG_EXPECT_NOT(write_all(log->fd, (void *)&(log->file_header), sizeof(log->file_header)), 0);
+    // The reader of an spsc log moves the head without the log's mutex, so
+    // the writer goes by the head as of the last snap_head. That's never
+    // ahead of the reader, and make_room never writes over it.
+    file_header_t file_header = {
+        .magic = log->file_header.magic,
+        .version = log->file_header.version,
+        .head = log->spsc ? log->header_head : log->file_header.head,
+        .tail = log->file_header.tail,
+        .head_seq = log->spsc ? log->header_head_seq : log->file_header.head_seq,
+        .tail_seq = log->file_header.tail_seq,
+        .good_tail = log->file_header.good_tail,
+        .good_seq = log->file_header.good_seq
+    };
+    STATS_ADD(log, io_calls, 1);
+    if (log->header_slots == 0) {
+        return ring_log_io_write(log, 0, (void *)&file_header, sizeof(file_header));
+    }
 
-exit:
-    ring_log_arch_free_mutex();
+    // With a header journal, the file header goes in the oldest slot.
+    ring_log_header_slot_t slot;
+    memset(&slot, 0, sizeof(slot));
+    slot.file_header = file_header;
+    slot.seq = ++log->header_seq;
+    slot.program_page = log->program_page;
+    slot.crc = header_slot_crc(&slot);
+    return ring_log_io_write(log, header_slot_off(log, slot.seq), (void *)&slot, sizeof(slot));
 }
 
-int ring_log_has_unread(const char *log_fn) {
-    log_t *log = lock_and_find_log(log_fn);
-
-    int ret = has_unread(log);
-
-    ring_log_arch_free_mutex();
+// read_journal reads the header slots of a log with a header journal, and
+// takes the newest one that checks out (if any) as the file header. It
+// returns 0 on error.
+static int read_journal(log_t *log) {
+    log->header_seq = 0;
+    for (uint32_t i = 0; i < log->header_slots; i++) {
+        ring_log_header_slot_t slot;
+        STATS_ADD(log, io_calls, 1);
+        if (!ring_log_io_read(log, header_slot_off(log, i), (void *)&slot, sizeof(slot))) {
+            RING_LOG_ERROR("ring_log_io_read failed");
+            return 0;
+        }
+        if (slot.file_header.magic != RING_LOG_MAGIC || slot.crc != header_slot_crc(&slot) ||
+            slot.seq <= log->header_seq) {
+            continue;
+        }
+        if (slot.program_page != log->program_page) {
+            RING_LOG_ERROR("ring log file was written with a different program page");
+            return 0;
+        }
+        log->header_seq = slot.seq;
+        log->file_header = slot.file_header;
+    }
+    return 1;
+}
 
-    return ret;
+// consumer_slot_off returns where the slot of the log's consumer `n` is.
+static off_t consumer_slot_off(const log_t *log, size_t n) {
+    return RING_LOG_CONSUMERS_OFF(log->capacity, (off_t)log->header_slots, (off_t)log->program_page) +
+        (off_t)n * RING_LOG_CONSUMER_SLOT_SIZE((off_t)log->program_page);
 }
 
-int ring_log_read_head(const char *log_fn, void *p, size_t len, size_t *read_total) {
-    log_t *log = lock_and_find_log(log_fn);
+static uint32_t consumer_slot_crc(const ring_log_consumer_slot_t *slot) {
+    return ~crc_update(CRC_INIT, (void *)slot, offsetof(ring_log_consumer_slot_t, crc));
+}
 
-    // There is an entry to be read if head != tail.
-    if (!has_unread(log)) {
-        RING_LOG_ERROR("there is no entry to read, use ring_log_has_unread() first");
-        goto fail;
+// store_consumer stores where a consumer has got to in its slot. It returns
+// 0 on error.
+static int store_consumer(log_t *log, const ring_log_consumer_t *consumer) {
+    ring_log_consumer_slot_t slot;
+    memset(&slot, 0, sizeof(slot));
+    memcpy(slot.name, consumer->name, strlen(consumer->name));
+    slot.off = consumer->off;
+    slot.seq = consumer->seq;
+    slot.lost = consumer->lost;
+    slot.crc = consumer_slot_crc(&slot);
+    STATS_ADD(log, io_calls, 1);
+    if (!ring_log_io_write(log, consumer_slot_off(log, consumer - log->consumers), (void *)&slot, sizeof(slot))) {
+        RING_LOG_ERROR("ring_log_io_write failed");
+        return 0;
     }
+    ring_log_io_flush(log);
+    return 1;
+}
 
-    // Seek to the head and read in the size of the entry.
-    if (!seek_abs(log, log->file_header.head)) {
-        RING_LOG_ERROR("seek_abs failed");
-        goto fail;
+// load_consumer picks the log's consumer `n` up where its slot says it got
+// to, or at the head if the slot doesn't check out. It returns 0 on error.
+static int load_consumer(log_t *log, size_t n) {
+    ring_log_consumer_t *consumer = &log->consumers[n];
+    ring_log_consumer_slot_t slot;
+    STATS_ADD(log, io_calls, 1);
+    if (!ring_log_io_read(log, consumer_slot_off(log, n), (void *)&slot, sizeof(slot))) {
+        RING_LOG_ERROR("ring_log_io_read failed");
+        return 0;
     }
-    entry_header_t entry_header;
-    if (read_wrap(log, (void *)&entry_header, sizeof(entry_header)) == -1) {
-        RING_LOG_ERROR("read_wrap failed");
-        goto fail;
+    consumer->log = log;
+    consumer->off = log->file_header.head;
+    consumer->seq = log->file_header.head_seq;
+    consumer->lost = 0;
+    if (slot.crc == consumer_slot_crc(&slot) && strncmp(slot.name, consumer->name, sizeof(slot.name)) == 0) {
+        consumer->lost = slot.lost;
+        if (slot.seq >= log->file_header.tail_seq) {
+            // It had read every entry there is (and maybe some that didn't
+            // make it through the last run).
+            consumer->off = log->file_header.tail;
+            consumer->seq = log->file_header.tail_seq;
+        } else if (slot.seq < log->file_header.head_seq) {
+            consumer->lost += log->file_header.head_seq - slot.seq;
+        } else if (slot.off >= sizeof(file_header_t) && slot.off < RING_LOG_FILE_SIZE(log->capacity)) {
+            consumer->off = slot.off;
+            consumer->seq = slot.seq;
+        }
     }
+    consumer->next_seq = consumer->seq;
+    return 1;
+}
 
-    // If we haven't read in the whole entry,
-    size_t remaining = entry_header.len - *read_total;
-    if (remaining > 0) {
-        // .. first, skip past stuff that we have read already.
-        if (read_wrap(log, NULL, *read_total) == -1) {
-            RING_LOG_ERROR("read_wrap failed");
-            goto fail;
+// read_wrap reads `len` bytes starting at `off` into `p`. The reads will wrap
+// around the end of the log, and skip over the file header, so there are at
+// most two pread calls. If `p` is NULL, nothing is read and only the offset is
+// advanced. read_wrap will return the offset after the last byte read. If
+// there is any kind of error, it will return -1.
+static off_t read_wrap(log_t *log, off_t off, char *p, size_t len) {
+    if (!check_off(log, off)) {
+        RING_LOG_ERROR("check_off failed");
+        return -1;
+    }
+
+    if (p != NULL) {
+        for (size_t i = 0; i < len; ) {
+            // Read up to the end of the file, then carry on after the header.
+            size_t now = RING_LOG_FILE_SIZE(log->capacity) - off;
+            if (now > len - i) {
+                now = len - i;
+            }
+            STATS_ADD(log, io_calls, 1);
+            if (!ring_log_io_read(log, off, p + i, now)) {
+                RING_LOG_ERROR("ring_log_io_read failed");
+                return -1;
+            }
+            i += now;
+            off = advance(log, off, now);
         }
+        return off;
+    }
 
-        // Then read in as much of what is remaining as we have `len` for.
-        size_t to_read = len < remaining ? len : remaining;
-        if (read_wrap(log, p, to_read) == -1) {
+    return advance(log, off, len);
+}
+
+// file_crc updates `*crc` with the `len` bytes starting at `off`, reading them
+// in a bit at a time. It returns 0 on error.
+static int file_crc(log_t *log, off_t off, size_t len, uint32_t *crc) {
+    char buffer[256];
+    for (size_t i = 0; i < len; ) {
+        size_t now = len - i < sizeof(buffer) ? len - i : sizeof(buffer);
+        if (read_wrap(log, advance(log, off, i), buffer, now) == -1) {
             RING_LOG_ERROR("read_wrap failed");
-            goto fail;
+            return 0;
         }
-        *read_total += to_read;
-
-        ring_log_arch_free_mutex();
+        *crc = crc_update(*crc, buffer, now);
+        i += now;
+    }
+    return 1;
+}
 
-        return to_read;
+// read_entry_header reads the header of the entry that starts at `off`, and
+// returns where the entry's contents start, or -1 on error.
+static off_t read_entry_header(log_t *log, off_t off, entry_header_t *entry_header) {
+    char header[ENTRY_HEADER_MAX];
+    if (read_wrap(log, off, header, sizeof(header)) == -1) {
+        RING_LOG_ERROR("read_wrap failed");
+        return -1;
+    }
+    int width = get_entry_header(header, entry_header);
+    if (width == 0) {
+        RING_LOG_ERROR("corrupted entry header");
+        return -1;
     }
+    return advance(log, off, width);
+}
 
-    ring_log_arch_free_mutex();
-    return 0;
-fail:
-    ring_log_arch_free_mutex();
-    return -1;
+// index_append adds an entry (whose contents start at `off`) to the end of the in-memory index of entries, if
+// there is room. Once an entry didn't fit, no more entries are added until
+// index_fill catches up again.
+static void index_append(log_t *log, off_t off, const entry_header_t *entry_header) {
+    ring_log_index_entry_t *entry;
+    if (log->spsc) {
+        // The entry that was in the slot has to have been read, or the reader
+        // might still look at it (see log_t). Where it hasn't, the entries
+        // from here on aren't all in the index until the next one that is.
+        // Readers get to see the slot once the entry is published.
+        uint64_t seq = log->file_header.tail_seq - 1;
+        if (seq - __atomic_load_n(&log->published_head_seq, __ATOMIC_ACQUIRE) >= log->index_size) {
+            __atomic_store_n(&log->index_from_seq, UINT64_MAX, __ATOMIC_RELAXED);
+            return;
+        }
+        entry = &log->index[seq % log->index_size];
+        if (log->index_from_seq == UINT64_MAX) {
+            __atomic_store_n(&log->index_from_seq, seq, __ATOMIC_RELAXED);
+        }
+    } else {
+        if (log->index_partial || log->index_count == log->index_size) {
+            log->index_partial = 1;
+            return;
+        }
+        entry = &log->index[(log->index_first + log->index_count) % log->index_size];
+        log->index_count++;
+    }
+    entry->off = off;
+    entry->len = entry_header->len;
+    entry->compressed = entry_header->compressed;
+    entry->continued = entry_header->continued;
 }
 
-void ring_log_read_head_success(const char *log_fn) {
-    log_t *log = lock_and_find_log(log_fn);
+// index_fill reads in the headers of the entries after the last indexed
+// entry (or the head), and adds them to the index until it's full or the tail
+// has been reached. It returns 0 on error.
+static int index_fill(log_t *log) {
+    if (log->index_size == 0) {
+        return 1;
+    }
 
-    // Check that there is an entry to be read at all.
-    if (!has_unread(log)) {
-        RING_LOG_ERROR("there is no entry to read, use ring_log_has_unread() first");
-        goto exit;
+    off_t off = log->file_header.head;
+    if (log->index_count > 0) {
+        ring_log_index_entry_t *last = &log->index[(log->index_first + log->index_count - 1) % log->index_size];
+        off = next_entry(log, last->off, last->len);
     }
 
-    // Seek to the head and read in the entry header.
-    if (!seek_abs(log, log->file_header.head)) {
-        RING_LOG_ERROR("seek_abs failed");
-        goto exit;
+    off_t tail = reader_tail(log);
+    log->index_partial = 0;
+    while (off != tail) {
+        if (log->index_count == log->index_size) {
+            log->index_partial = 1;
+            break;
+        }
+        entry_header_t entry_header;
+        off_t contents = read_entry_header(log, off, &entry_header);
+        if (contents == -1) {
+            RING_LOG_ERROR("read_entry_header failed");
+            return 0;
+        }
+        index_append(log, contents, &entry_header);
+        off = next_entry(log, contents, entry_header.len);
     }
-    entry_header_t entry_header;
-    RING_LOG_EXPECT_NOT(read_wrap(log, (void *)&entry_header, sizeof(entry_header)), -1);
+    return 1;
+}
 
-    // Figure out where the next entry starts and store that new head in the header.
-    uint16_t next_head = read_wrap(log, NULL, entry_header.len);
-    log->file_header.head = next_head;
-    RING_LOG_EXPECT_NOT(lseek(log->fd, 0, SEEK_SET), -1);
-    RING_LOG_EXPECT_NOT(write_all(log->fd, (void *)&(log->file_header), sizeof(log->file_header)), 0);
+// nth_entry finds out the header of the `n`th entry from the head, which
+// starts at `off`, from the index if possible, and from the file otherwise. It
+// returns the offset where the entry's contents start, or -1 on error.
+static off_t nth_entry(log_t *log, size_t n, off_t off, entry_header_t *entry_header) {
+    ring_log_index_entry_t *entry = NULL;
+    if (log->spsc) {
+        uint64_t seq = log->file_header.head_seq + n;
+        if (seq >= __atomic_load_n(&log->index_from_seq, __ATOMIC_RELAXED)) {
+            entry = &log->index[seq % log->index_size];
+        }
+    } else if (n < log->index_count) {
+        entry = &log->index[(log->index_first + n) % log->index_size];
+    }
+    if (entry != NULL) {
+        entry_header->len = entry->len;
+        entry_header->compressed = entry->compressed;
+        entry_header->continued = entry->continued;
+        return entry->off;
+    }
 
-exit:
-    ring_log_arch_free_mutex();
+    return read_entry_header(log, off, entry_header);
 }
 
-#ifdef DEBUG
+// head_entry is nth_entry for the entry at the head.
+static off_t head_entry(log_t *log, entry_header_t *entry_header) {
+    // The index ran dry, but there are more entries: index those first.
+    if (log->index_count == 0 && log->index_partial) {
+        if (!index_fill(log)) {
+            RING_LOG_ERROR("index_fill failed");
+            return -1;
+        }
+    }
 
-void sanity_check_file_size(const char *log_fn) {
-    log_t *log = lock_and_find_log(log_fn);
+    return nth_entry(log, 0, log->file_header.head, entry_header);
+}
 
-    off_t file_len = lseek(log->fd, 0, SEEK_END);
-    RING_LOG_EXPECT_NOT(file_len, -1);
-    if (file_len != log_size) {
-        RING_LOG_ERROR("expected file length to be " xstr(LOG_SIZE));
+// evict_head drops the entry at the head of the log by moving the head past
+// it, and says in `*continued` whether it was a piece with more after it (see
+// entry_header_t). The caller has to store the new head in the file header.
+// It returns 0 on error.
+static int evict_head(log_t *log, int *continued) {
+    entry_header_t entry_header;
+    off_t off = head_entry(log, &entry_header);
+    if (off == -1) {
+        RING_LOG_ERROR("head_entry failed");
+        return 0;
+    }
+    log->file_header.head = next_entry(log, off, entry_header.len);
+    log->file_header.head_seq++;
+    if (log->index_count > 0) {
+        log->index_first = (log->index_first + 1) % log->index_size;
+        log->index_count--;
+    }
+    *continued = entry_header.continued;
+    return 1;
+}
+
+// evict_chain is evict_head for every piece of the entry at the head (see
+// entry_header_t), and returns how many pieces it dropped, or 0 on error.
+static int evict_chain(log_t *log) {
+    int n = 0, continued = 1;
+    while (continued && has_readable(log)) {
+        if (!evict_head(log, &continued)) {
+            RING_LOG_ERROR("evict_head failed");
+            return 0;
+        }
+        n++;
+    }
+    __atomic_store_n(&log->published_head_seq, log->file_header.head_seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&log->published_head, log->file_header.head, __ATOMIC_RELEASE);
+    return n;
+}
+
+// chain_pieces returns how many pieces the entry that starts at `off`, the
+// `first`th from the head, is made up of (see entry_header_t), 0 if its last
+// piece hasn't been written yet, or -1 on error. If `end` isn't NULL, it gets
+// where the entry after it starts.
+static int chain_pieces(log_t *log, off_t off, size_t first, off_t *end) {
+    if (log->index_count == 0 && log->index_partial && !index_fill(log)) {
+        RING_LOG_ERROR("index_fill failed");
+        return -1;
+    }
+    off_t tail = reader_tail(log);
+    for (int n = 0; off != tail; n++) {
+        entry_header_t entry_header;
+        off_t contents = nth_entry(log, first + n, off, &entry_header);
+        if (contents == -1) {
+            RING_LOG_ERROR("nth_entry failed");
+            return -1;
+        }
+        off = next_entry(log, contents, entry_header.len);
+        if (!entry_header.continued) {
+            if (end != NULL) {
+                *end = off;
+            }
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+// head_pieces is chain_pieces for the entry at the head.
+static int head_pieces(log_t *log) {
+    return chain_pieces(log, log->file_header.head, 0, NULL);
+}
+
+// unpack decompresses the compressed entry with sequence number `seq`, whose
+// header is `entry_header` and whose contents start at `off`, into the second
+// part of the compress buffer, unless it's there already. It returns 0 on
+// error.
+static int unpack(log_t *log, uint64_t seq, off_t off, const entry_header_t *entry_header) {
+    if (log->unpacked_seq == seq) {
+        return 1;
+    }
+    if (log->compress_buffer == NULL || entry_header->len > log->staging_size) {
+        RING_LOG_ERROR("no room to decompress entry");
+        return 0;
+    }
+
+    // The writer of an spsc log compresses entries into the first part while
+    // this runs, so the reader reads the compressed entry into the third.
+    char *packed = log->compress_buffer + (log->spsc ? 2 * log->staging_size : 0);
+    char *unpacked = log->compress_buffer + log->staging_size;
+    if (read_wrap(log, off, packed, entry_header->len) == -1) {
+        RING_LOG_ERROR("read_wrap failed");
+        return 0;
+    }
+    uint64_t len;
+    int width = varint_get(packed, &len);
+    if (width == 0 || width > entry_header->len || len > log->staging_size ||
+        !ring_log_lz_decompress(packed + width, entry_header->len - width, unpacked, len)) {
+        RING_LOG_ERROR("corrupted compressed entry");
+        return 0;
+    }
+    log->unpacked_seq = seq;
+    log->unpacked_len = len;
+    return 1;
+}
+
+// entry_len returns how long an entry (see unpack) is once decompressed, or -1
+// on error.
+static ssize_t entry_len(log_t *log, uint64_t seq, off_t off, const entry_header_t *entry_header) {
+    if (!entry_header->compressed) {
+        return entry_header->len;
+    }
+    if (!unpack(log, seq, off, entry_header)) {
+        RING_LOG_ERROR("unpack failed");
+        return -1;
+    }
+    return log->unpacked_len;
+}
+
+// read_entry reads `len` bytes of an entry (see unpack) into `p`, starting
+// `pos` bytes into the entry once decompressed. It returns 0 on error.
+static int read_entry(log_t *log, uint64_t seq, off_t off, const entry_header_t *entry_header, size_t pos, char *p, size_t len) {
+    if (!entry_header->compressed) {
+        return read_wrap(log, advance(log, off, pos), p, len) != -1;
+    }
+    if (!unpack(log, seq, off, entry_header)) {
+        RING_LOG_ERROR("unpack failed");
+        return 0;
+    }
+    memcpy(p, log->compress_buffer + log->staging_size + pos, len);
+    return 1;
+}
+
+// read_chain_at reads up to `len` bytes of the entry that starts at `off`,
+// the `first`th from the head, all of its pieces put back together (see
+// entry_header_t), into `p`, starting `pos` bytes into it. It returns how many
+// bytes it read, and stores how long the whole entry is in `*total`, or
+// returns -1 on error.
+static ssize_t read_chain_at(log_t *log, off_t off, size_t first, size_t pos, char *p, size_t len, size_t *total) {
+    if (log->index_count == 0 && log->index_partial && !index_fill(log)) {
+        RING_LOG_ERROR("index_fill failed");
+        return -1;
+    }
+    off_t tail = reader_tail(log);
+    size_t at = 0, done = 0;
+    for (int n = 0; ; n++) {
+        if (off == tail) {
+            RING_LOG_ERROR("entry is missing pieces");
+            return -1;
+        }
+        entry_header_t entry_header;
+        off_t contents = nth_entry(log, first + n, off, &entry_header);
+        if (contents == -1) {
+            RING_LOG_ERROR("nth_entry failed");
+            return -1;
+        }
+        uint64_t seq = log->file_header.head_seq + first + n;
+        ssize_t piece_len = entry_len(log, seq, contents, &entry_header);
+        if (piece_len == -1) {
+            RING_LOG_ERROR("entry_len failed");
+            return -1;
+        }
+
+        // Read whatever is wanted of this piece.
+        if (done < len && pos + done < at + piece_len) {
+            size_t from = pos + done - at;
+            size_t now = piece_len - from < len - done ? piece_len - from : len - done;
+            if (!read_entry(log, seq, contents, &entry_header, from, p + done, now)) {
+                RING_LOG_ERROR("read_entry failed");
+                return -1;
+            }
+            done += now;
+        }
+        at += piece_len;
+        if (!entry_header.continued) {
+            break;
+        }
+        off = next_entry(log, contents, entry_header.len);
+    }
+    *total = at;
+    return done;
+}
+
+// read_chain is read_chain_at for the entry at the head.
+static ssize_t read_chain(log_t *log, size_t pos, char *p, size_t len, size_t *total) {
+    return read_chain_at(log, log->file_header.head, 0, pos, p, len, total);
+}
+
+// store_head stores the head that a reader has moved on in the file header,
+// except for spsc logs, whose file header only the writer writes (see log_t).
+// It returns 0 on error.
+static int store_head(log_t *log) {
+    if (log->spsc) {
+        return 1;
+    }
+    if (!write_file_header(log)) {
+        RING_LOG_ERROR("write_file_header failed");
+        return 0;
+    }
+    ring_log_io_flush(log);
+    return 1;
+}
+
+// make_room moves the head past every entry that writing `len` bytes at `off`
+// would overwrite (with all of its pieces), and stores the new head in the file header. The write isn't
+// allowed to end right at the head either: head == tail means the log is
+// empty. It returns 0 on error.
+static int make_room(log_t *log, off_t off, size_t len) {
+    // The reader of an spsc log only ever moves the head out of the way, so
+    // if there's room as of the head that the file header goes by (see
+    // write_file_header), there's room, and that head is left alone.
+    // Otherwise, once the head_mutex is taken, that head catches up with the
+    // reader, and only the entries still in the way get evicted.
+    if (log->spsc && (log->header_head == log->file_header.tail || distance(log, off, log->header_head) > len)) {
+        return 1;
+    }
+
+    int ret = 0, evicted = 0;
+    lock_head(log);
+    while (has_unread(log) && distance(log, off, log->file_header.head) <= len) {
+        // The pieces of an entry only ever get evicted all together.
+        int n = evict_chain(log);
+        if (n == 0) {
+            RING_LOG_ERROR("evict_chain failed");
+            goto exit;
+        }
+        STATS_ADD(log, entries_evicted, n);
+        evicted = 1;
+    }
+    snap_head(log);
+    if (evicted) {
+        if (!write_file_header(log)) {
+            RING_LOG_ERROR("write_file_header failed");
+            goto exit;
+        }
+    }
+    ret = 1;
+
+exit:
+    unlock_head(log);
+    return ret;
+}
+
+// reserve makes room at the tail for a whole entry of `len` bytes (with its
+// header), and for the padding after it (see pad), before any of it gets
+// written: every entry in the way is evicted in one go, and the new head goes
+// out in one write of the file header. It returns 0 on error.
+static int reserve(log_t *log, size_t len) {
+    off_t off = log->file_header.tail;
+    off_t end = advance(log, off, len);
+    return make_room(log, off, len + distance(log, end, pad(log, end)));
+}
+
+// write_wrap writes (unless error) `len` bytes from `p` starting at `off`. The
+// writes will wrap around the end of the log, and skip over the file header.
+// If `is_entry`, any entries in the way are evicted first (see make_room), for
+// entries written bit by bit, whose length isn't known up front. If
+// there is any error, write_wrap returns -1. Otherwise, it will return the
+// offset after the last byte written.
+static off_t write_wrap(log_t *log, int is_entry, off_t off, const char *p, size_t len) {
+    if (!check_off(log, off)) {
+        RING_LOG_ERROR("check_off failed");
+        return -1;
+    }
+
+    if (is_entry && !make_room(log, off, len)) {
+        RING_LOG_ERROR("make_room failed");
+        return -1;
+    }
+
+    off_t end = advance(log, off, len);
+
+    // If the write laps the ring, only the last lap ends up in the file.
+    if (len > log->capacity) {
+        p += len - log->capacity;
+        len = log->capacity;
+        off = end;
+    }
+
+    for (size_t i = 0; i < len; ) {
+        // Write up to the end of the file, then carry on after the header.
+        size_t now = RING_LOG_FILE_SIZE(log->capacity) - off;
+        if (now > len - i) {
+            now = len - i;
+        }
+        STATS_ADD(log, io_calls, 1);
+        if (!ring_log_io_write(log, off, p + i, now)) {
+            RING_LOG_ERROR("ring_log_io_write failed");
+            return -1;
+        }
+        i += now;
+        off = advance(log, off, now);
+    }
+
+    return end;
+}
+
+// commit_header writes out the file header, and syncs the file if the log's
+// durability is RING_LOG_DURABILITY_SYNC. It returns 0 on error.
+static int commit_header(log_t *log) {
+    if (!write_file_header(log)) {
+        RING_LOG_ERROR("write_file_header failed");
+        return 0;
+    }
+    ring_log_io_flush(log);
+    if (log->durability == RING_LOG_DURABILITY_SYNC) {
+        STATS_ADD(log, io_calls, 1);
+        if (!ring_log_io_sync(log)) {
+            RING_LOG_ERROR("ring_log_io_sync failed");
+            return 0;
+        }
+        stable_tail(log, &log->synced_tail, &log->synced_seq);
+    }
+    return 1;
+}
+
+// commit_tail makes the entry that has been written at the tail, whose header
+// is `entry_header` and whose contents start at `contents` and end at `end`,
+// part of the log, and stores the new tail in the file header, as the log's
+// durability says. It returns 0 on error.
+static int commit_tail(log_t *log, off_t contents, const entry_header_t *entry_header, off_t end) {
+    // The next entry starts on a new program page: make room up to there,
+    // unless the entry was reserved (see reserve) with that room already.
+    off_t next = pad(log, end);
+    if (next != end && !make_room(log, end, distance(log, end, next))) {
+        RING_LOG_ERROR("make_room failed");
+        return 0;
+    }
+    log->file_header.tail = next;
+    log->file_header.tail_seq++;
+    STATS_ADD(log, entries_written, 1);
+    STATS_ADD(log, bytes_written, entry_header->len);
+
+    // An entry that takes up the whole ring ends right where it started, and
+    // leaves the log looking empty. The reader of an spsc log can't get past
+    // the entries published before this one, so the head it last published
+    // will do to tell, and the head_mutex is only needed when the log is
+    // empty.
+    if (log->spsc) {
+        off_t head = __atomic_load_n(&log->published_head, __ATOMIC_ACQUIRE);
+        if (head != log->file_header.tail) {
+            index_append(log, contents, entry_header);
+            STATS_MAX(log, max_fill_bytes, distance(log, head, end));
+            STATS_MAX(log, max_fill_entries, log->file_header.tail_seq - __atomic_load_n(&log->published_head_seq, __ATOMIC_RELAXED));
+        } else {
+            lock_head(log);
+            log->file_header.head_seq = log->file_header.tail_seq;
+            __atomic_store_n(&log->published_head_seq, log->file_header.head_seq, __ATOMIC_RELAXED);
+            snap_head(log);
+            unlock_head(log);
+            STATS_ADD(log, entries_evicted, 1);
+        }
+    } else if (has_unread(log)) {
+        index_append(log, contents, entry_header);
+        STATS_MAX(log, max_fill_bytes, distance(log, log->file_header.head, end));
+        STATS_MAX(log, max_fill_entries, log->file_header.tail_seq - log->file_header.head_seq);
+    } else {
+        log->file_header.head_seq = log->file_header.tail_seq;
+        STATS_ADD(log, entries_evicted, 1);
+    }
+
+    // Readers get to see an entry once all of its pieces are there.
+    if (!entry_header->continued) {
+        __atomic_store_n(&log->published_tail, log->file_header.tail, __ATOMIC_RELEASE);
+    }
+
+    // With group commits, the file header gets written at the next one.
+    if (log->durability == RING_LOG_DURABILITY_GROUP) {
+        if (log->unsynced_entries++ == 0) {
+            log->unsynced_since_ms = ring_log_arch_now_ms();
+        }
+        log->unsynced_bytes += entry_header->len;
+        return 1;
+    }
+
+    // In the middle of a batch of entries from the async queue, the file
+    // header gets written at the end of the batch.
+    if (log->batching) {
+        return 1;
+    }
+
+    return commit_header(log);
+}
+
+// group_commit_due says whether enough entries have piled up for a group
+// commit, see RING_LOG_DURABILITY_GROUP.
+static int group_commit_due(log_t *log) {
+    if (log->durability != RING_LOG_DURABILITY_GROUP || log->unsynced_entries == 0) {
+        return 0;
+    }
+    return (log->group_entries && log->unsynced_entries >= log->group_entries) ||
+        (log->group_bytes && log->unsynced_bytes >= log->group_bytes) ||
+        (log->group_ms && ring_log_arch_now_ms() - log->unsynced_since_ms >= log->group_ms);
+}
+
+// group_commit writes out the file header and syncs the file, if a group
+// commit is due (or if `force`), unless another task is doing that already.
+// It has to be called with the lock taken, but lets go of it while syncing, so
+// that other tasks can carry on writing entries. Those get covered by the next
+// group commit.
+static void group_commit(log_t *log, int force) {
+    if (!force && (log->syncing || !group_commit_due(log))) {
+        return;
+    }
+
+    log->unsynced_entries = 0;
+    log->unsynced_bytes = 0;
+    // Forced, the file header also gets the head that the reader of an spsc
+    // log has got to.
+    if (force) {
+        lock_head(log);
+        snap_head(log);
+        unlock_head(log);
+    }
+    RING_LOG_EXPECT_NOT(write_file_header(log), 0);
+    ring_log_io_flush(log);
+
+    off_t tail;
+    uint64_t seq;
+    stable_tail(log, &tail, &seq);
+    log->syncing++;
+    ring_log_arch_free_mutex(log->mutex);
+    STATS_ADD(log, io_calls, 1);
+    RING_LOG_EXPECT_NOT(ring_log_io_sync(log), 0);
+    lock(log);
+    log->syncing--;
+
+    // Syncs can finish in any order, only ever move the last known good tail
+    // forward.
+    if (seq > log->synced_seq) {
+        log->synced_tail = tail;
+        log->synced_seq = seq;
+    }
+}
+
+// write_entry writes out a whole entry (or piece of one, if `continued`) at
+// the tail, and commits it. The `len` bytes of contents are at
+// `p + ENTRY_HEADER_MAX`: the room in front of them is for the entry header.
+// `crc` is the CRC of the contents so far. It returns 0 on error.
+static int write_entry(log_t *log, char *p, size_t len, int compressed, int continued, uint32_t crc) {
+    entry_header_t entry_header = {
+        .len = len,
+        .compressed = compressed,
+        .continued = continued,
+        .seq = log->file_header.tail_seq
+    };
+    entry_header.crc = entry_crc(crc, &entry_header);
+    char header[ENTRY_HEADER_MAX];
+    int width = put_entry_header(header, &entry_header, 0);
+    char *start = p + ENTRY_HEADER_MAX - width;
+    memcpy(start, header, width);
+    if (!reserve(log, width + len)) {
+        RING_LOG_ERROR("reserve failed");
+        return 0;
+    }
+    off_t off = log->file_header.tail;
+    off_t end = write_wrap(log, 0, off, start, width + len);
+    if (end == -1) {
+        RING_LOG_ERROR("write_wrap failed");
+        return 0;
+    }
+    return commit_tail(log, advance(log, off, width), &entry_header, end);
+}
+
+// compress_staged compresses the entry in the staging buffer into the first
+// half of the compress buffer, after room for the entry header, and returns
+// how long the compressed contents are, or 0 if compressing didn't make the
+// entry any shorter.
+static size_t compress_staged(log_t *log, size_t len) {
+    int width = varint_len(len);
+    if (log->compress_buffer == NULL || len < width + 2) {
+        return 0;
+    }
+    char *packed = log->compress_buffer + ENTRY_HEADER_MAX;
+    varint_put(packed, len, width);
+    size_t block_len = ring_log_lz_compress(log->staging + ENTRY_HEADER_MAX, len, packed + width, len - width - 1);
+    if (block_len == 0) {
+        return 0;
+    }
+    return width + block_len;
+}
+
+// write_staged writes out the `len` bytes of contents in the staging buffer
+// (after the room for the entry header) as a whole entry (see write_entry),
+// compressed if that's worth it, and commits it. `crc` is the CRC of the
+// contents. It returns 0 on error.
+static int write_staged(log_t *log, size_t len, int continued, uint32_t crc) {
+    size_t packed_len = compress_staged(log, len);
+    if (packed_len > 0) {
+        crc = crc_update(CRC_INIT, log->compress_buffer + ENTRY_HEADER_MAX, packed_len);
+        return write_entry(log, log->compress_buffer, packed_len, 1, continued, crc);
+    }
+    return write_entry(log, log->staging, len, 0, continued, crc);
+}
+
+// tail_busy says whether a tail entry is being written straight into the
+// file, which means it's at the tail already, in the way of any other entry,
+// or whether an entry is being written in pieces, which mustn't have any other
+// entry in between them.
+static int tail_busy(log_t *log) {
+    return (log->new_tail_started && !log->new_tail_failed && !log->staged) || log->chaining;
+}
+
+// The most padding (see pad) an entry can need: up to the next page, or past
+// the end of the ring and on to the first page boundary in it.
+static off_t max_padding(const log_t *log) {
+    if (log->program_page == 0) {
+        return 0;
+    }
+    return log->program_page - 1 + pad(log, sizeof(file_header_t)) - (off_t)sizeof(file_header_t);
+}
+
+// piece_room returns how long a piece of an entry (see ring_log_oversize_t)
+// can be, if the pieces before it take up `used` bytes of the ring: up to the
+// log's `max_entry_size`, and short enough that all of them, with their
+// headers and padding, fit in the ring without lapping it.
+static size_t piece_room(const log_t *log, off_t used) {
+    off_t room = log->capacity - 1 - (off_t)ENTRY_HEADER_MAX - max_padding(log) - used;
+    if (room < 0) {
+        room = 0;
+    }
+    if (log->max_entry_size && log->max_entry_size < room) {
+        return log->max_entry_size;
+    }
+    return room;
+}
+
+// entry_room is piece_room for a piece at the tail, of an entry whose first
+// piece starts at `start`.
+static size_t entry_room(const log_t *log, off_t start) {
+    return piece_room(log, distance(log, start, log->file_header.tail));
+}
+
+// chain_can_grow says whether an entry whose first piece starts at `start`
+// still has room for a piece after one of `room` bytes at the tail, with more
+// in it than RING_LOG_TRUNCATED_MARKER. If it doesn't, that one is cut short
+// instead.
+static int chain_can_grow(const log_t *log, off_t start, size_t room) {
+    if (log->oversize != RING_LOG_OVERSIZE_FRAGMENT) {
+        return 0;
+    }
+    off_t used = distance(log, start, log->file_header.tail) + (off_t)ENTRY_HEADER_MAX + room + max_padding(log);
+    return piece_room(log, used) > sizeof(RING_LOG_TRUNCATED_MARKER) - 1;
+}
+
+// marker_len returns how much of RING_LOG_TRUNCATED_MARKER goes at the end of
+// an entry cut short to `room` bytes.
+static size_t marker_len(size_t room) {
+    size_t len = sizeof(RING_LOG_TRUNCATED_MARKER) - 1;
+    return len < room ? len : room;
+}
+
+// write_piecev writes one whole entry (or piece of one, see write_entry) made
+// up of the `iovcnt` buffers in `iov` at the tail, and commits it. The tail
+// mustn't be busy (see tail_busy). It returns 0 on error.
+static int write_piecev(log_t *log, const struct iovec *iov, int iovcnt, int continued) {
+    size_t len = 0;
+    uint32_t crc = CRC_INIT;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+        crc = crc_update(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    // If the staging buffer isn't holding on to a tail entry, and the entry
+    // fits, gather it up in there and write it out like any staged entry.
+    if (!(log->new_tail_started && log->staged) && ENTRY_HEADER_MAX + len <= log->staging_size) {
+        char *p = log->staging + ENTRY_HEADER_MAX;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        return write_staged(log, len, continued, crc);
+    }
+
+    // Otherwise, the length is known up front, so the entry header can go out
+    // as it is: make room for the whole entry, and write the header and the
+    // contents right after each other.
+    entry_header_t entry_header = {
+        .len = len,
+        .compressed = 0,
+        .continued = continued,
+        .seq = log->file_header.tail_seq
+    };
+    entry_header.crc = entry_crc(crc, &entry_header);
+    char header[ENTRY_HEADER_MAX];
+    int width = put_entry_header(header, &entry_header, 0);
+    if (!reserve(log, width + len)) {
+        RING_LOG_ERROR("reserve failed");
+        return 0;
+    }
+    off_t off = log->file_header.tail;
+    off_t end = write_wrap(log, 0, off, header, width);
+    for (int i = 0; i < iovcnt && end != -1; i++) {
+        end = write_wrap(log, 0, end, iov[i].iov_base, iov[i].iov_len);
+    }
+    if (end == -1) {
+        RING_LOG_ERROR("write_wrap failed");
+        return 0;
+    }
+    return commit_tail(log, advance(log, off, width), &entry_header, end);
+}
+
+// end_chain is for when the next piece of an entry that's being written in
+// pieces (see ring_log_oversize_t) couldn't be written: if there are pieces
+// of it in the log already, it ends them with a last piece that only has
+// RING_LOG_TRUNCATED_MARKER in it.
+static void end_chain(log_t *log) {
+    if (log->file_header.tail != log->chain_start) {
+        struct iovec iov = {
+            .iov_base = (char *)RING_LOG_TRUNCATED_MARKER,
+            .iov_len = marker_len(entry_room(log, log->chain_start))
+        };
+        RING_LOG_EXPECT_NOT(write_piecev(log, &iov, 1, 0), 0);
+    }
+    log->chaining = 0;
+}
+
+// write_entryv writes one whole entry made up of the `iovcnt` buffers in `iov`
+// at the tail, and commits it. If it's too big for one (see entry_room), it's
+// cut short or written in pieces, as the log's `oversize` says. The tail
+// mustn't be busy (see tail_busy). It returns 0 on error.
+static int write_entryv(log_t *log, const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    log->chain_start = log->file_header.tail;
+    log->chain_seq = log->file_header.tail_seq;
+    if (len <= entry_room(log, log->chain_start)) {
+        return write_piecev(log, iov, iovcnt, 0);
+    }
+
+    // Each piece takes what's next of the buffers, as much as it has room
+    // for, and the marker if the entry gets cut short there.
+    struct iovec piece[iovcnt + 1];
+    int i = 0;
+    size_t in = 0;
+    while (1) {
+        size_t room = entry_room(log, log->chain_start);
+        int last = len <= room;
+        int truncated = !last && !chain_can_grow(log, log->chain_start, room);
+        size_t marker = truncated ? marker_len(room) : 0;
+        size_t want = last ? len : room - marker;
+
+        int n = 0;
+        for (size_t got = 0; got < want; ) {
+            size_t now = iov[i].iov_len - in < want - got ? iov[i].iov_len - in : want - got;
+            piece[n].iov_base = (char *)iov[i].iov_base + in;
+            piece[n++].iov_len = now;
+            got += now;
+            in += now;
+            if (in == iov[i].iov_len) {
+                i++;
+                in = 0;
+            }
+        }
+        if (marker) {
+            piece[n].iov_base = (char *)RING_LOG_TRUNCATED_MARKER;
+            piece[n++].iov_len = marker;
+        }
+
+        int continued = !last && !truncated;
+        if (continued) {
+            log->chaining = 1;
+            log->tail_owner = ring_log_arch_self();
+        }
+        if (!write_piecev(log, piece, n, continued)) {
+            RING_LOG_ERROR("write_piecev failed");
+            end_chain(log);
+            return 0;
+        }
+        if (!continued) {
+            log->chaining = 0;
+            return 1;
+        }
+        len -= want;
+    }
+}
+
+// The async queue (see log_t) is a bounded multi-producer queue along the
+// lines of Dmitry Vyukov's: each slot's `seq` says whose turn it is. A slot
+// is free for the entry at position `pos` once its seq is `pos`, and holds
+// that entry once its seq is `pos + 1`. Producers claim positions by moving
+// `async_tail` on. The flusher is the only one taking entries out, at
+// `async_head`, and hands the slot on to position `pos + async_slots`.
+static ring_log_async_slot_t *async_slot(log_t *log, uint64_t pos) {
+    return (void *)((char *)log->async_queue + pos % log->async_slots * RING_LOG_ASYNC_SLOT_SIZE(log->async_entry_size));
+}
+
+// async_held_up says whether the flusher is held up by the caller's own tail
+// entry (see tail_busy), so that waiting for the flusher would mean waiting
+// forever. A tail entry of another task's gets finished in the end.
+static int async_held_up(log_t *log) {
+    lock(log);
+    int busy = tail_busy(log) && log->tail_owner == ring_log_arch_self();
+    ring_log_arch_free_mutex(log->mutex);
+    return busy;
+}
+
+// async_push puts the entry made up of the `iovcnt` buffers in `iov`, which
+// add up to `len` bytes, in the async queue. It returns 0 if the entry got
+// dropped because the queue is full.
+
+static int async_push(log_t *log, const struct iovec *iov, int iovcnt, size_t len) {
+    ring_log_async_slot_t *slot;
+    uint64_t pos = __atomic_load_n(&log->async_tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = async_slot(log, pos);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            // The slot is free, try to claim it. If someone else got there
+            // first, `pos` is where the tail is now.
+            if (__atomic_compare_exchange_n(&log->async_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (seq > pos) {
+            // Someone else claimed it already.
+            pos = __atomic_load_n(&log->async_tail, __ATOMIC_RELAXED);
+        } else if (log->async_full == RING_LOG_ASYNC_BLOCK) {
+            // The queue is full: wait for the flusher to make room, unless
+            // it's waiting for the caller. Then the entry is dropped, and
+            // counted like any other dropped one.
+            uint32_t count = ring_log_arch_event_count(log->async_done);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) < pos) {
+                if (async_held_up(log)) {
+                    __atomic_fetch_add(&log->async_dropped, 1, __ATOMIC_RELAXED);
+                    STATS_ADD(log, entries_dropped, 1);
+                    return 0;
+                }
+                ring_log_arch_wait_event(log->async_done, count, 100);
+            }
+            pos = __atomic_load_n(&log->async_tail, __ATOMIC_RELAXED);
+        } else {
+            if (log->async_full == RING_LOG_ASYNC_COUNT_AND_DROP) {
+                __atomic_fetch_add(&log->async_dropped, 1, __ATOMIC_RELAXED);
+            }
+            STATS_ADD(log, entries_dropped, 1);
+            return 0;
+        }
+    }
+
+    char *p = (char *)(slot + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    slot->len = len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    // Wake up the flusher if it's waiting for entries.
+    if (__atomic_load_n(&log->async_sleeping, __ATOMIC_SEQ_CST)) {
+        ring_log_arch_set_event(log->async_wake);
+    }
+    return 1;
+}
+
+// async_ready says whether the entry at the head of the async queue is there
+// to be written out.
+static int async_ready(log_t *log) {
+    return __atomic_load_n(&async_slot(log, log->async_head)->seq, __ATOMIC_SEQ_CST) == log->async_head + 1;
+}
+
+// async_write_batch writes out the entries in the async queue, taking the lock
+// once, and writing out the file header (and syncing, depending on the log's
+// durability) once at the end. It returns how many entries it wrote.
+static uint32_t async_write_batch(log_t *log) {
+    uint32_t n = 0;
+
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    log->batching = 1;
+    // A tail entry that's being written straight into the file has to be
+    // finished first.
+    while (n < log->async_slots && async_ready(log) && !tail_busy(log)) {
+        ring_log_async_slot_t *slot = async_slot(log, log->async_head);
+        struct iovec iov = { .iov_base = slot + 1, .iov_len = slot->len };
+        if (!write_entryv(log, &iov, 1)) {
+            RING_LOG_ERROR("write_entryv failed");
+            STATS_ADD(log, tails_failed, 1);
+        }
+        __atomic_store_n(&slot->seq, log->async_head + log->async_slots, __ATOMIC_RELEASE);
+        log->async_head++;
+        n++;
+    }
+
+    // Say how many entries got dropped since the last time.
+    uint64_t dropped = __atomic_exchange_n(&log->async_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0 && !tail_busy(log)) {
+        char note[48];
+        struct iovec iov = { .iov_base = note };
+        iov.iov_len = snprintf(note, sizeof(note), "ring_log: dropped %llu entries", (unsigned long long)dropped);
+        RING_LOG_EXPECT_NOT(write_entryv(log, &iov, 1), 0);
+    } else if (dropped > 0) {
+        __atomic_fetch_add(&log->async_dropped, dropped, __ATOMIC_RELAXED);
+    }
+
+    log->batching = 0;
+    if (log->durability == RING_LOG_DURABILITY_GROUP) {
+        group_commit(log, 0);
+    } else {
+        RING_LOG_EXPECT_NOT(commit_header(log), 0);
+    }
+
+    ring_log_arch_free_mutex(log->mutex);
+
+    // Let producers waiting for room, and tasks waiting in async_flush, know.
+    __atomic_store_n(&log->async_written, log->async_head, __ATOMIC_RELEASE);
+    ring_log_arch_set_event(log->async_done);
+    return n;
+}
+
+// async_drop drops the entries in the async queue, without writing them out.
+static void async_drop(log_t *log) {
+    while (async_ready(log)) {
+        __atomic_store_n(&async_slot(log, log->async_head)->seq, log->async_head + log->async_slots, __ATOMIC_RELEASE);
+        log->async_head++;
+        STATS_ADD(log, entries_dropped, 1);
+    }
+    __atomic_store_n(&log->async_written, log->async_head, __ATOMIC_RELEASE);
+    ring_log_arch_set_event(log->async_done);
+}
+
+// async_flusher is the flusher thread: it writes out the entries in the async
+// queue in batches, and waits for more once it's empty, until the log's
+// `async_stopping`.
+static void async_flusher(void *arg) {
+    log_t *log = arg;
+    while (1) {
+        if (async_ready(log)) {
+            if (async_write_batch(log) == 0) {
+                // The tail is busy. Once the log is being closed, it's never
+                // going to be complete, so the rest of the queue is dropped.
+                if (__atomic_load_n(&log->async_stopping, __ATOMIC_ACQUIRE)) {
+                    async_drop(log);
+                    break;
+                }
+                // Otherwise, give it a moment.
+                ring_log_arch_wait_event(log->async_wake, ring_log_arch_event_count(log->async_wake), 1);
+            }
+            continue;
+        }
+        if (__atomic_load_n(&log->async_stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        // Producers wake the flusher up if `async_sleeping` is set by the time
+        // they've put their entry in the queue, so check once more after
+        // setting it.
+        uint32_t count = ring_log_arch_event_count(log->async_wake);
+        __atomic_store_n(&log->async_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!async_ready(log) && !__atomic_load_n(&log->async_stopping, __ATOMIC_ACQUIRE)) {
+            ring_log_arch_wait_event(log->async_wake, count, 1000);
+        }
+        __atomic_store_n(&log->async_sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+// async_flush waits until the flusher has written out every entry that was
+// put in the async queue before the call, and returns 1, or 0 straight away if
+// the flusher is held up by the caller (see async_held_up).
+static int async_flush(log_t *log) {
+    uint64_t target = __atomic_load_n(&log->async_tail, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&log->async_written, __ATOMIC_ACQUIRE) >= target) {
+        return 1;
+    }
+    if (async_held_up(log)) {
+        return 0;
+    }
+    while (__atomic_load_n(&log->async_written, __ATOMIC_ACQUIRE) < target) {
+        uint32_t count = ring_log_arch_event_count(log->async_done);
+        if (__atomic_load_n(&log->async_written, __ATOMIC_ACQUIRE) < target) {
+            ring_log_arch_wait_event(log->async_done, count, 100);
+        }
+    }
+    return 1;
+}
+
+// async_start sets up the log's async queue, and starts its flusher thread.
+// It returns 0 on error.
+static int async_start(log_t *log) {
+    if (log->async_slots == 0 || log->async_queue_size < log->async_slots * RING_LOG_ASYNC_SLOT_SIZE(log->async_entry_size)) {
+        RING_LOG_ERROR("async queue is too small");
+        return 0;
+    }
+    for (uint32_t i = 0; i < log->async_slots; i++) {
+        async_slot(log, i)->seq = i;
+    }
+    log->async_head = log->async_tail = log->async_written = 0;
+    log->async_dropped = 0;
+    log->async_sleeping = log->async_stopping = 0;
+    log->batching = 0;
+    log->async_wake = ring_log_arch_new_event();
+    log->async_done = ring_log_arch_new_event();
+    if (log->async_wake == NULL || log->async_done == NULL) {
+        RING_LOG_ERROR("couldn't create events");
+        return 0;
+    }
+    log->async_thread = ring_log_arch_start_thread(async_flusher, log);
+    if (log->async_thread == NULL) {
+        RING_LOG_ERROR("couldn't start flusher thread");
+        return 0;
+    }
+    return 1;
+}
+
+// async_stop writes out what's left in the async queue, and stops the flusher
+// thread.
+static void async_stop(log_t *log) {
+    __atomic_store_n(&log->async_stopping, 1, __ATOMIC_RELEASE);
+    ring_log_arch_set_event(log->async_wake);
+    ring_log_arch_join_thread(log->async_thread);
+    ring_log_arch_delete_event(log->async_wake);
+    ring_log_arch_delete_event(log->async_done);
+}
+
+// create_file creates a ring log file that doesn't exist yet: it writes out
+// the file header, gets the file to the right size (see ring_log_provision_t),
+// and then opens the file for use in `log->fd`. It returns 0 on error.
+static int create_file(log_t *log) {
+    int fd = open(log->fn, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd == -1) {
+        RING_LOG_ERROR("couldn't create ring log file");
+        return 0;
+    }
+    // With a program page, the first entry starts on the first page boundary
+    // in the ring.
+    off_t start = pad(log, sizeof(file_header_t));
+    file_header_t file_header = {
+        .magic = RING_LOG_MAGIC,
+        .version = RING_LOG_VERSION,
+        .head = start, .tail = start,
+        .head_seq = 0, .tail_seq = 0
+    };
+    if (!pwrite_all(fd, 0, (void *)&file_header, sizeof(file_header))) {
+        RING_LOG_ERROR("couldn't write ring log file header");
+        close(fd);
+        return 0;
+    }
+
+    off_t file_size = RING_LOG_LOG_FILE_SIZE(log);
+    int sized = 0;
+    if (log->provision != RING_LOG_PROVISION_FILL) {
+        sized = ring_log_arch_size_file(fd, file_size, log->provision == RING_LOG_PROVISION_SPARSE);
+    }
+
+    // Otherwise, write enough chunks of the log's filler_byte to get the file
+    // to the right size.
+    char filler[512];
+    memset(filler, log->filler_byte, sizeof(filler));
+    for (off_t off = sizeof(file_header); !sized && off < file_size; off += sizeof(filler)) {
+        size_t len = file_size - off < sizeof(filler) ? file_size - off : sizeof(filler);
+        if (!pwrite_all(fd, off, filler, len)) {
+            RING_LOG_ERROR("couldn't write filler");
+            close(fd);
+            return 0;
+        }
+    }
+
+    // Close the file, otherwise the fs might now actually save the file size.
+    close(fd);
+    log->fd = open(log->fn, O_RDWR);
+    if (log->fd == -1) {
+        RING_LOG_ERROR("wasn't able to reopen ring log file");
+        return 0;
+    }
+    return 1;
+}
+
+typedef struct {
+    log_t *log;
+    void *thread;
+    int ok;
+} create_job_t;
+
+static void create_job(void *arg) {
+    create_job_t *job = arg;
+    job->ok = create_file(job->log);
+}
+
+// open_files opens the ring log files into `logs[i].fd`. Files that don't
+// exist yet get created, all at the same time if provision_in_parallel.
+static int open_files(void) {
+    create_job_t jobs[n_logs];
+    for (int i = 0; i < n_logs; i++) {
+        jobs[i].log = &logs[i];
+        jobs[i].thread = NULL;
+        jobs[i].ok = 1;
+        logs[i].fd = open(logs[i].fn, O_RDWR);
+        if (logs[i].fd != -1) {
+            continue;
+        }
+        if (provision_in_parallel) {
+            jobs[i].thread = ring_log_arch_start_thread(create_job, &jobs[i]);
+        }
+        if (jobs[i].thread == NULL) {
+            create_job(&jobs[i]);
+        }
+    }
+
+    int ok = 1;
+    for (int i = 0; i < n_logs; i++) {
+        if (jobs[i].thread != NULL) {
+            ring_log_arch_join_thread(jobs[i].thread);
+        }
+        ok &= jobs[i].ok;
+    }
+    return ok;
+}
+
+// v0_copy copies `len` bytes out of the image of a version 0 ring log file of
+// `file_size` bytes, starting at `off`, and returns the offset after the last
+// byte copied.
+static off_t v0_copy(const char *image, off_t file_size, off_t off, char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        p[i] = image[off++];
+        if (off == file_size) {
+            off = sizeof(v0_file_header_t);
+        }
+    }
+    return off;
+}
+
+// migrate_v0 rewrites a version 0 ring log file (see v0_file_header_t) in the
+// current format, oldest entry first. The new file header takes up more room,
+// so if the old entries don't all fit anymore, the oldest ones are evicted as
+// usual. This only ever happens once per file, so the old file is simply read
+// into RAM in one go. It returns 0 on error.
+static int migrate_v0(log_t *log) {
+    // Version 0 only had 16-bit offsets.
+    off_t file_size = RING_LOG_FILE_SIZE(log->capacity);
+    if (file_size > UINT16_MAX + 1) {
+        RING_LOG_ERROR("not a ring log file");
+        return 0;
+    }
+
+    int ok = 0;
+    off_t v0_ring_size = file_size - sizeof(v0_file_header_t);
+    char *image = malloc(file_size);
+    char *entry = malloc(ENTRY_HEADER_MAX + v0_ring_size);
+    if (image == NULL || entry == NULL) {
+        RING_LOG_ERROR("couldn't allocate room to migrate ring log file");
+        goto exit;
+    }
+    STATS_ADD(log, io_calls, 1);
+    if (!ring_log_io_read(log, 0, image, file_size)) {
+        RING_LOG_ERROR("ring_log_io_read failed");
+        goto exit;
+    }
+
+    v0_file_header_t v0_header;
+    memcpy(&v0_header, image, sizeof(v0_header));
+    // Version 0 stored a tail of 0 when an entry ended right at the end of
+    // the file, which is the same spot as just after the header.
+    if (v0_header.tail == 0) {
+        v0_header.tail = sizeof(v0_header);
+    }
+    if (v0_header.head < sizeof(v0_header) || v0_header.head >= file_size ||
+        v0_header.tail < sizeof(v0_header) || v0_header.tail >= file_size) {
+        RING_LOG_ERROR("not a ring log file");
+        goto exit;
+    }
+
+    // Start over with an empty log, and write the old entries back into it.
+    log->file_header = (file_header_t) {
+        .magic = RING_LOG_MAGIC,
+        .version = RING_LOG_VERSION,
+        .head = sizeof(file_header_t), .tail = sizeof(file_header_t),
+        .head_seq = 0, .tail_seq = 0
+    };
+    log->synced_tail = log->file_header.tail;
+    log->synced_seq = log->file_header.tail_seq;
+    if (!write_file_header(log)) {
+        RING_LOG_ERROR("write_file_header failed");
+        goto exit;
+    }
+    off_t off = v0_header.head;
+    off_t copied = 0;
+    while (off != v0_header.tail) {
+        v0_entry_header_t v0_entry_header;
+        off = v0_copy(image, file_size, off, (void *)&v0_entry_header, sizeof(v0_entry_header));
+        copied += sizeof(v0_entry_header) + v0_entry_header.len;
+        // An entry that lapped the ring left the rest of the log corrupted,
+        // there's nothing more worth keeping.
+        if (copied > v0_ring_size) {
+            RING_LOG_MSG("dropping corrupted entries");
+            break;
+        }
+        off = v0_copy(image, file_size, off, entry + ENTRY_HEADER_MAX, v0_entry_header.len);
+        uint32_t crc = crc_update(CRC_INIT, entry + ENTRY_HEADER_MAX, v0_entry_header.len);
+        if (!write_entry(log, entry, v0_entry_header.len, 0, 0, crc)) {
+            RING_LOG_ERROR("write_entry failed");
+            goto exit;
+        }
+    }
+
+    // Make sure that the migrated log is on the disk, whatever the log's
+    // durability.
+    if (!write_file_header(log)) {
+        RING_LOG_ERROR("write_file_header failed");
+        goto exit;
+    }
+    ring_log_io_flush(log);
+    STATS_ADD(log, io_calls, 1);
+    if (!ring_log_io_sync(log)) {
+        RING_LOG_ERROR("ring_log_io_sync failed");
+        goto exit;
+    }
+    log->unsynced_entries = 0;
+    log->unsynced_bytes = 0;
+    ok = 1;
+
+exit:
+    free(image);
+    free(entry);
+    return ok;
+}
+
+// recover checks the entries after the last known good tail (or after the
+// head, if the head has moved past it), up to the first one that doesn't check
+// out, and makes that the tail. This drops entries that only partly made it
+// into the file, and picks up entries that made it into the file, but not into
+// the file header. It returns 0 on error.
+static int recover(log_t *log) {
+    file_header_t *file_header = &log->file_header;
+    off_t off = file_header->head;
+    uint64_t seq = file_header->head_seq;
+    if (file_header->good_seq > file_header->head_seq && file_header->good_seq <= file_header->tail_seq &&
+        file_header->good_tail >= sizeof(file_header_t) && file_header->good_tail < RING_LOG_FILE_SIZE(log->capacity)) {
+        off = file_header->good_tail;
+        seq = file_header->good_seq;
+    }
+
+    // How much of the ring the entries from the head up to `off` take up. The
+    // entries can't take up all of it.
+    off_t used = distance(log, file_header->head, off);
+    // Where the entry that the entries checked so far end in starts, see
+    // stable_tail.
+    off_t chain_off = off;
+    uint64_t chain_seq = seq;
+    int continued = 0;
+    while (1) {
+        char header[ENTRY_HEADER_MAX];
+        entry_header_t entry_header;
+        if (read_wrap(log, off, header, sizeof(header)) == -1) {
+            RING_LOG_ERROR("read_wrap failed");
+            return 0;
+        }
+        int width = get_entry_header(header, &entry_header);
+        if (width == 0 || entry_header.seq != (uint32_t)seq || entry_header.len >= log->capacity ||
+            used + width + entry_header.len >= log->capacity) {
+            break;
+        }
+
+        off_t contents = advance(log, off, width);
+        uint32_t crc = CRC_INIT;
+        if (!file_crc(log, contents, entry_header.len, &crc)) {
+            RING_LOG_ERROR("file_crc failed");
+            return 0;
+        }
+        if (entry_crc(crc, &entry_header) != entry_header.crc) {
+            break;
+        }
+
+        off_t next = next_entry(log, contents, entry_header.len);
+        used += width + entry_header.len + distance(log, advance(log, contents, entry_header.len), next);
+        off = next;
+        seq++;
+        continued = entry_header.continued;
+        if (!continued) {
+            chain_off = off;
+            chain_seq = seq;
+        }
+    }
+
+    // An entry whose last piece (see entry_header_t) didn't make it goes as a
+    // whole.
+    off = chain_off;
+    seq = chain_seq;
+
+    // The entries up to the new tail have just been checked, so they're known
+    // to be good from now on.
+    log->synced_tail = off;
+    log->synced_seq = seq;
+    if (off != file_header->tail || seq != file_header->tail_seq) {
+        file_header->tail = off;
+        file_header->tail_seq = seq;
+        if (!write_file_header(log)) {
+            RING_LOG_ERROR("write_file_header failed");
+            return 0;
+        }
+        ring_log_io_flush(log);
+        STATS_ADD(log, io_calls, 1);
+        if (!ring_log_io_sync(log)) {
+            RING_LOG_ERROR("ring_log_io_sync failed");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int ring_log_init(void) {
+    ring_log_arch_init();
+
+    crc_init_table();
+    crc_update = crc_have_hw() ? crc_update_hw : crc_update_table;
+
+    // Check that the capacities will do, and which of them are powers of two.
+    for (int i = 0; i < n_logs; i++) {
+        off_t capacity = logs[i].capacity;
+        if (capacity <= 0) {
+            RING_LOG_ERROR("ring log capacity is not set");
+            return 0;
+        }
+        int pow2 = (capacity & (capacity - 1)) == 0;
+#ifdef RING_LOG_POW2_CAPACITY
+        if (!pow2) {
+            RING_LOG_ERROR("ring log capacity is not a power of two");
+            return 0;
+        }
+#endif
+        logs[i].ring_mask = pow2 ? capacity - 1 : 0;
+
+        // A program page needs a header journal, and room for a few pages.
+        if (logs[i].program_page != 0 && (logs[i].header_slots == 0 || 2 * (off_t)logs[i].program_page > capacity)) {
+            RING_LOG_ERROR("ring log program page doesn't fit");
+            return 0;
+        }
+
+        // Consumers' names have to fit in their slots.
+        for (uint32_t j = 0; j < logs[i].n_consumers; j++) {
+            const char *name = logs[i].consumers[j].name;
+            if (name == NULL || strlen(name) > RING_LOG_CONSUMER_NAME_MAX) {
+                RING_LOG_ERROR("ring log consumer name doesn't fit");
+                return 0;
+            }
+        }
+        memset(&logs[i].stats, 0, sizeof(logs[i].stats));
+    }
+
+    // The config's static assert only knows the capacities. Check that the
+    // files, with their header journals and consumers' slots, leave the fs the
+    // 20% of the partition that ring_log_config.c keeps free.
+    off_t files_size = 0;
+    for (int i = 0; i < n_logs; i++) {
+        files_size += RING_LOG_LOG_FILE_SIZE(&logs[i]);
+    }
+    if (files_size > logs_partition_size * 8 / 10) {
+        RING_LOG_ERROR("ring log files don't fit in the partition");
+        return 0;
+    }
+
+    if (!open_files()) {
+        RING_LOG_ERROR("open_files failed");
+        return 0;
+    }
+
+    // For each of the logs,
+    for (int i = 0; i < n_logs; i++) {
+        // Check that the file is the right size.
+        if (lseek(logs[i].fd, 0, SEEK_END) != RING_LOG_LOG_FILE_SIZE(&logs[i])) {
+            RING_LOG_ERROR("ring log file is not the right size");
+            return 0;
+        }
+
+        // Check that there's room to compress and decompress entries that
+        // fill the staging buffer, and for an spsc log's reader, to read them
+        // in while the writer compresses the next one (see log_t).
+        if (logs[i].compress_buffer != NULL && logs[i].compress_buffer_size < (logs[i].spsc ? 3 : 2) * logs[i].staging_size) {
+            RING_LOG_ERROR("compress buffer is too small");
+            return 0;
+        }
+
+        // Read in the header and set up per-log variables.
+        if (!ring_log_io_open(&logs[i])) {
+            RING_LOG_ERROR("ring_log_io_open failed");
+            return 0;
+        }
+        STATS_ADD(&logs[i], io_calls, 1);
+        if (!ring_log_io_read(&logs[i], 0, (void *)&(logs[i].file_header), sizeof(logs[i].file_header))) {
+            RING_LOG_ERROR("couldn't read ring log file header");
+            return 0;
+        }
+        if (logs[i].header_slots > 0 && !read_journal(&logs[i])) {
+            RING_LOG_ERROR("read_journal failed");
+            return 0;
+        }
+        logs[i].index_first = logs[i].index_count = 0;
+        logs[i].index_partial = 0;
+        // An spsc log only works as one (see log_t) once it's all set up.
+        int spsc = logs[i].spsc;
+        logs[i].spsc = 0;
+        logs[i].unsynced_entries = 0;
+        logs[i].unsynced_bytes = 0;
+        logs[i].syncing = 0;
+        logs[i].unpacked_seq = UINT64_MAX;
+
+        // Files without a magic number are from before the file format had a
+        // version, bring those up to date first.
+        if (logs[i].file_header.magic != RING_LOG_MAGIC) {
+            if (!migrate_v0(&logs[i])) {
+                RING_LOG_ERROR("migrate_v0 failed");
+                return 0;
+            }
+        } else if (logs[i].file_header.version != RING_LOG_VERSION) {
+            RING_LOG_ERROR("unsupported ring log file version");
+            return 0;
+        } else if (!check_off(&logs[i], logs[i].file_header.head) || !check_off(&logs[i], logs[i].file_header.tail)) {
+            RING_LOG_ERROR("corrupted ring log file header");
+            return 0;
+        }
+
+        // Find the real tail, in case the last run didn't get to finish
+        // writing entries.
+        if (!recover(&logs[i])) {
+            RING_LOG_ERROR("recover failed");
+            return 0;
+        }
+
+        // Index the entries that are already in the log.
+        if (!index_fill(&logs[i])) {
+            RING_LOG_ERROR("index_fill failed");
+            return 0;
+        }
+
+        // Each consumer carries on from where it got to.
+        for (uint32_t j = 0; j < logs[i].n_consumers; j++) {
+            if (!load_consumer(&logs[i], j)) {
+                RING_LOG_ERROR("load_consumer failed");
+                return 0;
+            }
+        }
+
+        logs[i].batch_seq = logs[i].batch_end_seq = logs[i].file_header.head_seq;
+        logs[i].batch_count = 0;
+        logs[i].new_tail_started = 0;
+        logs[i].new_tail_truncated = 0;
+        logs[i].chaining = 0;
+        logs[i].new_tail_failed = 0;
+        logs[i].staged = 0;
+        logs[i].reserved = 0;
+        logs[i].mutex = ring_log_arch_new_mutex();
+        if (logs[i].mutex == NULL) {
+            RING_LOG_ERROR("couldn't create mutex");
+            return 0;
+        }
+        if (spsc && (logs[i].head_mutex = ring_log_arch_new_mutex()) == NULL) {
+            RING_LOG_ERROR("couldn't create mutex");
+            return 0;
+        }
+        logs[i].published_tail = logs[i].file_header.tail;
+        logs[i].published_head = logs[i].file_header.head;
+        logs[i].published_head_seq = logs[i].file_header.head_seq;
+        snap_head(&logs[i]);
+        // The entries that are there already aren't in an spsc log's index.
+        if (spsc) {
+            logs[i].index_count = 0;
+            logs[i].index_partial = 0;
+            logs[i].index_from_seq = logs[i].index_size > 0 ? logs[i].file_header.tail_seq : UINT64_MAX;
+        }
+        logs[i].spsc = spsc;
+        if (logs[i].async_queue != NULL && !async_start(&logs[i])) {
+            RING_LOG_ERROR("async_start failed");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void ring_log_deinit(void) {
+    ring_log_flush();
+
+    // Close each of the log files, after stopping the flusher threads and
+    // committing any entries that are still waiting for a group commit.
+    for (int i = 0; i < n_logs; i++) {
+        if (logs[i].async_queue != NULL) {
+            async_stop(&logs[i]);
+        }
+        if (logs[i].unsynced_entries > 0) {
+            lock(&logs[i]);
+            group_commit(&logs[i], 1);
+            ring_log_arch_free_mutex(logs[i].mutex);
+        }
+        // The file header of an spsc log might not have the head that the
+        // reader got to yet.
+        if (logs[i].spsc) {
+            snap_head(&logs[i]);
+            RING_LOG_EXPECT_NOT(write_file_header(&logs[i]), 0);
+            ring_log_arch_delete_mutex(logs[i].head_mutex);
+        }
+        ring_log_io_close(&logs[i]);
+        close(logs[i].fd);
+        ring_log_arch_delete_mutex(logs[i].mutex);
+    }
+
+    ring_log_arch_deinit();
+}
+
+static int str_compare(const char *p1, const char *p2) {
+    if (p1 == NULL || p2 == NULL) {
+        RING_LOG_ERROR("NULL inputs");
+        return -1;
+    }
+
+    while (1) {
+        if (*p1 == '\0' && *p2 == '\0') {
+            return 0;
+        }
+        if (*p1 != *p2) {
+            return (int)*p2 - (int)*p1;
+        }
+        p1++;
+        p2++;
+    }
+
+    return 0;
+}
+
+ring_log_handle_t ring_log_open(const char *log_fn) {
+    // Find the struct for this log. The list of logs never changes, so this
+    // doesn't need the lock.
+    for (int i = 0; i < n_logs; i++) {
+        if (!str_compare(logs[i].fn, log_fn)) {
+            return &logs[i];
+        }
+    }
+
+    RING_LOG_ERROR("didn't find the struct corresponding to log");
+    return NULL;
+}
+
+// start_tail starts a new tail entry (or the next piece of one, see
+// ring_log_oversize_t), which `len` bytes are about to be written to. The
+// entry header goes at the front of the staging buffer, if there is one.
+// Otherwise, the header is padded out, so that it can be filled in once the
+// length is known. It returns 0 on error.
+static int start_tail(log_t *log, size_t len) {
+    log->new_tail_header.len = 0;
+    log->new_tail_header.compressed = 0;
+    log->new_tail_header.continued = 0;
+    log->new_tail_header.seq = log->file_header.tail_seq;
+    log->new_tail_header.crc = 0;
+    log->new_tail_crc = CRC_INIT;
+    log->new_tail_started = 1;
+    log->new_tail_failed = 0;
+    log->new_tail_truncated = 0;
+    log->tail_owner = ring_log_arch_self();
+    // The first piece goes wherever the tail is when it's written.
+    log->new_tail_room = log->chaining ? entry_room(log, log->chain_start) : piece_room(log, 0);
+    if (ENTRY_HEADER_MAX + len <= log->staging_size) {
+        log->staged = ENTRY_HEADER_MAX;
+        return 1;
+    }
+    char header[ENTRY_HEADER_MAX];
+    put_entry_header(header, &(log->new_tail_header), VARINT_MAX);
+    if ((log->new_tail_end_offset = write_wrap(log, 1, log->file_header.tail, header, sizeof(header))) == -1) {
+        log->new_tail_failed = 1;
+        STATS_ADD(log, tails_failed, 1);
+        return 0;
+    }
+    return 1;
+}
+
+// append_tail adds `len` bytes to the new tail entry, which has room for them.
+// It returns 0 on error.
+static int append_tail(log_t *log, const void *p, size_t len) {
+    log->new_tail_crc = crc_update(log->new_tail_crc, p, len);
+
+    if (log->staged) {
+        // If there's still room in the staging buffer, just add to it.
+        if (log->staged + len <= log->staging_size) {
+            memcpy(log->staging + log->staged, p, len);
+            log->staged += len;
+            log->new_tail_header.len += len;
+            return 1;
+        }
+
+        // Otherwise, the entry is too big to stage: write out what we have so
+        // far and carry on writing straight into the file.
+        put_entry_header(log->staging, &(log->new_tail_header), VARINT_MAX);
+        off_t off = write_wrap(log, 1, log->file_header.tail, log->staging, log->staged);
+        log->staged = 0;
+        if (off == -1) {
+            log->new_tail_failed = 1;
+            STATS_ADD(log, tails_failed, 1);
+            return 0;
+        }
+        log->new_tail_end_offset = off;
+    }
+
+    // Write into the new tail, right after what has been written so far.
+    off_t off;
+    if ((off = write_wrap(log, 1, log->new_tail_end_offset, p, len)) == -1) {
+        log->new_tail_failed = 1;
+        STATS_ADD(log, tails_failed, 1);
+        return 0;
+    }
+    log->new_tail_end_offset = off;
+    log->new_tail_header.len += len;
+    return 1;
+}
+
+// truncate_tail puts RING_LOG_TRUNCATED_MARKER at the end of the new tail
+// entry, which has been cut short, and works out its CRC again. It returns 0
+// on error.
+static int truncate_tail(log_t *log) {
+    size_t len = log->new_tail_header.len;
+    size_t cut = len - marker_len(len);
+    if (log->staged) {
+        memcpy(log->staging + ENTRY_HEADER_MAX + cut, RING_LOG_TRUNCATED_MARKER, len - cut);
+        log->new_tail_crc = crc_update(CRC_INIT, log->staging + ENTRY_HEADER_MAX, len);
+        return 1;
+    }
+    off_t contents = advance(log, log->file_header.tail, ENTRY_HEADER_MAX);
+    if (write_wrap(log, 0, advance(log, contents, cut), RING_LOG_TRUNCATED_MARKER, len - cut) == -1 ||
+        !file_crc(log, contents, cut, &log->new_tail_crc)) {
+        RING_LOG_ERROR("couldn't write marker");
+        return 0;
+    }
+    log->new_tail_crc = crc_update(log->new_tail_crc, RING_LOG_TRUNCATED_MARKER, len - cut);
+    return 1;
+}
+
+// finish_tail makes the new tail entry (or piece of one, if `continued`) part
+// of the log. It returns 0 on error.
+static int finish_tail(log_t *log, int continued) {
+    log->new_tail_started = 0;
+    if (log->new_tail_truncated && !truncate_tail(log)) {
+        RING_LOG_ERROR("truncate_tail failed");
+        return 0;
+    }
+    if (!log->chaining) {
+        log->chain_start = log->file_header.tail;
+        log->chain_seq = log->file_header.tail_seq;
+    }
+    if (continued) {
+        log->chaining = 1;
+    }
+
+    entry_header_t *entry_header = &(log->new_tail_header);
+    entry_header->continued = continued;
+    if (log->staged) {
+        // The whole entry is in the staging buffer: compress it if that's
+        // worth it, evict whatever is in the way and write out the entry
+        // header and contents in one go.
+        log->staged = 0;
+        return write_staged(log, entry_header->len, continued, log->new_tail_crc);
+    }
+
+    // Update the size and CRC in the log entry's header, and the tail in the
+    // log's header.
+    entry_header->crc = entry_crc(log->new_tail_crc, entry_header);
+    char header[ENTRY_HEADER_MAX];
+    put_entry_header(header, entry_header, VARINT_MAX);
+    if (write_wrap(log, 0, log->file_header.tail, header, sizeof(header)) == -1) {
+        RING_LOG_ERROR("write_wrap failed");
+        return 0;
+    }
+    off_t contents = advance(log, log->file_header.tail, sizeof(header));
+    return commit_tail(log, contents, entry_header, log->new_tail_end_offset);
+}
+
+void ring_log_write_tail_h(ring_log_handle_t log, const void *p, size_t len) {
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    if (log->new_tail_failed || log->reserved) {
+        // If we got an error earlier, or the tail entry is reserved, stop
+        // here.
+        goto exit;
+    }
+
+    // If a new tail entry hasn't been started yet, start one.
+    if (!log->new_tail_started && !start_tail(log, len)) {
+        goto exit;
+    }
+
+    // Once the entry has as much as it has room for, it carries on in a new
+    // piece (see ring_log_oversize_t), or the rest of it is dropped.
+    while (!log->new_tail_truncated) {
+        size_t now = log->new_tail_room - log->new_tail_header.len;
+        if (len <= now) {
+            append_tail(log, p, len);
+            break;
+        }
+        if (!append_tail(log, p, now)) {
+            break;
+        }
+        if (!chain_can_grow(log, log->chaining ? log->chain_start : log->file_header.tail, log->new_tail_room)) {
+            log->new_tail_truncated = 1;
+            break;
+        }
+        if (!finish_tail(log, 1)) {
+            RING_LOG_ERROR("finish_tail failed");
+            log->new_tail_started = log->new_tail_failed = 1;
+            STATS_ADD(log, tails_failed, 1);
+            break;
+        }
+        p = (const char *)p + now;
+        len -= now;
+        if (!start_tail(log, len)) {
+            break;
+        }
+    }
+
+exit:
+    ring_log_arch_free_mutex(log->mutex);
+}
+
+void ring_log_write_tail_complete_h(ring_log_handle_t log) {
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    // We didn't start a tail entry (or it's reserved), so don't do anything.
+    if (!log->new_tail_started || log->reserved) {
+        goto exit;
+    }
+
+    // If we started a new tail entry, but we ran into an error, then just
+    // abandon the new tail entry. If it's the next piece of one, the pieces
+    // written so far still need a last one.
+    if (log->new_tail_failed) {
+        log->new_tail_started = 0;
+        log->new_tail_failed = 0;
+        log->staged = 0;
+        if (log->chaining) {
+            end_chain(log);
+        }
+        goto exit;
+    }
+
+    if (!finish_tail(log, 0)) {
+        RING_LOG_ERROR("finish_tail failed");
+        if (log->chaining) {
+            end_chain(log);
+        }
+    }
+    log->chaining = 0;
+
+    group_commit(log, 0);
+
+exit:
+    ring_log_arch_free_mutex(log->mutex);
+}
+
+int ring_log_writev(ring_log_handle_t log, const struct iovec *iov, int iovcnt) {
+    if (log->async_queue != NULL) {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            len += iov[i].iov_len;
+        }
+        if (len <= log->async_entry_size) {
+            return async_push(log, iov, iovcnt, len);
+        }
+        // Too big for the queue: write it out right after the entries that
+        // are in the queue already.
+        if (!async_flush(log)) {
+            STATS_ADD(log, tails_failed, 1);
+            return 0;
+        }
+    }
+
+    int ret = 0;
+
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    if (tail_busy(log)) {
+        goto exit;
+    }
+    if (!write_entryv(log, iov, iovcnt)) {
+        RING_LOG_ERROR("write_entryv failed");
+        goto exit;
+    }
+    ret = 1;
+    group_commit(log, 0);
+
+exit:
+    if (!ret) {
+        STATS_ADD(log, tails_failed, 1);
+    }
+    ring_log_arch_free_mutex(log->mutex);
+    return ret;
+}
+
+// start_reserved starts a new tail entry of `len` bytes for ring_log_reserve,
+// at the tail in the file if it's mapped in, and in the staging buffer
+// otherwise, and fills in `resv`. It returns 0 if there's no room for it, or
+// on error.
+static int start_reserved(log_t *log, size_t len, ring_log_resv_t *resv) {
+    off_t contents = advance(log, log->file_header.tail, ENTRY_HEADER_MAX);
+    char *map = ring_log_io_map(log, contents);
+
+    log->new_tail_header.len = 0;
+    log->new_tail_header.compressed = 0;
+    log->new_tail_header.continued = 0;
+    log->new_tail_header.seq = log->file_header.tail_seq;
+    log->new_tail_header.crc = 0;
+
+    if (map == NULL) {
+        if (ENTRY_HEADER_MAX + len > log->staging_size) {
+            return 0;
+        }
+        resv->span[0] = log->staging + ENTRY_HEADER_MAX;
+        resv->len[0] = len;
+        log->staged = ENTRY_HEADER_MAX + len;
+        return 1;
+    }
+
+    // Evict everything in the way of the whole entry up front, and write a
+    // padded out entry header, as for a tail entry too big to stage, so that
+    // the contents can go straight in after it.
+    char header[ENTRY_HEADER_MAX];
+    put_entry_header(header, &(log->new_tail_header), VARINT_MAX);
+    if (!reserve(log, sizeof(header) + len) ||
+        write_wrap(log, 0, log->file_header.tail, header, sizeof(header)) == -1) {
+        RING_LOG_ERROR("couldn't start reserved entry");
+        return 0;
+    }
+    size_t first = RING_LOG_FILE_SIZE(log->capacity) - contents;
+    if (first > len) {
+        first = len;
+    }
+    resv->span[0] = map;
+    resv->len[0] = first;
+    if (first < len) {
+        resv->span[1] = ring_log_io_map(log, sizeof(file_header_t));
+        resv->len[1] = len - first;
+    }
+    log->staged = 0;
+    log->new_tail_end_offset = advance(log, contents, len);
+    return 1;
+}
+
+void *ring_log_reserve(ring_log_handle_t log, size_t len, ring_log_resv_t *resv) {
+    void *ret = NULL;
+    resv->log = log;
+    resv->span[0] = resv->span[1] = NULL;
+    resv->len[0] = resv->len[1] = 0;
+
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    if (log->new_tail_started || log->chaining || len > piece_room(log, 0)) {
+        goto exit;
+    }
+    if (!start_reserved(log, len, resv)) {
+        goto exit;
+    }
+    log->new_tail_crc = CRC_INIT;
+    log->new_tail_started = 1;
+    log->new_tail_failed = 0;
+    log->new_tail_truncated = 0;
+    log->tail_owner = ring_log_arch_self();
+    log->new_tail_room = len;
+    log->reserved = 1;
+    ret = resv->span[0];
+
+exit:
+    if (ret == NULL) {
+        resv->span[0] = NULL;
+        STATS_ADD(log, tails_failed, 1);
+    }
+    ring_log_arch_free_mutex(log->mutex);
+    return ret;
+}
+
+int ring_log_commit(ring_log_resv_t *resv) {
+    log_t *log = resv->log;
+    int ret = 0;
+
+    // Nothing was reserved, or it's been committed or abandoned already.
+    if (resv->span[0] == NULL) {
+        return 0;
+    }
+
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    if (!log->reserved) {
+        goto exit;
+    }
+    log->reserved = 0;
+    for (int i = 0; i < 2; i++) {
+        log->new_tail_crc = crc_update(log->new_tail_crc, resv->span[i], resv->len[i]);
+        log->new_tail_header.len += resv->len[i];
+    }
+    if (!finish_tail(log, 0)) {
+        RING_LOG_ERROR("finish_tail failed");
+        goto exit;
+    }
+    ret = 1;
+    group_commit(log, 0);
+
+exit:
+    if (!ret) {
+        STATS_ADD(log, tails_failed, 1);
+    }
+    resv->span[0] = NULL;
+    ring_log_arch_free_mutex(log->mutex);
+    return ret;
+}
+
+// The tail hasn't moved, so there's nothing to undo in the file: whatever was
+// written after it is just left there.
+void ring_log_abandon(ring_log_resv_t *resv) {
+    log_t *log = resv->log;
+
+    // Nothing was reserved, or it's been committed or abandoned already.
+    if (resv->span[0] == NULL) {
+        return;
+    }
+
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    if (log->reserved) {
+        log->reserved = 0;
+        log->new_tail_started = 0;
+        log->staged = 0;
+    }
+    resv->span[0] = NULL;
+
+    ring_log_arch_free_mutex(log->mutex);
+}
+
+int ring_log_flush(void) {
+    int ret = 1;
+    for (int i = 0; i < n_logs; i++) {
+        if (logs[i].async_queue != NULL && !async_flush(&logs[i])) {
+            ret = 0;
+        }
+    }
+    return ret;
+}
+
+int ring_log_has_unread_h(ring_log_handle_t log) {
+    // The head and tail of an spsc log are only ever published between whole
+    // entries, so there's no need for the lock.
+    if (log->spsc) {
+        return __atomic_load_n(&log->published_head, __ATOMIC_ACQUIRE) !=
+            __atomic_load_n(&log->published_tail, __ATOMIC_ACQUIRE);
+    }
+
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    int ret = has_readable(log);
+
+    // An entry isn't there to be read until all of its pieces are.
+    if (ret) {
+        ret = head_pieces(log);
+        if (ret == -1) {
+            RING_LOG_ERROR("head_pieces failed");
+            ret = 0;
+        }
+        ret = ret > 0;
+    }
+
+    unlock_read(log);
+
+    return ret;
+}
+
+int ring_log_read_head_h(ring_log_handle_t log, void *p, size_t len, size_t *read_total) {
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // There is an entry to be read if head != tail.
+    if (!has_readable(log)) {
+        RING_LOG_ERROR("there is no entry to read, use ring_log_has_unread() first");
+        goto fail;
+    }
+
+    // If we haven't read in the whole entry, read in as much of what is
+    // remaining as we have `len` for, right after the stuff that we have read
+    // already.
+    size_t entry_total;
+    ssize_t to_read = read_chain(log, *read_total, p, len, &entry_total);
+    if (to_read == -1) {
+        RING_LOG_ERROR("read_chain failed");
+        goto fail;
+    }
+    *read_total += to_read;
+
+    unlock_read(log);
+    return to_read;
+fail:
+    unlock_read(log);
+    return -1;
+}
+
+void ring_log_read_head_success_h(ring_log_handle_t log) {
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // Check that there is an entry to be read at all.
+    if (!has_readable(log)) {
+        RING_LOG_ERROR("there is no entry to read, use ring_log_has_unread() first");
+        goto exit;
+    }
+
+    // Figure out where the next entry starts and store that new head in the header.
+    int n = evict_chain(log);
+    RING_LOG_EXPECT_NOT(n, 0);
+    STATS_ADD(log, entries_read, n);
+    RING_LOG_EXPECT_NOT(store_head(log), 0);
+
+exit:
+    unlock_read(log);
+}
+
+void ring_log_sync_h(ring_log_handle_t log) {
+    // Lock: only one task works with the log at a time.
+    lock(log);
+
+    group_commit(log, 1);
+
+    ring_log_arch_free_mutex(log->mutex);
+}
+
+int ring_log_get_stats(ring_log_handle_t log, ring_log_stats_t *stats) {
+#ifdef RING_LOG_STATS
+    stats->entries_written = __atomic_load_n(&log->stats.entries_written, __ATOMIC_RELAXED);
+    stats->bytes_written = __atomic_load_n(&log->stats.bytes_written, __ATOMIC_RELAXED);
+    stats->entries_evicted = __atomic_load_n(&log->stats.entries_evicted, __ATOMIC_RELAXED);
+    stats->entries_read = __atomic_load_n(&log->stats.entries_read, __ATOMIC_RELAXED);
+    stats->entries_dropped = __atomic_load_n(&log->stats.entries_dropped, __ATOMIC_RELAXED);
+    stats->tails_failed = __atomic_load_n(&log->stats.tails_failed, __ATOMIC_RELAXED);
+    stats->io_calls = __atomic_load_n(&log->stats.io_calls, __ATOMIC_RELAXED);
+    stats->lock_acquisitions = __atomic_load_n(&log->stats.lock_acquisitions, __ATOMIC_RELAXED);
+    stats->lock_wait_us = __atomic_load_n(&log->stats.lock_wait_us, __ATOMIC_RELAXED);
+    stats->max_fill_bytes = __atomic_load_n(&log->stats.max_fill_bytes, __ATOMIC_RELAXED);
+    stats->max_fill_entries = __atomic_load_n(&log->stats.max_fill_entries, __ATOMIC_RELAXED);
+    return 1;
+#else
+    (void)log;
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+#endif
+}
+
+int ring_log_cursor_begin(ring_log_handle_t log, ring_log_cursor_t *cursor) {
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // There is an entry to be read if head != tail, and all of its pieces
+    // have been written.
+    int pieces = has_readable(log) ? head_pieces(log) : 0;
+    if (pieces <= 0) {
+        RING_LOG_EXPECT_NOT(pieces, -1);
+        unlock_read(log);
+        return pieces;
+    }
+
+    // Remember where the contents of the head entry start, and how long it is.
+    entry_header_t entry_header;
+    off_t off = head_entry(log, &entry_header);
+    size_t len;
+    if (off == -1 || read_chain(log, 0, NULL, 0, &len) == -1) {
+        RING_LOG_ERROR("couldn't read head entry");
+        unlock_read(log);
+        return -1;
+    }
+    cursor->log = log;
+    cursor->off = off;
+    cursor->entry_header = entry_header;
+    cursor->piece_seq = cursor->seq = log->file_header.head_seq;
+    cursor->piece_at = 0;
+    cursor->len = cursor->remaining = len;
+
+    unlock_read(log);
+    return 1;
+}
+
+int ring_log_cursor_read(ring_log_cursor_t *cursor, void *p, size_t len) {
+    log_t *log = cursor->log;
+
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // If the head has moved on, the entry has been evicted from under us.
+    if (cursor->seq != log->file_header.head_seq) {
+        unlock_read(log);
+        return -1;
+    }
+
+    // Read in as much of what is remaining as we have `len` for, from the
+    // piece the cursor is in on.
+    size_t to_read = len < cursor->remaining ? len : cursor->remaining;
+    size_t pos = cursor->len - cursor->remaining;
+    size_t done = 0;
+    while (done < to_read) {
+        ssize_t piece_len = entry_len(log, cursor->piece_seq, cursor->off, &cursor->entry_header);
+        if (piece_len == -1) {
+            RING_LOG_ERROR("entry_len failed");
+            unlock_read(log);
+            return -1;
+        }
+
+        // Once the piece has been read, move on to the next one.
+        if (pos + done == cursor->piece_at + piece_len) {
+            off_t next = next_entry(log, cursor->off, cursor->entry_header.len);
+            next = nth_entry(log, cursor->piece_seq + 1 - cursor->seq, next, &cursor->entry_header);
+            if (next == -1) {
+                RING_LOG_ERROR("nth_entry failed");
+                unlock_read(log);
+                return -1;
+            }
+            cursor->off = next;
+            cursor->piece_seq++;
+            cursor->piece_at += piece_len;
+            continue;
+        }
+
+        size_t from = pos + done - cursor->piece_at;
+        size_t now = piece_len - from < to_read - done ? piece_len - from : to_read - done;
+        if (!read_entry(log, cursor->piece_seq, cursor->off, &cursor->entry_header, from, (char *)p + done, now)) {
+            RING_LOG_ERROR("read_entry failed");
+            unlock_read(log);
+            return -1;
+        }
+        done += now;
+    }
+    cursor->remaining -= to_read;
+
+    unlock_read(log);
+    return to_read;
+}
+
+void ring_log_cursor_commit(ring_log_cursor_t *cursor) {
+    log_t *log = cursor->log;
+
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // If the entry has been evicted already, there's nothing left to do.
+    if (cursor->seq == log->file_header.head_seq) {
+        int n = evict_chain(log);
+        RING_LOG_EXPECT_NOT(n, 0);
+        STATS_ADD(log, entries_read, n);
+        RING_LOG_EXPECT_NOT(store_head(log), 0);
+    }
+
+    unlock_read(log);
+}
+
+// read_batch_each is ring_log_read_batch for logs with a compress buffer: it
+// reads the entries in one by one, decompressing them (and putting their
+// pieces back together, see entry_header_t) as it goes, and returns how many
+// it read, or -1 on error. `*pieces` is how many pieces those were.
+static int read_batch_each(log_t *log, char *p, size_t len, size_t *entry_offsets, int max_entries, int *pieces) {
+    off_t off = log->file_header.head, tail = reader_tail(log);
+    size_t out = 0;
+    int n = 0, m = 0;
+    while (n < max_entries && off != tail) {
+        size_t entry_out = out;
+        int entry_m = m;
+        int continued = 1;
+        while (continued && off != tail) {
+            entry_header_t entry_header;
+            off_t contents = nth_entry(log, m, off, &entry_header);
+            if (contents == -1) {
+                RING_LOG_ERROR("nth_entry failed");
+                return -1;
+            }
+            uint64_t seq = log->file_header.head_seq + m;
+            ssize_t piece_len = entry_len(log, seq, contents, &entry_header);
+            if (piece_len == -1) {
+                RING_LOG_ERROR("entry_len failed");
+                return -1;
+            }
+            if (out + piece_len > len) {
+                break;
+            }
+            if (!read_entry(log, seq, contents, &entry_header, 0, p + out, piece_len)) {
+                RING_LOG_ERROR("read_entry failed");
+                return -1;
+            }
+            out += piece_len;
+            off = next_entry(log, contents, entry_header.len);
+            m++;
+            continued = entry_header.continued;
+        }
+        // The entry didn't fit, or its last piece isn't there yet.
+        if (continued) {
+            out = entry_out;
+            m = entry_m;
+            break;
+        }
+        entry_offsets[n++] = entry_out;
+    }
+    entry_offsets[n] = out;
+    *pieces = m;
+    return n;
+}
+
+int ring_log_read_batch(ring_log_handle_t log, void *p, size_t len, size_t *entry_offsets, int max_entries) {
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    if (log->index_count == 0 && log->index_partial) {
+        if (!index_fill(log)) {
+            RING_LOG_ERROR("index_fill failed");
+            goto fail;
+        }
+    }
+
+    // Entries that might be compressed get decompressed one at a time.
+    int n = 0, m = 0;
+    if (log->compress_buffer != NULL) {
+        n = read_batch_each(log, p, len, entry_offsets, max_entries, &m);
+        if (n == -1) {
+            RING_LOG_ERROR("read_batch_each failed");
+            goto fail;
+        }
+        goto done;
+    }
+
+    // Figure out how many whole entries (with their headers, and all of their
+    // pieces) fit in `p`. `m` counts the pieces, `raw_len` runs up to the end
+    // of the last one, `padded_len` on to where the next one starts.
+    off_t off = log->file_header.head, tail = reader_tail(log);
+    size_t raw_len = 0, padded_len = 0;
+    while (n < max_entries && off != tail) {
+        off_t entry_off = off;
+        size_t entry_raw_len = raw_len, entry_padded_len = padded_len;
+        int entry_m = m;
+        int continued = 1;
+        while (continued && off != tail) {
+            entry_header_t entry_header;
+            off_t contents = nth_entry(log, m, off, &entry_header);
+            if (contents == -1) {
+                RING_LOG_ERROR("nth_entry failed");
+                goto fail;
+            }
+            if (entry_header.compressed) {
+                RING_LOG_ERROR("compressed entry, but the log has no compress buffer");
+                goto fail;
+            }
+            size_t raw_entry_len = distance(log, off, contents) + entry_header.len;
+            if (padded_len + raw_entry_len > len) {
+                break;
+            }
+            raw_len = padded_len + raw_entry_len;
+            off_t next = next_entry(log, contents, entry_header.len);
+            padded_len += distance(log, off, next);
+            off = next;
+            m++;
+            continued = entry_header.continued;
+        }
+        // The entry didn't fit, or its last piece isn't there yet.
+        if (continued) {
+            off = entry_off;
+            raw_len = entry_raw_len;
+            padded_len = entry_padded_len;
+            m = entry_m;
+            break;
+        }
+        n++;
+    }
+
+    // The entries sit next to each other in the file, so read them all in at
+    // once, and then squeeze out the entry headers (and any padding), which
+    // puts the pieces of each entry back together too.
+    if (read_wrap(log, log->file_header.head, p, raw_len) == -1) {
+        RING_LOG_ERROR("read_wrap failed");
+        goto fail;
+    }
+    size_t in = 0, out = 0;
+    off = log->file_header.head;
+    int continued = 0;
+    for (int i = 0, j = 0; i < m; i++) {
+        entry_header_t entry_header;
+        int width = get_entry_header((char *)p + in, &entry_header);
+        if (!continued) {
+            entry_offsets[j++] = out;
+        }
+        continued = entry_header.continued;
+        memmove((char *)p + out, (char *)p + in + width, entry_header.len);
+        out += entry_header.len;
+        off_t next = next_entry(log, advance(log, off, width), entry_header.len);
+        in += distance(log, off, next);
+        off = next;
+    }
+    entry_offsets[n] = out;
+
+done:
+    // Remember which entries these were, for ring_log_ack.
+    log->batch_seq = log->file_header.head_seq;
+    log->batch_count = n;
+    log->batch_end_seq = log->file_header.head_seq + m;
+
+    unlock_read(log);
+    return n;
+fail:
+    unlock_read(log);
+    return -1;
+}
+
+void ring_log_ack(ring_log_handle_t log, int n) {
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // Some of the entries might have been evicted since ring_log_read_batch,
+    // in which case there are fewer left to drop: count the ones that are
+    // still there (entries only ever go as a whole, see entry_header_t).
+    off_t off = log->file_header.head;
+    int left = 0;
+    for (uint64_t i = 0; log->file_header.head_seq + i < log->batch_end_seq; i++) {
+        entry_header_t entry_header;
+        off_t contents = nth_entry(log, i, off, &entry_header);
+        if (contents == -1) {
+            RING_LOG_ERROR("nth_entry failed");
+            goto exit;
+        }
+        left += !entry_header.continued;
+        off = next_entry(log, contents, entry_header.len);
+    }
+
+    int dropped = 0;
+    for (int i = n - (log->batch_count - left); i > 0 && has_readable(log); i--) {
+        int pieces = evict_chain(log);
+        RING_LOG_EXPECT_NOT(pieces, 0);
+        STATS_ADD(log, entries_read, pieces);
+        dropped = 1;
+    }
+    if (dropped) {
+        RING_LOG_EXPECT_NOT(store_head(log), 0);
+    }
+
+exit:
+    unlock_read(log);
+}
+
+ring_log_consumer_t *ring_log_consumer_open(ring_log_handle_t log, const char *name) {
+    // The consumers never change either, so this doesn't need the lock.
+    for (uint32_t i = 0; i < log->n_consumers; i++) {
+        if (!str_compare(log->consumers[i].name, name)) {
+            return &log->consumers[i];
+        }
+    }
+    return NULL;
+}
+
+// catch_up moves a consumer that the writer has lapped on to the head, and
+// counts the entries it missed.
+static void catch_up(ring_log_consumer_t *consumer) {
+    log_t *log = consumer->log;
+    if (consumer->seq < log->file_header.head_seq) {
+        consumer->lost += log->file_header.head_seq - consumer->seq;
+        consumer->off = log->file_header.head;
+        consumer->seq = consumer->next_seq = log->file_header.head_seq;
+    }
+}
+
+// consumer_next finds out where the entry after the consumer's next one
+// starts, unless it knows already. It returns 0 if there is no such entry
+// (with all of its pieces), or on error.
+static int consumer_next(ring_log_consumer_t *consumer) {
+    log_t *log = consumer->log;
+    if (consumer->next_seq != consumer->seq) {
+        return 1;
+    }
+    if (consumer->off == reader_tail(log)) {
+        return 0;
+    }
+    int pieces = chain_pieces(log, consumer->off, consumer->seq - log->file_header.head_seq, &consumer->next_off);
+    if (pieces <= 0) {
+        RING_LOG_EXPECT_NOT(pieces, -1);
+        return 0;
+    }
+    consumer->next_seq = consumer->seq + pieces;
+    return 1;
+}
+
+int ring_log_consumer_has_unread(ring_log_consumer_t *consumer) {
+    log_t *log = consumer->log;
+
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    catch_up(consumer);
+    int ret = consumer_next(consumer);
+
+    unlock_read(log);
+    return ret;
+}
+
+int ring_log_consumer_read(ring_log_consumer_t *consumer, void *p, size_t len, size_t *read_total) {
+    log_t *log = consumer->log;
+
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // If the writer has lapped the consumer partway through the entry, the
+    // rest of it is gone.
+    if (*read_total > 0 && consumer->seq < log->file_header.head_seq) {
+        catch_up(consumer);
+        goto fail;
+    }
+    catch_up(consumer);
+    if (!consumer_next(consumer)) {
+        RING_LOG_ERROR("there is no entry to read, use ring_log_consumer_has_unread() first");
+        goto fail;
+    }
+
+    size_t entry_total;
+    ssize_t to_read = read_chain_at(log, consumer->off, consumer->seq - log->file_header.head_seq, *read_total, p, len, &entry_total);
+    if (to_read == -1) {
+        RING_LOG_ERROR("read_chain_at failed");
+        goto fail;
+    }
+    *read_total += to_read;
+
+    unlock_read(log);
+    return to_read;
+fail:
+    unlock_read(log);
+    return -1;
+}
+
+void ring_log_consumer_success(ring_log_consumer_t *consumer) {
+    log_t *log = consumer->log;
+
+    // Lock: only one task works with the log at a time.
+    lock_read(log);
+
+    // Move past the entry. If the writer has lapped the consumer since it
+    // read the entry, it only missed the ones after it.
+    if (consumer->next_seq == consumer->seq) {
+        catch_up(consumer);
+        if (!consumer_next(consumer)) {
+            RING_LOG_ERROR("there is no entry to read, use ring_log_consumer_has_unread() first");
+            goto exit;
+        }
+    }
+    consumer->off = consumer->next_off;
+    consumer->seq = consumer->next_seq;
+    catch_up(consumer);
+    RING_LOG_EXPECT_NOT(store_consumer(log, consumer), 0);
+
+    // Entries that every consumer has read can go.
+    uint64_t seq = UINT64_MAX;
+    for (uint32_t i = 0; i < log->n_consumers; i++) {
+        if (log->consumers[i].seq < seq) {
+            seq = log->consumers[i].seq;
+        }
+    }
+    int dropped = 0;
+    while (log->file_header.head_seq < seq && has_readable(log)) {
+        int n = evict_chain(log);
+        if (n == 0) {
+            RING_LOG_ERROR("evict_chain failed");
+            break;
+        }
+        STATS_ADD(log, entries_read, n);
+        dropped = 1;
+    }
+    if (dropped) {
+        RING_LOG_EXPECT_NOT(store_head(log), 0);
+    }
+
+exit:
+    unlock_read(log);
+}
+
+// The functions below are the same as the _h ones, but look up the log by
+// filename on each call.
+
+void ring_log_write_tail(const char *log_fn, const void *p, size_t len) {
+    ring_log_write_tail_h(ring_log_open(log_fn), p, len);
+}
+
+void ring_log_write_tail_complete(const char *log_fn) {
+    ring_log_write_tail_complete_h(ring_log_open(log_fn));
+}
+
+int ring_log_has_unread(const char *log_fn) {
+    return ring_log_has_unread_h(ring_log_open(log_fn));
+}
+
+int ring_log_read_head(const char *log_fn, void *p, size_t len, size_t *read_total) {
+    return ring_log_read_head_h(ring_log_open(log_fn), p, len, read_total);
+}
+
+void ring_log_read_head_success(const char *log_fn) {
+    ring_log_read_head_success_h(ring_log_open(log_fn));
+}
+
+#ifdef DEBUG
+
+void sanity_check_file_size(const char *log_fn) {
+    log_t *log = ring_log_open(log_fn);
+    lock(log);
+
+    off_t file_len = lseek(log->fd, 0, SEEK_END);
+    RING_LOG_EXPECT_NOT(file_len, -1);
+    if (file_len != RING_LOG_LOG_FILE_SIZE(log)) {
+        RING_LOG_ERROR("expected file length to be RING_LOG_LOG_FILE_SIZE(log)");
+    }
+
+    ring_log_arch_free_mutex(log->mutex);
+}
+
+void sanity_check_index(const char *log_fn) {
+    log_t *log = ring_log_open(log_fn);
+    lock(log);
+
+    // Walk the entry headers in the file, and check that the index matches.
+    off_t off = log->file_header.head;
+    size_t n = 0;
+    while (off != log->file_header.tail) {
+        entry_header_t entry_header;
+        off_t contents = read_entry_header(log, off, &entry_header);
+        RING_LOG_EXPECT_NOT(contents, -1);
+        if (n < log->index_count) {
+            ring_log_index_entry_t *entry = &log->index[(log->index_first + n) % log->index_size];
+            RING_LOG_EXPECT(entry->off, contents);
+            RING_LOG_EXPECT(entry->len, entry_header.len);
+            RING_LOG_EXPECT(entry->compressed, entry_header.compressed);
+            RING_LOG_EXPECT(entry->continued, entry_header.continued);
+        }
+        off = next_entry(log, contents, entry_header.len);
+        n++;
+    }
+    if (!log->index_partial) {
+        RING_LOG_EXPECT(log->index_count, n);
     }
 
-    ring_log_arch_free_mutex();
+    ring_log_arch_free_mutex(log->mutex);
 }
 
 void debug_print(const char *log_fn) {
-    log_t *log = lock_and_find_log(log_fn);
+    log_t *log = ring_log_open(log_fn);
+    lock(log);
 
     off_t file_len = lseek(log->fd, 0, SEEK_END);
     RING_LOG_EXPECT_NOT(file_len, -1);
@@ -491,7 +3139,7 @@ void debug_print(const char *log_fn) {
     }
     putchar('\n');
 
-    ring_log_arch_free_mutex();
+    ring_log_arch_free_mutex(log->mutex);
 }
 
 #endif
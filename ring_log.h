@@ -5,26 +5,438 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+// Ring log files start with a file header, which says which version of the
+// file format the rest of the file is in. Files in an older format get
+// migrated by ring_log_init.
+#define RING_LOG_MAGIC 0x474f4c52 // "RLOG"
+#define RING_LOG_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t head;
+    uint64_t tail;
+    // The sequence number of the entry at the head, and the one that the next
+    // entry written will get. There are tail_seq - head_seq entries.
+    uint64_t head_seq;
+    uint64_t tail_seq;
+    // The last known good tail: the entries up to here are known to be on the
+    // disk, so ring_log_init only has to check the entries after it.
+    uint64_t good_tail;
+    uint64_t good_seq;
+} file_header_t;
+
+// In the file, the length is stored as a varint (with whether the entry is
+// compressed in the lowest bit), followed by the low 32 bits of the entry's
+// sequence number, and a CRC32C of the contents, the length and the sequence
+// number. The contents of a compressed entry are the length of the entry once
+// decompressed, as a varint, followed by an LZ4 block.
+//
+// An entry that's too big for one (see ring_log_oversize_t) is stored as a
+// chain of pieces, each `continued` but the last, which readers put back
+// together. That's a bit past the 64 bits of the length varint, which then
+// takes up all 10 bytes, and the CRC covers it too.
+typedef struct {
+    uint64_t len;
+    int compressed;
+    int continued;
+    uint32_t seq;
+    uint32_t crc;
+} entry_header_t;
+
+// How big the ring log file for a log with a ring of `capacity` bytes is.
+#define RING_LOG_FILE_SIZE(capacity) ((off_t)sizeof(file_header_t) + (capacity))
+
+// A log with a header journal (see log_t) doesn't rewrite the file header at
+// the start of the file, which then only says how the file started out.
+// Instead, each update goes into the next of a number of header slots after
+// the ring, taking turns, with a sequence number and a CRC32C of the rest of
+// the slot. The newest slot that checks out is the file header.
+// `program_page` is the log's, so that ring_log_init can check that entries
+// were laid out the same way.
+typedef struct {
+    file_header_t file_header;
+    uint64_t seq;
+    uint32_t program_page;
+    uint32_t crc;
+} ring_log_header_slot_t;
+
+// RING_LOG_ALIGN rounds `v` up to a multiple of `page`, unless that's 0.
+#define RING_LOG_ALIGN(v, page) ((page) ? ((v) + (page) - 1) / (page) * (page) : (v))
+
+// The header slots each start on a program page of their own (if the log has
+// a `program_page`), from the first one after the ring on.
+#define RING_LOG_HEADER_SLOT_SIZE(page) RING_LOG_ALIGN((off_t)sizeof(ring_log_header_slot_t), page)
+#define RING_LOG_JOURNAL_OFF(capacity, page) RING_LOG_ALIGN(RING_LOG_FILE_SIZE(capacity), page)
+
+// How big the ring log file for a log with a ring of `capacity` bytes and
+// `slots` header slots is (see RING_LOG_FILE_SIZE if `slots` is 0).
+#define RING_LOG_JOURNAL_FILE_SIZE(capacity, slots, page) \
+    ((slots) ? RING_LOG_JOURNAL_OFF(capacity, page) + (off_t)(slots) * RING_LOG_HEADER_SLOT_SIZE(page) : RING_LOG_FILE_SIZE(capacity))
+
+// Each of a log's consumers (see ring_log_consumer_t) keeps where it's got to
+// in a consumer slot of its own, after the ring (and the header journal, if
+// any), in the order they're configured in. Only the consumer writes its
+// slot, each time it moves on. The CRC32C is of the rest of the slot: a slot
+// that doesn't check out (or has another consumer's name in it) has the
+// consumer start over from the head.
+#ifndef RING_LOG_CONSUMER_NAME_MAX
+#define RING_LOG_CONSUMER_NAME_MAX 16
+#endif
+
+typedef struct {
+    char name[RING_LOG_CONSUMER_NAME_MAX];
+    uint64_t off;
+    uint64_t seq;
+    uint64_t lost;
+    uint32_t crc;
+} ring_log_consumer_slot_t;
+
+#define RING_LOG_CONSUMER_SLOT_SIZE(page) RING_LOG_ALIGN((off_t)sizeof(ring_log_consumer_slot_t), page)
+#define RING_LOG_CONSUMERS_OFF(capacity, slots, page) RING_LOG_ALIGN(RING_LOG_JOURNAL_FILE_SIZE(capacity, slots, page), page)
+
+// How big the ring log file for a log with `consumers` consumer slots is
+// (see RING_LOG_JOURNAL_FILE_SIZE if `consumers` is 0).
+#define RING_LOG_CONSUMERS_FILE_SIZE(capacity, slots, page, consumers) \
+    ((consumers) ? RING_LOG_CONSUMERS_OFF(capacity, slots, page) + (off_t)(consumers) * RING_LOG_CONSUMER_SLOT_SIZE(page) : \
+        RING_LOG_JOURNAL_FILE_SIZE(capacity, slots, page))
+
+// How big the ring log file for `log` is.
+#define RING_LOG_LOG_FILE_SIZE(log) \
+    RING_LOG_CONSUMERS_FILE_SIZE((log)->capacity, (log)->header_slots, (log)->program_page, (log)->n_consumers)
+
+// RING_LOG_STATIC_ASSERT fails to compile if `cond` (a constant expression)
+// is false, with `name` in the error.
+#define RING_LOG_STATIC_ASSERT(cond, name) typedef char name[(cond) ? 1 : -1]
+
+// Version 0 of the file format had no magic number, and 16-bit offsets and
+// entry lengths.
 typedef struct {
     uint16_t head;
     uint16_t tail;
-} file_header_t;
+} v0_file_header_t;
 
 typedef struct {
     uint16_t len;
-} entry_header_t;
+} v0_entry_header_t;
+
+// `off` is where the entry's contents start, right after its header.
+typedef struct {
+    uint64_t off;
+    uint64_t len;
+    int compressed;
+    int continued;
+} ring_log_index_entry_t;
+
+// How ring_log_init gets a new ring log file to the right size:
+// RING_LOG_PROVISION_FILL writes filler_byte to every byte, which works
+// everywhere. RING_LOG_PROVISION_FALLOCATE has the fs allocate the blocks
+// without writing them, and RING_LOG_PROVISION_SPARSE just sets the file size,
+// leaving it up to the fs to allocate blocks once they're written. With these
+// two, the file reads as zeroes rather than filler_byte. If the OS or fs can't
+// do them, the file is filled instead.
+typedef enum {
+    RING_LOG_PROVISION_FILL,
+    RING_LOG_PROVISION_FALLOCATE,
+    RING_LOG_PROVISION_SPARSE
+} ring_log_provision_t;
+
+// How hard ring_log_write_tail_complete tries to get the entry onto the disk:
+// RING_LOG_DURABILITY_NONE writes the entry and the file header, and leaves
+// it up to the OS when they hit the disk. RING_LOG_DURABILITY_SYNC also syncs
+// the file after every entry. RING_LOG_DURABILITY_GROUP only writes the file
+// header and syncs the file once `group_entries` entries, or `group_bytes`
+// bytes of entries, have been written since the last time, or the oldest of
+// them is `group_ms` old (0 turns a limit off). That sync covers the entries of
+// every task writing to the log, and other tasks carry on writing while it's
+// going on. The age limit is checked as entries are written, use
+// ring_log_sync_h to commit the entries written so far.
+typedef enum {
+    RING_LOG_DURABILITY_NONE,
+    RING_LOG_DURABILITY_SYNC,
+    RING_LOG_DURABILITY_GROUP
+} ring_log_durability_t;
+
+// What ring_log_writev does with an entry for a log whose async queue (see
+// log_t) is full: RING_LOG_ASYNC_BLOCK waits for the flusher thread to make
+// room. RING_LOG_ASYNC_DROP_NEWEST drops the entry, and
+// RING_LOG_ASYNC_COUNT_AND_DROP does too, but then the flusher writes an
+// entry saying how many entries were dropped ("ring_log: dropped N entries")
+// once there's room again. When an entry is dropped, ring_log_writev returns 0.
+typedef enum {
+    RING_LOG_ASYNC_BLOCK,
+    RING_LOG_ASYNC_DROP_NEWEST,
+    RING_LOG_ASYNC_COUNT_AND_DROP
+} ring_log_async_full_t;
+
+// What happens to an entry that's longer than the log's `max_entry_size`, or
+// than the ring can hold (see log_t): RING_LOG_OVERSIZE_TRUNCATE cuts it
+// short, with RING_LOG_TRUNCATED_MARKER as its last bytes, and
+// RING_LOG_OVERSIZE_FRAGMENT stores it in pieces (see entry_header_t) of up to
+// that size, which are read back as one entry. Entries too big for even that
+// get truncated. Either way, an entry never evicts more than the rest of the
+// ring.
+typedef enum {
+    RING_LOG_OVERSIZE_TRUNCATE,
+    RING_LOG_OVERSIZE_FRAGMENT
+} ring_log_oversize_t;
+
+#ifndef RING_LOG_TRUNCATED_MARKER
+#define RING_LOG_TRUNCATED_MARKER "[truncated]"
+#endif
+
+// Each slot in an async queue starts with this, followed by up to
+// `async_entry_size` bytes of the entry, padded out to 8 bytes.
+typedef struct {
+    uint64_t seq;
+    uint32_t len;
+} ring_log_async_slot_t;
+
+#define RING_LOG_ASYNC_SLOT_SIZE(entry_size) ((sizeof(ring_log_async_slot_t) + (entry_size) + 7) / 8 * 8)
+
+// How many uint64_ts an async queue of `slots` entries of up to `entry_size`
+// bytes takes up.
+#define RING_LOG_ASYNC_QUEUE_WORDS(slots, entry_size) ((slots) * RING_LOG_ASYNC_SLOT_SIZE(entry_size) / 8)
+
+// How far apart fields written by different tasks are kept in log_t, so that
+// they don't end up in the same cache line.
+#ifndef RING_LOG_CACHE_LINE
+#define RING_LOG_CACHE_LINE 64
+#endif
+
+// Counters kept per log when built with RING_LOG_STATS, see
+// ring_log_get_stats. `bytes_written` counts the entries' contents as stored
+// (compressed, if they were), `entries_evicted` the entries dropped unread to
+// make room for new ones, `entries_dropped` the entries that didn't make it
+// into a full async queue, and `io_calls` the reads, writes and syncs that the
+// I/O layer was asked to do (which needn't be syscalls: with
+// ring_log_io_mmap.c, most are a memcpy). `max_fill_bytes` and `max_fill_entries` are the
+// most the ring has held since ring_log_init.
+typedef struct {
+    uint64_t entries_written;
+    uint64_t bytes_written;
+    uint64_t entries_evicted;
+    uint64_t entries_read;
+    uint64_t entries_dropped;
+    uint64_t tails_failed;
+    uint64_t io_calls;
+    uint64_t lock_acquisitions;
+    uint64_t lock_wait_us;
+    uint64_t max_fill_bytes;
+    uint64_t max_fill_entries;
+} ring_log_stats_t;
+
+typedef struct ring_log_consumer ring_log_consumer_t;
 
 typedef struct {
     const char *fn;
+    // The file is the file header followed by a ring of `capacity` bytes for
+    // the entries, see RING_LOG_FILE_SIZE. New files are filled with
+    // `filler_byte` (see ring_log_provision_t). `ring_mask` is capacity - 1 if
+    // the capacity is a power of two, and 0 otherwise.
+    off_t capacity;
+    uint8_t filler_byte;
+    off_t ring_mask;
+    ring_log_provision_t provision;
+    ring_log_durability_t durability;
+    uint32_t group_entries;
+    size_t group_bytes;
+    uint32_t group_ms;
+    // With `header_slots`, the file header is kept in a header journal (see
+    // ring_log_header_slot_t) rather than rewritten in place, and with a
+    // `program_page` (which needs a header journal), each entry starts on a
+    // page boundary in the file, so that writing it doesn't touch the page the
+    // entry before it ended on. The unused bytes up to there count as part of
+    // the entry when it comes to making room. Both are part of the file format:
+    // changing them needs a new file.
+    uint32_t header_slots;
+    uint32_t program_page;
+    // Entries are at most `max_entry_size` bytes long (0 for as long as the
+    // ring can hold), see ring_log_oversize_t.
+    size_t max_entry_size;
+    ring_log_oversize_t oversize;
+    // A log with `consumers` (`n_consumers` of them) is read through those,
+    // each at its own pace, rather than from the head. The head then only
+    // moves to make room for new entries, or once every consumer has read
+    // the entry at the head (see ring_log_consumer_success). The consumers
+    // are part of the file format too (see RING_LOG_CONSUMER_SLOT_SIZE).
+    ring_log_consumer_t *consumers;
+    uint32_t n_consumers;
     int fd;
+    void *io;
     file_header_t file_header;
+    // The sequence number of the newest header slot.
+    uint64_t header_seq;
+    // file_header.head_seq as of the last ring_log_read_batch, how many
+    // entries it read, and the sequence number after their last piece.
+    uint64_t batch_seq;
+    int batch_count;
+    uint64_t batch_end_seq;
+    // Only one task works with the log at a time.
+    void *mutex;
+    // The task that started the new tail entry (see ring_log_arch_self).
+    void *tail_owner;
     int new_tail_started;
     int new_tail_failed;
     off_t new_tail_end_offset;
     entry_header_t new_tail_header;
+    // The CRC32C of the new tail entry's contents so far.
+    uint32_t new_tail_crc;
+    // The new tail entry takes up to `new_tail_room` bytes (see
+    // ring_log_oversize_t), and is `new_tail_truncated` once more than that
+    // has been written. While an oversized entry is being written in pieces,
+    // `chaining` is set, and the first piece starts at `chain_start`.
+    size_t new_tail_room;
+    int new_tail_truncated;
+    int chaining;
+    off_t chain_start;
+    uint64_t chain_seq;
+    // The new tail entry is collected in `staging` (if any), and only written
+    // out at ring_log_write_tail_complete -time. `staged` counts the bytes in
+    // there, including room for the longest possible entry header, or is 0 if
+    // the entry didn't fit and is being written straight into the file
+    // instead.
+    char *staging;
+    size_t staging_size;
+    size_t staged;
+    // The new tail entry is `reserved` (see ring_log_reserve), rather than
+    // being written with ring_log_write_tail_h.
+    int reserved;
+    // If there's a `compress_buffer`, which needs to be twice the size of
+    // `staging` (three times for an `spsc` log), entries that fit in the
+    // staging buffer get compressed when that makes them smaller. The first
+    // part of the buffer is for the entry being compressed, the second for the
+    // entry at `unpacked_seq` (decompressed, `unpacked_len` bytes long) while
+    // it's being read, and the third for reading that one in compressed, since
+    // an spsc log's reader doesn't wait for the writer.
+    char *compress_buffer;
+    size_t compress_buffer_size;
+    uint64_t unpacked_seq;
+    size_t unpacked_len;
+    // Where the entries start and how long they are, oldest first, so that
+    // moving the head doesn't need to read the entry headers from the file.
+    // If there are more entries than fit in `index`, `index_partial` is set
+    // and the rest get indexed once there's room again. The writer of an
+    // `spsc` log fills in the index without waiting for the reader instead:
+    // entry `seq` goes in slot `seq % index_size`, if the entry that was in
+    // there has been read already, and every entry from `index_from_seq` on
+    // is in there (none are, if it's UINT64_MAX).
+    ring_log_index_entry_t *index;
+    size_t index_size;
+    size_t index_first;
+    size_t index_count;
+    int index_partial;
+    uint64_t index_from_seq;
+    // With RING_LOG_DURABILITY_GROUP, the entries written since the last
+    // group commit, and when the first of them was written. `syncing` counts
+    // the syncs going on (without the lock) right now.
+    uint32_t unsynced_entries;
+    size_t unsynced_bytes;
+    uint64_t unsynced_since_ms;
+    int syncing;
+    // The tail and tail_seq as of the last sync, which become the file
+    // header's good_tail and good_seq the next time it's written.
+    off_t synced_tail;
+    uint64_t synced_seq;
+    // With an `async_queue` (of `async_queue_size` bytes, see
+    // RING_LOG_ASYNC_QUEUE_WORDS), ring_log_writev (and RING_LOG_PRINTF) only
+    // put the entry in the queue, which has room for `async_slots` entries of
+    // up to `async_entry_size` bytes, and a flusher thread writes them to the
+    // log in batches. `async_full` says what happens when the queue is full.
+    // Bigger entries are written out straight away, after the ones queued.
+    uint64_t *async_queue;
+    size_t async_queue_size;
+    uint32_t async_slots;
+    size_t async_entry_size;
+    ring_log_async_full_t async_full;
+    // The flusher takes entries from `async_head`, producers add them at
+    // `async_tail`, and `async_written` is how far the flusher has written
+    // them out. The flusher waits on `async_wake` (if `async_sleeping`), and
+    // sets `async_done` after every batch. `async_dropped` counts the entries
+    // dropped since the last note about them.
+    uint64_t async_head;
+    uint64_t async_tail;
+    uint64_t async_written;
+    int async_sleeping;
+    int async_stopping;
+    uint64_t async_dropped;
+    void *async_wake;
+    void *async_done;
+    void *async_thread;
+    // While the flusher writes a batch of entries, the file header only gets
+    // written once, at the end of the batch.
+    int batching;
+    // An `spsc` log is for one task writing to it (or its async queue's
+    // flusher) and one reading from it. Writers still take the log's `mutex`,
+    // but readers take `head_mutex` instead, and only wait for the writer while
+    // it evicts entries, which takes `head_mutex` too. The reader decompresses
+    // entries in a part of the `compress_buffer` of its own, which makes that
+    // three times the size of `staging` rather than twice. The writer publishes
+    // where the last whole entry ends (and the entries' slots in the `index`
+    // before that) in `published_tail`, and the reader (or the writer,
+    // evicting) where the head is in `published_head` (and its sequence number
+    // in `published_head_seq`), each in a cache line of its own:
+    // ring_log_has_unread_h only looks at those two. The reader doesn't write
+    // the file header: the ones the writer writes go by the head as of the last
+    // time the writer took `head_mutex` (`header_head` and `header_head_seq`),
+    // which it does when it catches up with that head and needs room, and at
+    // ring_log_sync_h and ring_log_deinit. So after a crash, entries read since
+    // then come back.
+    int spsc;
+    void *head_mutex;
+    off_t header_head;
+    uint64_t header_head_seq;
+    char spsc_pad0[RING_LOG_CACHE_LINE];
+    off_t published_tail;
+    char spsc_pad1[RING_LOG_CACHE_LINE];
+    off_t published_head;
+    uint64_t published_head_seq;
+    char spsc_pad2[RING_LOG_CACHE_LINE];
+    ring_log_stats_t stats;
 } log_t;
 
+typedef log_t *ring_log_handle_t;
+
+// A cursor reads the head entry bit by bit, picking up where the previous read
+// left off. `len` is how long the entry is (once decompressed, and with all of
+// its pieces, see entry_header_t). `off` and `entry_header` are those of the
+// piece the cursor is in, which has sequence number `piece_seq` and starts
+// `piece_at` bytes into the entry, so that a read doesn't have to go through
+// the pieces before it again.
+typedef struct {
+    log_t *log;
+    off_t off;
+    entry_header_t entry_header;
+    uint64_t piece_seq;
+    size_t piece_at;
+    size_t len;
+    size_t remaining;
+    // The sequence number of the entry, so that the cursor can tell that the
+    // entry is gone once the head has moved on.
+    uint64_t seq;
+} ring_log_cursor_t;
+
+// A consumer reads a log's entries in order, without dropping them, from
+// where it last got to: `off` is where the next entry for it starts, and `seq`
+// is its sequence number. A consumer that the writer has lapped (the entries
+// it hadn't read yet got evicted to make room) carries on from the head, and
+// adds how many entries it missed to `lost` (counting each piece of an
+// oversized entry, see entry_header_t). `next_off` and `next_seq` are where
+// the entry after the one it's reading starts, once it has started reading
+// it. Configure a log's consumers with just their names, the rest is filled
+// in by ring_log_init.
+struct ring_log_consumer {
+    const char *name;
+    log_t *log;
+    off_t off;
+    uint64_t seq;
+    uint64_t lost;
+    off_t next_off;
+    uint64_t next_seq;
+};
+
 #ifdef DEBUG
 
 #include <stdio.h>
@@ -52,6 +464,7 @@ typedef struct {
     } while(0);
 
 void sanity_check_file_size(const char *);
+void sanity_check_index(const char *);
 void debug_print(const char *);
 
 #else
@@ -69,11 +482,187 @@ void debug_print(const char *);
 void ring_log_arch_abort(void);
 void ring_log_arch_init(void);
 void ring_log_arch_deinit(void);
-void ring_log_arch_take_mutex(void);
-void ring_log_arch_free_mutex(void);
+void *ring_log_arch_new_mutex(void);
+void ring_log_arch_delete_mutex(void *);
+void ring_log_arch_take_mutex(void *);
+void ring_log_arch_free_mutex(void *);
+// An event counts how many times it has been set. ring_log_arch_wait_event
+// waits until the count isn't `count` anymore, or for up to `ms` ms.
+void *ring_log_arch_new_event(void);
+void ring_log_arch_delete_event(void *);
+uint32_t ring_log_arch_event_count(void *);
+void ring_log_arch_set_event(void *);
+void ring_log_arch_wait_event(void *, uint32_t, uint32_t);
+void *ring_log_arch_start_thread(void (*)(void *), void *);
+void ring_log_arch_join_thread(void *);
+// ring_log_arch_self identifies the calling task.
+void *ring_log_arch_self(void);
+int ring_log_arch_size_file(int, off_t, int);
+uint64_t ring_log_arch_now_ms(void);
+uint64_t ring_log_arch_now_us(void);
+
+// The I/O layer (ring_log_io_*.c) moves bytes in and out of an opened ring log
+// file. The read/write/sync functions return 0 on error. ring_log_io_sync
+// waits until everything written so far is on the disk. ring_log_io_map
+// returns where `off` is in memory, if the file is mapped in, and NULL
+// otherwise: writing there is the same as ring_log_io_write.
+int ring_log_io_open(log_t *);
+void ring_log_io_close(log_t *);
+int ring_log_io_read(log_t *, off_t, void *, size_t);
+int ring_log_io_write(log_t *, off_t, const void *, size_t);
+void ring_log_io_flush(log_t *);
+int ring_log_io_sync(log_t *);
+void *ring_log_io_map(log_t *, off_t);
+
+// ring_log_lz.c: ring_log_lz_compress returns the size of the compressed
+// block, or 0 if it didn't fit in `dst_len` bytes. ring_log_lz_decompress
+// returns 1 if the block decompressed to exactly `dst_len` bytes, and 0
+// otherwise.
+size_t ring_log_lz_compress(const void *src, size_t len, void *dst, size_t dst_len);
+int ring_log_lz_decompress(const void *src, size_t len, void *dst, size_t dst_len);
+
+// When to msync a mapped ring log file (ring_log_io_mmap.c only).
+typedef enum {
+    RING_LOG_MSYNC_NONE,
+    RING_LOG_MSYNC_ASYNC,
+    RING_LOG_MSYNC_SYNC
+} ring_log_msync_t;
 
 int ring_log_init(void);
 void ring_log_deinit(void);
+
+// Look up a log once with ring_log_open, and pass the handle to the _h
+// functions, instead of having each call look up the log by filename.
+ring_log_handle_t ring_log_open(const char *);
+void ring_log_write_tail_h(ring_log_handle_t, const void *, size_t);
+void ring_log_write_tail_complete_h(ring_log_handle_t);
+int ring_log_has_unread_h(ring_log_handle_t);
+int ring_log_read_head_h(ring_log_handle_t, void *, size_t, size_t *);
+void ring_log_read_head_success_h(ring_log_handle_t);
+
+// ring_log_writev writes one whole entry made up of the `iovcnt` buffers in
+// `iov`, taking the lock once, and returns 1, or 0 if it couldn't. For logs
+// with an async queue, see log_t. The entry
+// either makes it into the log in one piece or not at all. A tail entry that's
+// being written with ring_log_write_tail_h carries on as if nothing happened,
+// unless it's too big for the staging buffer: then it's already in the file
+// at the tail, and ring_log_writev returns 0 until it's complete.
+int ring_log_writev(ring_log_handle_t, const struct iovec *, int);
+
+// ring_log_reserve claims room for an entry of exactly `len` bytes, for the
+// caller to fill in place, and returns where it starts (the same as
+// resv->span[0]), or NULL if it couldn't. The room is in the file, if it's
+// mapped in (ring_log_io_mmap.c): then it's in two spans if it wraps around
+// the end of the ring, with the whole entry in the way evicted already, and
+// no other entry can be written until the reservation is committed or
+// abandoned. Otherwise, the room is in the staging buffer (and the entry has
+// to fit in there), and works like ring_log_write_tail_h. Entries that don't
+// fit in one piece (see ring_log_oversize_t) can't be reserved, and neither
+// can anything while a tail entry is being written.
+//
+// ring_log_commit makes the entry part of the log, like
+// ring_log_write_tail_complete_h, and returns 1, or 0 if it couldn't.
+// ring_log_abandon drops it instead: the log is left as it was, but for the
+// entries evicted to make room. Either can be called on a reservation that
+// failed (or is done with already), and then does nothing.
+typedef struct {
+    log_t *log;
+    void *span[2];
+    size_t len[2];
+} ring_log_resv_t;
+
+void *ring_log_reserve(ring_log_handle_t, size_t, ring_log_resv_t *);
+int ring_log_commit(ring_log_resv_t *);
+void ring_log_abandon(ring_log_resv_t *);
+
+// ring_log_flush waits until the entries put in the async queues so far have
+// been written to their logs (as their durability says), and returns 1.
+// ring_log_deinit does this too. The flusher can't write past a tail entry
+// that's being written straight into the file (see ring_log_writev) until
+// it's complete. If the calling task is writing one, ring_log_flush doesn't
+// wait for that log, and returns 0, and ring_log_writev drops (and counts) an
+// entry that would have to wait for it. ring_log_deinit drops the entries
+// still queued behind one.
+int ring_log_flush(void);
+
+// RING_LOG_PRINTF(log, fmt, ...) writes an entry that's to be printed with
+// `fmt`, like printf, without doing the formatting: the entry only holds the
+// format's id and the arguments, in binary (see ring_log_printf.c), and
+// ring_log_format_entry does the formatting when it's read. Each call site
+// registers its format the first time it's used. To read entries from before
+// that (say, from an earlier run), register the formats up front with
+// ring_log_printf_register. Integers, characters, doubles, C strings and
+// pointers are supported, %n, wide characters and long doubles aren't.
+// Entries can be up to RING_LOG_PRINTF_MAX bytes long: ring_log_printf returns
+// 0 (and doesn't write the entry) if it doesn't fit, or on any other error,
+// and 1 otherwise.
+#ifndef RING_LOG_PRINTF_MAX
+#define RING_LOG_PRINTF_MAX 256
+#endif
+#define RING_LOG_PRINTF_TAG 0xfe
+
+#define RING_LOG_PRINTF(log, ...) \
+    do { \
+        static uint32_t ring_log_printf_id; \
+        ring_log_printf((log), &ring_log_printf_id, __VA_ARGS__); \
+    } while (0)
+
+int ring_log_printf(ring_log_handle_t, uint32_t *, const char *, ...);
+
+// ring_log_printf_register returns the id of `fmt`, or 0 if there's no room
+// for another format (see RING_LOG_PRINTF_FORMATS in ring_log_printf.c). The
+// string has to stay around.
+uint32_t ring_log_printf_register(const char *);
+
+// ring_log_format_entry formats an entry written by RING_LOG_PRINTF into `out`,
+// and returns how long the text is, or -1 if the entry isn't one or its format
+// hasn't been registered. Like snprintf, the text is cut short if it doesn't
+// fit in `out_size` bytes (including the terminating NUL), and what's returned
+// is how long it would have been.
+int ring_log_format_entry(const void *, size_t, char *, size_t);
+
+// ring_log_sync_h makes sure that all of the entries written so far are on the
+// disk, whatever the log's durability.
+void ring_log_sync_h(ring_log_handle_t);
+
+// ring_log_get_stats copies the log's counters (see ring_log_stats_t) without
+// waiting for the lock, so they can be a little out of step with each other.
+// It returns 1, or 0 (with the counters zeroed) if built without
+// RING_LOG_STATS.
+int ring_log_get_stats(ring_log_handle_t, ring_log_stats_t *);
+
+// ring_log_cursor_begin points the cursor at the head entry, and returns 1, or
+// 0 if there is no entry to read. ring_log_cursor_read returns how many bytes
+// it read (0 once the whole entry has been read), or -1 if the entry was
+// evicted in the meantime. ring_log_cursor_commit drops the entry, like
+// ring_log_read_head_success.
+int ring_log_cursor_begin(ring_log_handle_t, ring_log_cursor_t *);
+int ring_log_cursor_read(ring_log_cursor_t *, void *, size_t);
+void ring_log_cursor_commit(ring_log_cursor_t *);
+
+// ring_log_read_batch copies as many whole entries (starting with the head
+// entry) as fit into the buffer, and returns how many, or -1 on error. Entry
+// `i` ends up at `entry_offsets[i]` up to `entry_offsets[i + 1]`, so
+// `entry_offsets` needs room for one more offset than `max_entries`. The
+// entry headers take up room in the buffer while reading, so the buffer needs
+// to be a bit bigger than the entries. ring_log_ack then drops the first `n`
+// of those entries.
+int ring_log_read_batch(ring_log_handle_t, void *, size_t, size_t *, int);
+void ring_log_ack(ring_log_handle_t, int);
+
+// ring_log_consumer_open looks up one of the log's consumers by name (see
+// ring_log_consumer_t), or returns NULL if it has no such consumer. The
+// consumer functions work like the head ones: ring_log_consumer_read reads
+// the consumer's next entry, and returns how many bytes it read, or -1 on
+// error, or if the entry was evicted partway through (the consumer is then
+// moved on to the head). ring_log_consumer_success moves the consumer past
+// the entry, and stores where it's got to in its slot. Reading the log from
+// the head as well as through consumers drops entries from under them.
+ring_log_consumer_t *ring_log_consumer_open(ring_log_handle_t, const char *);
+int ring_log_consumer_has_unread(ring_log_consumer_t *);
+int ring_log_consumer_read(ring_log_consumer_t *, void *, size_t, size_t *);
+void ring_log_consumer_success(ring_log_consumer_t *);
+
 void ring_log_write_tail(const char *, const void *, size_t);
 void ring_log_write_tail_complete(const char *);
 int ring_log_has_unread(const char *);
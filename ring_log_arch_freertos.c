@@ -1,27 +1,145 @@
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 
 #include "ring_log.h"
 
-static SemaphoreHandle_t mutex = NULL;
+// Stack size for tasks started by ring_log.
+#define RING_LOG_TASK_STACK_SIZE 4096
 
 void ring_log_arch_abort(void) {
     vTaskDelete(NULL);
 }
 
 void ring_log_arch_init(void) {
-    RING_LOG_EXPECT(mutex, NULL);
-    mutex = xSemaphoreCreateMutex();
+}
+
+void ring_log_arch_deinit(void) {
+}
+
+void *ring_log_arch_new_mutex(void) {
+    return xSemaphoreCreateMutex();
+}
+
+void ring_log_arch_delete_mutex(void *mutex) {
     RING_LOG_EXPECT_NOT(mutex, NULL);
+    vSemaphoreDelete(mutex);
 }
 
-void ring_log_arch_take_mutex(void) {
+void ring_log_arch_take_mutex(void *mutex) {
     RING_LOG_EXPECT_NOT(mutex, NULL);
     xSemaphoreTake(mutex, portMAX_DELAY);
 }
 
-void ring_log_arch_free_mutex(void) {
+void ring_log_arch_free_mutex(void *mutex) {
     RING_LOG_EXPECT_NOT(mutex, NULL);
     xSemaphoreGive(mutex);
 }
+
+// Setting an event wakes up every task waiting on its event group bit, even
+// though the bit gets cleared again right away. A task that checks the count
+// just before it gets set only wakes up once its wait times out.
+typedef struct {
+    EventGroupHandle_t group;
+    uint32_t count;
+} event_t;
+
+#define EVENT_BIT 1
+
+void *ring_log_arch_new_event(void) {
+    event_t *event = pvPortMalloc(sizeof(*event));
+    if (event == NULL) {
+        return NULL;
+    }
+    event->group = xEventGroupCreate();
+    if (event->group == NULL) {
+        vPortFree(event);
+        return NULL;
+    }
+    event->count = 0;
+    return event;
+}
+
+void ring_log_arch_delete_event(void *arg) {
+    event_t *event = arg;
+    vEventGroupDelete(event->group);
+    vPortFree(event);
+}
+
+uint32_t ring_log_arch_event_count(void *arg) {
+    event_t *event = arg;
+    return __atomic_load_n(&event->count, __ATOMIC_SEQ_CST);
+}
+
+void ring_log_arch_set_event(void *arg) {
+    event_t *event = arg;
+    __atomic_fetch_add(&event->count, 1, __ATOMIC_SEQ_CST);
+    xEventGroupSetBits(event->group, EVENT_BIT);
+    xEventGroupClearBits(event->group, EVENT_BIT);
+}
+
+void ring_log_arch_wait_event(void *arg, uint32_t count, uint32_t ms) {
+    event_t *event = arg;
+    if (__atomic_load_n(&event->count, __ATOMIC_SEQ_CST) == count) {
+        xEventGroupWaitBits(event->group, EVENT_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(ms));
+    }
+}
+
+typedef struct {
+    SemaphoreHandle_t done;
+    void (*fn)(void *);
+    void *arg;
+} thread_t;
+
+static void run_thread(void *arg) {
+    thread_t *thread = arg;
+    thread->fn(thread->arg);
+    xSemaphoreGive(thread->done);
+    vTaskDelete(NULL);
+}
+
+void *ring_log_arch_start_thread(void (*fn)(void *), void *arg) {
+    thread_t *thread = pvPortMalloc(sizeof(*thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->done = xSemaphoreCreateBinary();
+    if (thread->done == NULL) {
+        vPortFree(thread);
+        return NULL;
+    }
+    thread->fn = fn;
+    thread->arg = arg;
+    if (xTaskCreate(run_thread, "ring_log", RING_LOG_TASK_STACK_SIZE, thread, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+        vSemaphoreDelete(thread->done);
+        vPortFree(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void ring_log_arch_join_thread(void *arg) {
+    thread_t *thread = arg;
+    xSemaphoreTake(thread->done, portMAX_DELAY);
+    vSemaphoreDelete(thread->done);
+    vPortFree(thread);
+}
+
+void *ring_log_arch_self(void) {
+    return xTaskGetCurrentTaskHandle();
+}
+
+// The fs can't be assumed to do preallocation or sparse files.
+int ring_log_arch_size_file(int fd, off_t len, int sparse) {
+    return 0;
+}
+
+uint64_t ring_log_arch_now_ms(void) {
+    return (uint64_t)xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+// Only as fine-grained as the tick.
+uint64_t ring_log_arch_now_us(void) {
+    return (uint64_t)xTaskGetTickCount() * portTICK_PERIOD_MS * 1000;
+}
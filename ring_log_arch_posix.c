@@ -1,26 +1,177 @@
+// posix_fallocate, ftruncate and clock_gettime are POSIX.1-2008.
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ring_log.h"
 
-static pthread_mutex_t lock;
-
 void ring_log_arch_abort(void) {
     abort();
 }
 
 void ring_log_arch_init(void) {
-    RING_LOG_EXPECT(pthread_mutex_init(&lock, NULL), 0);
 }
 
 void ring_log_arch_deinit(void) {
-    RING_LOG_EXPECT(pthread_mutex_destroy(&lock), 0);
 }
 
-void ring_log_arch_take_mutex(void) {
-    pthread_mutex_lock(&lock);
+void *ring_log_arch_new_mutex(void) {
+    pthread_mutex_t *lock = malloc(sizeof(*lock));
+    if (lock == NULL) {
+        return NULL;
+    }
+    if (pthread_mutex_init(lock, NULL) != 0) {
+        free(lock);
+        return NULL;
+    }
+    return lock;
+}
+
+void ring_log_arch_delete_mutex(void *lock) {
+    RING_LOG_EXPECT(pthread_mutex_destroy(lock), 0);
+    free(lock);
+}
+
+void ring_log_arch_take_mutex(void *lock) {
+    pthread_mutex_lock(lock);
+}
+
+void ring_log_arch_free_mutex(void *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t count;
+} event_t;
+
+void *ring_log_arch_new_event(void) {
+    event_t *event = malloc(sizeof(*event));
+    if (event == NULL) {
+        return NULL;
+    }
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0) {
+        free(event);
+        return NULL;
+    }
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&event->lock, NULL) != 0) {
+        pthread_condattr_destroy(&attr);
+        free(event);
+        return NULL;
+    }
+    if (pthread_cond_init(&event->cond, &attr) != 0) {
+        pthread_mutex_destroy(&event->lock);
+        pthread_condattr_destroy(&attr);
+        free(event);
+        return NULL;
+    }
+    pthread_condattr_destroy(&attr);
+    event->count = 0;
+    return event;
+}
+
+void ring_log_arch_delete_event(void *arg) {
+    event_t *event = arg;
+    RING_LOG_EXPECT(pthread_cond_destroy(&event->cond), 0);
+    RING_LOG_EXPECT(pthread_mutex_destroy(&event->lock), 0);
+    free(event);
+}
+
+uint32_t ring_log_arch_event_count(void *arg) {
+    event_t *event = arg;
+    pthread_mutex_lock(&event->lock);
+    uint32_t count = event->count;
+    pthread_mutex_unlock(&event->lock);
+    return count;
+}
+
+void ring_log_arch_set_event(void *arg) {
+    event_t *event = arg;
+    pthread_mutex_lock(&event->lock);
+    event->count++;
+    pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->lock);
+}
+
+void ring_log_arch_wait_event(void *arg, uint32_t count, uint32_t ms) {
+    event_t *event = arg;
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&event->lock);
+    while (event->count == count) {
+        if (pthread_cond_timedwait(&event->cond, &event->lock, &until) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&event->lock);
+}
+
+typedef struct {
+    pthread_t thread;
+    void (*fn)(void *);
+    void *arg;
+} thread_t;
+
+static void *run_thread(void *arg) {
+    thread_t *thread = arg;
+    thread->fn(thread->arg);
+    return NULL;
+}
+
+void *ring_log_arch_start_thread(void (*fn)(void *), void *arg) {
+    thread_t *thread = malloc(sizeof(*thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->fn = fn;
+    thread->arg = arg;
+    if (pthread_create(&thread->thread, NULL, run_thread, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void ring_log_arch_join_thread(void *arg) {
+    thread_t *thread = arg;
+    RING_LOG_EXPECT(pthread_join(thread->thread, NULL), 0);
+    free(thread);
+}
+
+// pthread_t is an integer or a pointer everywhere this runs.
+void *ring_log_arch_self(void) {
+    return (void *)(uintptr_t)pthread_self();
+}
+
+int ring_log_arch_size_file(int fd, off_t len, int sparse) {
+    if (sparse) {
+        return ftruncate(fd, len) == 0;
+    }
+    return posix_fallocate(fd, 0, len) == 0;
+}
+
+uint64_t ring_log_arch_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void ring_log_arch_free_mutex(void) {
-    pthread_mutex_unlock(&lock);
+uint64_t ring_log_arch_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
@@ -1,24 +1,116 @@
 #include "ring_log.h"
 
-// For each log, just specify the filename (`.fn`):
+// How many bytes of entries (with their headers) each log's ring holds. The
+// file also has a file header, see RING_LOG_FILE_SIZE. Wrapping around the end
+// of a ring whose capacity is a power of two takes a mask rather than a
+// division, build with RING_LOG_POW2_CAPACITY to make sure they all are.
+#define LOG_A_CAPACITY 104
+#define LOG_B_CAPACITY 128
+#define LOG_C_CAPACITY 256
+
+// Entries are collected in RAM and written to the file in one go, as long as
+// they fit in the log's staging buffer. Bigger entries are written to the file
+// bit by bit, as they come in.
+static char log_a_staging[64];
+
+// Where the entries start is kept track of in RAM, for up to as many entries
+// as fit in the log's index. If there are more entries in the log than that,
+// their headers get read from the file once there's room in the index again.
+static ring_log_index_entry_t log_a_index[8];
+
+// Entries that fit in the staging buffer get compressed if the log has a
+// compress buffer, which needs to be twice the size of the staging buffer
+// (three times for an spsc log, see log_t in ring_log.h).
+static char log_b_staging[64];
+static char log_b_compress_buffer[2 * sizeof(log_b_staging)];
+static ring_log_index_entry_t log_b_index[8];
+
+// Entries written with ring_log_writev to a log with an async queue go into
+// the queue, and a flusher thread writes them out in batches. The queue has
+// room for a number of entries of up to a certain size, see
+// RING_LOG_ASYNC_QUEUE_WORDS. With the flusher as its only writer, and one
+// task reading it, the log can be an spsc one.
+static char log_c_staging[64];
+static ring_log_index_entry_t log_c_index[8];
+static uint64_t log_c_async_queue[RING_LOG_ASYNC_QUEUE_WORDS(8, 32)];
+
+// ring_log can't assume that the underlying FS can make sparse files. So at
+// ring_log_init -time, it'll fill up each log with (mostly) its filler byte.
+// For some storage technologies (Flash), the choice here can make a big
+// difference in terms of wear.
+//
+// For each log, specify the filename (`.fn`), the capacity (`.capacity`), and
+// optionally the filler byte (`.filler_byte`, defaults to 0), a staging buffer
+// (`.staging` and `.staging_size`), a compress buffer (`.compress_buffer` and
+// `.compress_buffer_size`), an index (`.index` and `.index_size`),
+// how to create the file if it doesn't exist (`.provision`, see
+// ring_log_provision_t in ring_log.h, defaults to RING_LOG_PROVISION_FILL),
+// when entries get synced to the disk (`.durability`, and for group
+// commits `.group_entries`, `.group_bytes` and `.group_ms`, see
+// ring_log_durability_t in ring_log.h, defaults to RING_LOG_DURABILITY_NONE),
+// an async queue (`.async_queue`, `.async_queue_size`, `.async_slots`,
+// `.async_entry_size`, and what to do when it's full, `.async_full`, see
+// ring_log_async_full_t in ring_log.h, defaults to RING_LOG_ASYNC_BLOCK),
+// a header journal (`.header_slots`, and `.program_page` to start each
+// entry on a page of its own, see log_t in ring_log.h; the file then takes up
+// RING_LOG_JOURNAL_FILE_SIZE), and how long entries can be (`.max_entry_size`,
+// defaults to as long as the ring can hold) and what happens to longer ones
+// (`.oversize`, see ring_log_oversize_t in ring_log.h, defaults to
+// RING_LOG_OVERSIZE_TRUNCATE), whether readers get a lock of their own
+// (`.spsc`, see log_t in ring_log.h), and named consumers (`.consumers` and
+// `.n_consumers`, see ring_log_consumer_t in ring_log.h; the file then takes
+// up RING_LOG_CONSUMERS_FILE_SIZE):
 log_t logs[] = {
-    { .fn = "log_a" }
+    {
+        .fn = "log_a",
+        .capacity = LOG_A_CAPACITY,
+        .staging = log_a_staging, .staging_size = sizeof(log_a_staging),
+        .index = log_a_index, .index_size = sizeof(log_a_index) / sizeof(log_a_index[0])
+    },
+    {
+        .fn = "log_b",
+        .capacity = LOG_B_CAPACITY,
+        .staging = log_b_staging, .staging_size = sizeof(log_b_staging),
+        .compress_buffer = log_b_compress_buffer, .compress_buffer_size = sizeof(log_b_compress_buffer),
+        .index = log_b_index, .index_size = sizeof(log_b_index) / sizeof(log_b_index[0])
+    },
+    {
+        .fn = "log_c",
+        .capacity = LOG_C_CAPACITY,
+        .staging = log_c_staging, .staging_size = sizeof(log_c_staging),
+        .index = log_c_index, .index_size = sizeof(log_c_index) / sizeof(log_c_index[0]),
+        .async_queue = log_c_async_queue, .async_queue_size = sizeof(log_c_async_queue),
+        .async_slots = 8, .async_entry_size = 32,
+        .spsc = 1
+    }
 };
 
-// The total log size to be shared among all of the logs defined above.
-#define LOGS_PARTITION_SIZE 200
-const int logs_partition_size = LOGS_PARTITION_SIZE;
+// The total log size to be shared among all of the logs defined above. A log
+// with a header journal or consumers takes up more than its ring (see
+// RING_LOG_LOG_FILE_SIZE), so leave room for those too: test.c gives log_a a
+// header journal with a program page.
+#define LOGS_PARTITION_SIZE 1280
+const off_t logs_partition_size = LOGS_PARTITION_SIZE;
 
 // Leave this alone!
 #define N_LOGS (sizeof(logs) / sizeof(logs[0]))
 const int n_logs = N_LOGS;
 
 // We want to have some free space, so that when bad blocks crop up the fs can
-// replace them with some of the free blocks.
-const int log_size = LOGS_PARTITION_SIZE * .8 / N_LOGS;
+// replace them with some of the free blocks. So the logs only get to use 80%
+// of the partition. This only checks the rings and their file headers, which
+// is all that's known at compile time: ring_log_init checks the files' actual
+// size, header journals and consumer slots included, before it creates any.
+RING_LOG_STATIC_ASSERT(RING_LOG_FILE_SIZE(LOG_A_CAPACITY) + RING_LOG_FILE_SIZE(LOG_B_CAPACITY) + RING_LOG_FILE_SIZE(LOG_C_CAPACITY) <=
+    LOGS_PARTITION_SIZE * 8 / 10, logs_fit_in_partition);
 
-// ring_log can't assume that the underlying FS can make sparse files. So at
-// ring_log_init -time, it'll fill up the log with (mostly) filler_byte. For
-// some storage technologies (Flash), the choice here can make a big difference
-// in terms of wear.
-const uint8_t filler_byte = 0;
+// Creating the ring log files that don't exist yet can take a while. If
+// provision_in_parallel, ring_log_init creates them all at the same time, each
+// in its own thread.
+const int provision_in_parallel = 1;
+
+// Only used with ring_log_io_mmap.c: when to msync the mapped ring log files
+// after an entry has been written or read. RING_LOG_MSYNC_NONE leaves it up to
+// the kernel, RING_LOG_MSYNC_ASYNC starts writeback, and RING_LOG_MSYNC_SYNC
+// waits for the data to hit the disk.
+const ring_log_msync_t msync_policy = RING_LOG_MSYNC_NONE;
@@ -0,0 +1,63 @@
+// pread/pwrite and fdatasync are POSIX.1-2008.
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "ring_log.h"
+
+int ring_log_io_open(log_t *log) {
+    log->io = NULL;
+    return 1;
+}
+
+void ring_log_io_close(log_t *log) {
+}
+
+int ring_log_io_read(log_t *log, off_t off, void *p, size_t len) {
+    ssize_t have_read = 0;
+    while (have_read < len) {
+        ssize_t ret = pread(log->fd, (char *)p + have_read, len - have_read, off + have_read);
+        if (ret == -1) {
+            if (errno != EINTR) {
+                RING_LOG_ERROR("errno != EINTR");
+                return 0;
+            }
+        } else if (ret == 0) {
+            RING_LOG_ERROR("unexpected EOF");
+            return 0;
+        } else {
+            have_read += ret;
+        }
+    }
+    return 1;
+}
+
+int ring_log_io_write(log_t *log, off_t off, const void *p, size_t len) {
+    ssize_t written = 0;
+    while (written < len) {
+        ssize_t ret = pwrite(log->fd, (const char *)p + written, len - written, off + written);
+        if (ret == -1) {
+            if (errno != EINTR) {
+                RING_LOG_ERROR("errno != EINTR");
+                return 0;
+            }
+        } else {
+            written += ret;
+        }
+    }
+    return 1;
+}
+
+// Writes go straight to the file, so there's nothing to flush.
+void ring_log_io_flush(log_t *log) {
+}
+
+int ring_log_io_sync(log_t *log) {
+    return fdatasync(log->fd) == 0;
+}
+
+// Nothing is mapped in.
+void *ring_log_io_map(log_t *log, off_t off) {
+    return NULL;
+}
@@ -0,0 +1,69 @@
+// mmap/msync are POSIX.1-2008.
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ring_log.h"
+
+extern const ring_log_msync_t msync_policy;
+
+// The whole ring log file is mapped in at ring_log_io_open -time, so reads and
+// writes are just memcpy's. The ring log files are fixed-size, so the mapping
+// never has to change.
+int ring_log_io_open(log_t *log) {
+    void *map = mmap(NULL, RING_LOG_LOG_FILE_SIZE(log), PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (map == MAP_FAILED) {
+        RING_LOG_ERROR("mmap failed");
+        return 0;
+    }
+    log->io = map;
+    return 1;
+}
+
+void ring_log_io_close(log_t *log) {
+    RING_LOG_EXPECT(msync(log->io, RING_LOG_LOG_FILE_SIZE(log), MS_SYNC), 0);
+    RING_LOG_EXPECT(munmap(log->io, RING_LOG_LOG_FILE_SIZE(log)), 0);
+    log->io = NULL;
+}
+
+int ring_log_io_read(log_t *log, off_t off, void *p, size_t len) {
+    if (off + len > RING_LOG_LOG_FILE_SIZE(log)) {
+        RING_LOG_ERROR("off + len > RING_LOG_LOG_FILE_SIZE(log)");
+        return 0;
+    }
+    memcpy(p, (char *)log->io + off, len);
+    return 1;
+}
+
+int ring_log_io_write(log_t *log, off_t off, const void *p, size_t len) {
+    if (off + len > RING_LOG_LOG_FILE_SIZE(log)) {
+        RING_LOG_ERROR("off + len > RING_LOG_LOG_FILE_SIZE(log)");
+        return 0;
+    }
+    memcpy((char *)log->io + off, p, len);
+    return 1;
+}
+
+// The kernel writes dirty pages back whenever it likes. msync_policy decides
+// whether to also push them out after every change to the file header.
+void ring_log_io_flush(log_t *log) {
+    switch (msync_policy) {
+    case RING_LOG_MSYNC_NONE:
+        break;
+    case RING_LOG_MSYNC_ASYNC:
+        RING_LOG_EXPECT(msync(log->io, RING_LOG_LOG_FILE_SIZE(log), MS_ASYNC), 0);
+        break;
+    case RING_LOG_MSYNC_SYNC:
+        RING_LOG_EXPECT(msync(log->io, RING_LOG_LOG_FILE_SIZE(log), MS_SYNC), 0);
+        break;
+    }
+}
+
+int ring_log_io_sync(log_t *log) {
+    return msync(log->io, RING_LOG_LOG_FILE_SIZE(log), MS_SYNC) == 0;
+}
+
+void *ring_log_io_map(log_t *log, off_t off) {
+    return (char *)log->io + off;
+}
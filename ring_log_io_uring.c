@@ -0,0 +1,330 @@
+// syscall is a glibc extension, pread/pwrite and fdatasync are POSIX.1-2008.
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ring_log.h"
+
+// Writes are copied into a buffer and queued up as io_uring submissions, which
+// all go to the kernel in one linked chain (so in order) at the next
+// ring_log_io_flush. ring_log.c flushes after writing the file header, so the
+// contents, entry headers and file header of an entry (or of a whole batch of
+// entries, for an async log) cost one io_uring_enter. If the kernel doesn't do
+// io_uring (or it's not allowed), the log falls back to pwrite.
+//
+// Everything here happens with the log's lock taken, except for
+// ring_log_io_sync, which is only ever called right after a flush, so it just
+// calls fdatasync and leaves the ring alone. If io_uring_enter ever fails, or
+// the kernel turns a write down as one it doesn't do, the log goes back to
+// pwrite for good. spsc logs (see log_t) always use pwrite.
+
+#ifndef RING_LOG_URING_ENTRIES
+#define RING_LOG_URING_ENTRIES 64
+#endif
+
+#ifndef RING_LOG_URING_BUFFER
+#define RING_LOG_URING_BUFFER 65536
+#endif
+
+typedef struct {
+    off_t off;
+    size_t len;
+    size_t at;
+} pending_write_t;
+
+typedef struct {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // A write that went wrong at flush time gets reported by the next call.
+    int failed;
+    int broken;
+    unsigned n_pending;
+    size_t buffered;
+    pending_write_t pending[RING_LOG_URING_ENTRIES];
+    uint8_t buffer[RING_LOG_URING_BUFFER];
+} uring_t;
+
+static int pread_all(int fd, off_t off, void *p, size_t len) {
+    size_t have_read = 0;
+    while (have_read < len) {
+        ssize_t ret = pread(fd, (char *)p + have_read, len - have_read, off + have_read);
+        if (ret == -1) {
+            if (errno != EINTR) {
+                RING_LOG_ERROR("errno != EINTR");
+                return 0;
+            }
+        } else if (ret == 0) {
+            RING_LOG_ERROR("unexpected EOF");
+            return 0;
+        } else {
+            have_read += ret;
+        }
+    }
+    return 1;
+}
+
+static int pwrite_all(int fd, off_t off, const void *p, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t ret = pwrite(fd, (const char *)p + written, len - written, off + written);
+        if (ret == -1) {
+            if (errno != EINTR) {
+                RING_LOG_ERROR("errno != EINTR");
+                return 0;
+            }
+        } else {
+            written += ret;
+        }
+    }
+    return 1;
+}
+
+static void unmap(uring_t *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+}
+
+static void *map(int fd, size_t size, off_t off) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// setup sets up the ring, and returns 0 if io_uring isn't there to use.
+static int setup(uring_t *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, RING_LOG_URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return 0;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->sq_ring = ring->cq_ring = map(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    } else {
+        ring->sq_ring = map(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+        ring->cq_ring = map(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+        unmap(ring);
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return 1;
+}
+
+// submit sends the pending writes to the kernel as one linked chain, and waits
+// for them all. Writes that came back short, or got cancelled because one
+// before them in the chain did, are finished off with pwrite. It returns 0 on
+// error.
+static int submit(log_t *log) {
+    uring_t *ring = log->io;
+    unsigned n = ring->n_pending;
+    if (n == 0) {
+        return 1;
+    }
+    ring->n_pending = 0;
+    ring->buffered = 0;
+
+    unsigned tail = *ring->sq_tail;
+    for (unsigned i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = &ring->sqes[i];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = log->fd;
+        sqe->off = ring->pending[i].off;
+        sqe->addr = (uintptr_t)(ring->buffer + ring->pending[i].at);
+        sqe->len = ring->pending[i].len;
+        sqe->flags = i + 1 < n ? IOSQE_IO_LINK : 0;
+        sqe->user_data = i;
+        ring->sq_array[(tail + i) & *ring->sq_mask] = i;
+    }
+    __atomic_store_n(ring->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    // How much of each write made it out.
+    size_t done[RING_LOG_URING_ENTRIES] = { 0 };
+    unsigned to_submit = n, reaped = 0;
+    while (reaped < n) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, n - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Whatever did get written is written again, which is harmless.
+            RING_LOG_ERROR("io_uring_enter failed");
+            ring->broken = 1;
+            memset(done, 0, sizeof(done));
+            break;
+        }
+        to_submit -= ret;
+
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, reaped++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            done[cqe->user_data] = cqe->res < 0 ? 0 : cqe->res;
+            // Kernels from before IORING_OP_WRITE (5.6) fail every write.
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                ring->broken = 1;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        pending_write_t *w = &ring->pending[i];
+        if (done[i] < w->len && !pwrite_all(log->fd, w->off + done[i], ring->buffer + w->at + done[i], w->len - done[i])) {
+            RING_LOG_ERROR("pwrite_all failed");
+            ring->failed = 1;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// check_failed returns 0 (once) if a write went wrong since the last call.
+static int check_failed(uring_t *ring) {
+    if (ring->failed) {
+        ring->failed = 0;
+        return 0;
+    }
+    return 1;
+}
+
+int ring_log_io_open(log_t *log) {
+    // The reader of an spsc log reads without the log's lock, so it can't
+    // share the ring with the writer.
+    if (log->spsc) {
+        log->io = NULL;
+        return 1;
+    }
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    if (ring == NULL) {
+        RING_LOG_ERROR("calloc failed");
+        return 0;
+    }
+    if (!setup(ring)) {
+        free(ring);
+        ring = NULL;
+    }
+    log->io = ring;
+    return 1;
+}
+
+void ring_log_io_close(log_t *log) {
+    uring_t *ring = log->io;
+    if (ring == NULL) {
+        return;
+    }
+    if (!ring->broken) {
+        RING_LOG_EXPECT_NOT(submit(log), 0);
+    }
+    unmap(ring);
+    close(ring->fd);
+    free(ring);
+    log->io = NULL;
+}
+
+// using_ring returns whether the log's I/O goes through io_uring.
+static int using_ring(log_t *log) {
+    return log->io != NULL && !((uring_t *)log->io)->broken;
+}
+
+int ring_log_io_read(log_t *log, off_t off, void *p, size_t len) {
+    uring_t *ring = log->io;
+    // Reads have to see whatever has been written so far.
+    if (using_ring(log) && (!submit(log) || !check_failed(ring))) {
+        RING_LOG_ERROR("submit failed");
+        return 0;
+    }
+    return pread_all(log->fd, off, p, len);
+}
+
+int ring_log_io_write(log_t *log, off_t off, const void *p, size_t len) {
+    uring_t *ring = log->io;
+    if (!using_ring(log)) {
+        return pwrite_all(log->fd, off, p, len);
+    }
+    if (!check_failed(ring)) {
+        return 0;
+    }
+
+    // Writes bigger than the buffer go in buffer-sized pieces.
+    for (size_t i = 0; i < len; ) {
+        if (ring->n_pending == RING_LOG_URING_ENTRIES || ring->buffered == RING_LOG_URING_BUFFER) {
+            if (!submit(log)) {
+                RING_LOG_ERROR("submit failed");
+                return 0;
+            }
+        }
+        size_t now = RING_LOG_URING_BUFFER - ring->buffered;
+        if (now > len - i) {
+            now = len - i;
+        }
+        pending_write_t *w = &ring->pending[ring->n_pending++];
+        w->off = off + i;
+        w->len = now;
+        w->at = ring->buffered;
+        memcpy(ring->buffer + ring->buffered, (const char *)p + i, now);
+        ring->buffered += now;
+        i += now;
+    }
+    return 1;
+}
+
+void ring_log_io_flush(log_t *log) {
+    if (using_ring(log)) {
+        RING_LOG_EXPECT_NOT(submit(log), 0);
+    }
+}
+
+// ring_log.c always flushes before it syncs, so everything written so far has
+// been through the ring already.
+int ring_log_io_sync(log_t *log) {
+    return fdatasync(log->fd) == 0;
+}
+
+// Nothing is mapped in: the writes all go through the buffer.
+void *ring_log_io_map(log_t *log, off_t off) {
+    return NULL;
+}
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "ring_log.h"
+
+// A small compressor and decompressor for the LZ4 block format. A block is a
+// list of sequences, each made up of:
+//
+// - a token byte, with the number of literals in the top 4 bits, and the
+//   match length - 4 in the bottom 4 bits. If either is 15, more bytes follow
+//   (literals first), which are added on, until one that isn't 255,
+// - the literals themselves,
+// - a 2 byte little endian offset back into the output to copy the match
+//   from, and then any more match length bytes.
+//
+// The last sequence only has literals. The last 5 bytes are always literals,
+// and the last match starts at least 12 bytes before the end.
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 0xffff
+#define LZ_HASH_BITS 10
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// put_length stores the part of a literal or match length that didn't fit in
+// the token, and returns the new output position, or NULL if there's no room.
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op == oend) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == oend) {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+
+// put_sequence stores `n_literals` literals from `literals`, followed by a
+// match of `match_len` bytes at `offset` back (if `match_len`), and returns
+// the new output position, or NULL if there's no room.
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t n_literals, size_t offset, size_t match_len) {
+    if (op == oend) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (n_literals < 15 ? n_literals : 15) << 4;
+    if (n_literals >= 15 && (op = put_length(op, oend, n_literals - 15)) == NULL) {
+        return NULL;
+    }
+    if (oend - op < n_literals) {
+        return NULL;
+    }
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+
+    if (match_len == 0) {
+        return op;
+    }
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15 && (op = put_length(op, oend, match_len - 15)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+size_t ring_log_lz_compress(const void *src, size_t len, void *dst, size_t dst_len) {
+    // Positions are kept in 16 bits.
+    if (len > UINT16_MAX) {
+        return 0;
+    }
+
+    const uint8_t *in = src;
+    const uint8_t *ip = in, *anchor = in, *iend = in + len;
+    uint8_t *op = dst, *oend = op + dst_len;
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    // Look for matches at each position, and jump over the ones found.
+    while (len >= LZ_MATCH_LIMIT && ip <= iend - LZ_MATCH_LIMIT) {
+        uint32_t v = read32(ip);
+        uint32_t h = hash(v);
+        const uint8_t *ref = in + table[h];
+        table[h] = ip - in;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != v) {
+            ip++;
+            continue;
+        }
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < iend - LZ_LAST_LITERALS && ref[match_len] == ip[match_len]) {
+            match_len++;
+        }
+        if ((op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, match_len)) == NULL) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    // Whatever is left over goes out as literals.
+    if ((op = put_sequence(op, oend, anchor, iend - anchor, 0, 0)) == NULL) {
+        return 0;
+    }
+    return op - (uint8_t *)dst;
+}
+
+// get_length adds on the extra bytes of a literal or match length to `*len`,
+// and returns the new input position, or NULL if the block is cut short.
+static const uint8_t *get_length(const uint8_t *ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (ip == iend) {
+            return NULL;
+        }
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+int ring_log_lz_decompress(const void *src, size_t len, void *dst, size_t dst_len) {
+    const uint8_t *ip = src, *iend = ip + len;
+    uint8_t *out = dst;
+    uint8_t *op = out, *oend = out + dst_len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t n_literals = token >> 4;
+        if (n_literals == 15 && (ip = get_length(ip, iend, &n_literals)) == NULL) {
+            return 0;
+        }
+        if (iend - ip < n_literals || oend - op < n_literals) {
+            return 0;
+        }
+        memcpy(op, ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+
+        // The last sequence has no match.
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return 0;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && (ip = get_length(ip, iend, &match_len)) == NULL) {
+            return 0;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - out || oend - op < match_len) {
+            return 0;
+        }
+        // The match can overlap with what it's copying, so go byte by byte.
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return op == oend;
+}
@@ -0,0 +1,497 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ring_log.h"
+
+// A RING_LOG_PRINTF record is RING_LOG_PRINTF_TAG, the id of the format string
+// (see format_id), and then the arguments, in the order the format string
+// uses them:
+//
+// - integers (and characters) as varints (see ring_log.c), zigzagged if
+//   they're signed, so that small negative numbers stay short too,
+// - pointers as varints,
+// - doubles as they are, 8 bytes,
+// - strings as their length (as a varint), followed by the characters.
+//
+// The format string itself isn't stored: ring_log_format_entry looks it up by
+// its id among the formats that have been registered.
+
+// Up to how many formats can be registered.
+#ifndef RING_LOG_PRINTF_FORMATS
+#define RING_LOG_PRINTF_FORMATS 64
+#endif
+
+static const char *formats[RING_LOG_PRINTF_FORMATS];
+
+typedef enum {
+    ARG_NONE,
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_CHAR,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER
+} arg_kind_t;
+
+typedef enum {
+    LENGTH_NONE,
+    LENGTH_HH,
+    LENGTH_H,
+    LENGTH_L,
+    LENGTH_LL,
+    LENGTH_J,
+    LENGTH_Z,
+    LENGTH_T
+} arg_length_t;
+
+// A conversion specification, like "%-8.*s". `flags_len` is how long the
+// flags, width and precision (everything between the % and the length
+// modifier) are. `stars` counts the width and precision given as arguments,
+// and `precision` is the precision, or -1 if there's none (or it's one of
+// those arguments, with `precision_star` set).
+typedef struct {
+    size_t flags_len;
+    int stars;
+    int precision;
+    int precision_star;
+    arg_length_t length;
+    char conversion;
+    arg_kind_t kind;
+} spec_t;
+
+// format_id hashes the format string (32-bit FNV-1a). 0 means "no id yet" to
+// RING_LOG_PRINTF call sites, so it's never an id.
+static uint32_t format_id(const char *fmt) {
+    uint32_t h = 2166136261u;
+    for (; *fmt; fmt++) {
+        h ^= (uint8_t)*fmt;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+// parse_spec parses the conversion specification at `p` (right after the %)
+// into `spec`, and returns where it ends, or NULL if it's one that
+// RING_LOG_PRINTF can't store.
+static const char *parse_spec(const char *p, spec_t *spec) {
+    const char *start = p;
+    spec->stars = 0;
+    spec->precision = -1;
+    spec->precision_star = 0;
+
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+        p++;
+    }
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    } else {
+        while (isdigit((unsigned char)*p)) {
+            p++;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            spec->precision_star = 1;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (isdigit((unsigned char)*p)) {
+                spec->precision = spec->precision * 10 + (*p++ - '0');
+            }
+        }
+    }
+    spec->flags_len = p - start;
+
+    spec->length = LENGTH_NONE;
+    if (p[0] == 'h' && p[1] == 'h') {
+        spec->length = LENGTH_HH;
+        p += 2;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        spec->length = LENGTH_LL;
+        p += 2;
+    } else if (*p != '\0' && strchr("hljzt", *p) != NULL) {
+        spec->length = *p == 'h' ? LENGTH_H : *p == 'l' ? LENGTH_L : *p == 'j' ? LENGTH_J : *p == 'z' ? LENGTH_Z : LENGTH_T;
+        p++;
+    }
+
+    spec->conversion = *p;
+    switch (*p) {
+    case 'd': case 'i':
+        spec->kind = ARG_SIGNED;
+        break;
+    case 'u': case 'o': case 'x': case 'X':
+        spec->kind = ARG_UNSIGNED;
+        break;
+    case 'c':
+        spec->kind = ARG_CHAR;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        spec->kind = ARG_DOUBLE;
+        break;
+    case 's':
+        spec->kind = ARG_STRING;
+        break;
+    case 'p':
+        spec->kind = ARG_POINTER;
+        break;
+    case '%':
+        spec->kind = ARG_NONE;
+        break;
+    default:
+        // %n, or not a conversion at all.
+        return NULL;
+    }
+    // Wide characters and long doubles aren't supported, and %l is only
+    // allowed (and does nothing) with the floating point conversions.
+    if (spec->length != LENGTH_NONE && spec->kind != ARG_SIGNED && spec->kind != ARG_UNSIGNED &&
+        !(spec->length == LENGTH_L && spec->kind == ARG_DOUBLE)) {
+        return NULL;
+    }
+    if (spec->kind == ARG_NONE && (spec->flags_len != 0 || spec->length != LENGTH_NONE)) {
+        return NULL;
+    }
+    return p + 1;
+}
+
+uint32_t ring_log_printf_register(const char *fmt) {
+    uint32_t id = format_id(fmt);
+    for (int i = 0; i < RING_LOG_PRINTF_FORMATS; i++) {
+        const char *slot = __atomic_load_n(&formats[i], __ATOMIC_ACQUIRE);
+        if (slot == NULL) {
+            if (__atomic_compare_exchange_n(&formats[i], &slot, fmt, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                return id;
+            }
+            // Someone else got this slot first, see what they put in it.
+        }
+        if (slot == fmt || strcmp(slot, fmt) == 0) {
+            return id;
+        }
+        if (format_id(slot) == id) {
+            RING_LOG_ERROR("two formats have the same id");
+            return 0;
+        }
+    }
+    RING_LOG_ERROR("no room to register another format");
+    return 0;
+}
+
+// find_format returns the registered format with the id, or NULL.
+static const char *find_format(uint32_t id) {
+    for (int i = 0; i < RING_LOG_PRINTF_FORMATS; i++) {
+        const char *slot = __atomic_load_n(&formats[i], __ATOMIC_ACQUIRE);
+        if (slot == NULL) {
+            break;
+        }
+        if (format_id(slot) == id) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// put_varint adds `v` to the record, as a varint, and returns 0 if there's no
+// room for it.
+static int put_varint(char *record, size_t *len, uint64_t v) {
+    do {
+        if (*len == RING_LOG_PRINTF_MAX) {
+            return 0;
+        }
+        record[(*len)++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    return 1;
+}
+
+static int put_signed(char *record, size_t *len, int64_t v) {
+    return put_varint(record, len, ((uint64_t)v << 1) ^ (v < 0 ? UINT64_MAX : 0));
+}
+
+static int put_bytes(char *record, size_t *len, const void *p, size_t n) {
+    if (RING_LOG_PRINTF_MAX - *len < n) {
+        return 0;
+    }
+    memcpy(record + *len, p, n);
+    *len += n;
+    return 1;
+}
+
+// get_varint reads the varint at `*pos` in the record, and returns 0 if the
+// record is cut short or the varint is too long.
+static int get_varint(const uint8_t *record, size_t len, size_t *pos, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*pos == len) {
+            return 0;
+        }
+        uint8_t b = record[(*pos)++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int get_signed(const uint8_t *record, size_t len, size_t *pos, int64_t *v) {
+    uint64_t u;
+    if (!get_varint(record, len, pos, &u)) {
+        return 0;
+    }
+    *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return 1;
+}
+
+// encode_args adds the arguments that `fmt` uses to the record.
+static int encode_args(char *record, size_t *len, const char *fmt, va_list ap) {
+    for (const char *p = fmt; *p != '\0'; ) {
+        if (*p++ != '%') {
+            continue;
+        }
+        spec_t spec;
+        if ((p = parse_spec(p, &spec)) == NULL) {
+            RING_LOG_ERROR("unsupported conversion in format");
+            return 0;
+        }
+
+        int star = 0;
+        for (int i = 0; i < spec.stars; i++) {
+            star = va_arg(ap, int);
+            if (!put_signed(record, len, star)) {
+                return 0;
+            }
+        }
+        int precision = spec.precision_star ? star : spec.precision;
+
+        int ok = 1;
+        switch (spec.kind) {
+        case ARG_NONE:
+            break;
+        case ARG_SIGNED: {
+            int64_t v;
+            switch (spec.length) {
+            case LENGTH_HH: v = (signed char)va_arg(ap, int); break;
+            case LENGTH_H: v = (short)va_arg(ap, int); break;
+            case LENGTH_L: v = va_arg(ap, long); break;
+            case LENGTH_LL: v = va_arg(ap, long long); break;
+            case LENGTH_J: v = va_arg(ap, intmax_t); break;
+            case LENGTH_Z: case LENGTH_T: v = va_arg(ap, ptrdiff_t); break;
+            default: v = va_arg(ap, int); break;
+            }
+            ok = put_signed(record, len, v);
+            break;
+        }
+        case ARG_UNSIGNED: {
+            uint64_t v;
+            switch (spec.length) {
+            case LENGTH_HH: v = (unsigned char)va_arg(ap, unsigned); break;
+            case LENGTH_H: v = (unsigned short)va_arg(ap, unsigned); break;
+            case LENGTH_L: v = va_arg(ap, unsigned long); break;
+            case LENGTH_LL: v = va_arg(ap, unsigned long long); break;
+            case LENGTH_J: v = va_arg(ap, uintmax_t); break;
+            case LENGTH_Z: case LENGTH_T: v = va_arg(ap, size_t); break;
+            default: v = va_arg(ap, unsigned); break;
+            }
+            ok = put_varint(record, len, v);
+            break;
+        }
+        case ARG_CHAR:
+            ok = put_signed(record, len, va_arg(ap, int));
+            break;
+        case ARG_DOUBLE: {
+            double v = va_arg(ap, double);
+            ok = put_bytes(record, len, &v, sizeof(v));
+            break;
+        }
+        case ARG_STRING: {
+            const char *s = va_arg(ap, const char *);
+            if (s == NULL) {
+                s = "(null)";
+            }
+            // Only the part of the string that gets printed is stored.
+            size_t n = 0;
+            while (s[n] != '\0' && (precision < 0 || n < precision)) {
+                n++;
+            }
+            ok = put_varint(record, len, n) && put_bytes(record, len, s, n);
+            break;
+        }
+        case ARG_POINTER:
+            ok = put_varint(record, len, (uintptr_t)va_arg(ap, void *));
+            break;
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int ring_log_printf(ring_log_handle_t log, uint32_t *id, const char *fmt, ...) {
+    // The first time around, the call site's format gets registered.
+    uint32_t format = __atomic_load_n(id, __ATOMIC_RELAXED);
+    if (format == 0) {
+        if ((format = ring_log_printf_register(fmt)) == 0) {
+            RING_LOG_ERROR("ring_log_printf_register failed");
+            return 0;
+        }
+        __atomic_store_n(id, format, __ATOMIC_RELAXED);
+    }
+
+    char record[RING_LOG_PRINTF_MAX];
+    record[0] = (char)RING_LOG_PRINTF_TAG;
+    memcpy(record + 1, &format, sizeof(format));
+    size_t len = 1 + sizeof(format);
+
+    va_list ap;
+    va_start(ap, fmt);
+    int ok = encode_args(record, &len, fmt, ap);
+    va_end(ap);
+    if (!ok) {
+        return 0;
+    }
+
+    struct iovec iov = { .iov_base = record, .iov_len = len };
+    return ring_log_writev(log, &iov, 1);
+}
+
+// Appending to the output keeps count of how long it would have been, like
+// snprintf, and only writes what fits.
+#define APPEND(...) \
+    do { \
+        int n = snprintf(total < out_size ? out + total : NULL, total < out_size ? out_size - total : 0, __VA_ARGS__); \
+        if (n < 0) { \
+            return -1; \
+        } \
+        total += n; \
+    } while (0)
+
+// A conversion with up to two * arguments in front of the value.
+#define APPEND_ARG(conversion, value) \
+    do { \
+        if (spec.stars == 0) { \
+            APPEND(conversion, value); \
+        } else if (spec.stars == 1) { \
+            APPEND(conversion, stars[0], value); \
+        } else { \
+            APPEND(conversion, stars[0], stars[1], value); \
+        } \
+    } while (0)
+
+int ring_log_format_entry(const void *entry, size_t len, char *out, size_t out_size) {
+    const uint8_t *record = entry;
+    uint32_t id;
+    if (len < 1 + sizeof(id) || record[0] != RING_LOG_PRINTF_TAG) {
+        return -1;
+    }
+    memcpy(&id, record + 1, sizeof(id));
+    const char *fmt = find_format(id);
+    if (fmt == NULL) {
+        return -1;
+    }
+
+    size_t pos = 1 + sizeof(id);
+    size_t total = 0;
+    if (out_size > 0) {
+        out[0] = '\0';
+    }
+    for (const char *p = fmt; *p != '\0'; ) {
+        // Copy the text up to the next conversion as it is.
+        const char *text = p;
+        while (*p != '\0' && *p != '%') {
+            p++;
+        }
+        if (p != text) {
+            APPEND("%.*s", (int)(p - text), text);
+        }
+        if (*p == '\0') {
+            break;
+        }
+
+        const char *start = p++;
+        spec_t spec;
+        if ((p = parse_spec(p, &spec)) == NULL) {
+            return -1;
+        }
+        int stars[2];
+        for (int i = 0; i < spec.stars; i++) {
+            int64_t v;
+            if (!get_signed(record, len, &pos, &v)) {
+                return -1;
+            }
+            stars[i] = v;
+        }
+
+        // Rebuild the conversion, with the length modifier to go with the
+        // type that the value is passed as.
+        char conversion[32];
+        const char *length = spec.kind == ARG_SIGNED || spec.kind == ARG_UNSIGNED ? "ll" : "";
+        if (1 + spec.flags_len + strlen(length) + 2 > sizeof(conversion)) {
+            return -1;
+        }
+        sprintf(conversion, "%%%.*s%s%c", (int)spec.flags_len, start + 1, length, spec.conversion);
+
+        switch (spec.kind) {
+        case ARG_NONE:
+            APPEND("%%");
+            break;
+        case ARG_SIGNED: case ARG_CHAR: {
+            int64_t v;
+            if (!get_signed(record, len, &pos, &v)) {
+                return -1;
+            }
+            if (spec.kind == ARG_SIGNED) {
+                APPEND_ARG(conversion, (long long)v);
+            } else {
+                APPEND_ARG(conversion, (int)v);
+            }
+            break;
+        }
+        case ARG_UNSIGNED: {
+            uint64_t v;
+            if (!get_varint(record, len, &pos, &v)) {
+                return -1;
+            }
+            APPEND_ARG(conversion, (unsigned long long)v);
+            break;
+        }
+        case ARG_DOUBLE: {
+            double v;
+            if (len - pos < sizeof(v)) {
+                return -1;
+            }
+            memcpy(&v, record + pos, sizeof(v));
+            pos += sizeof(v);
+            APPEND_ARG(conversion, v);
+            break;
+        }
+        case ARG_STRING: {
+            uint64_t n;
+            char s[RING_LOG_PRINTF_MAX];
+            if (!get_varint(record, len, &pos, &n) || len - pos < n || n >= sizeof(s)) {
+                return -1;
+            }
+            memcpy(s, record + pos, n);
+            s[n] = '\0';
+            pos += n;
+            APPEND_ARG(conversion, s);
+            break;
+        }
+        case ARG_POINTER: {
+            uint64_t v;
+            if (!get_varint(record, len, &pos, &v)) {
+                return -1;
+            }
+            APPEND_ARG(conversion, (void *)(uintptr_t)v);
+            break;
+        }
+        }
+    }
+    if (pos != len) {
+        return -1;
+    }
+    return total;
+}
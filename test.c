@@ -1,18 +1,172 @@
 #include <stdio.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ring_log.h"
 
 extern void debug_print(const char *);
 
-extern const int logs_partition_size;
+extern log_t logs[];
+extern const int n_logs;
+extern const off_t logs_partition_size;
+
+// log_a is the first log in ring_log_config.c.
+#define LOG_A_FILE_SIZE RING_LOG_FILE_SIZE(logs[0].capacity)
 
 typedef struct {
     uint32_t len;
     uint32_t seq;
 } test_entry_header_t;
 
+// ref_log_t is a copy of a version 0 ring log file in RAM, which gets updated
+// one byte at a time the same way that ring_log.c used to. It's used to make
+// version 0 files, to check that ring_log_init migrates them.
+typedef struct {
+    char *image;
+    v0_file_header_t file_header;
+    int new_tail_started;
+    off_t new_tail_end_offset;
+    v0_entry_header_t new_tail_header;
+} ref_log_t;
+
+static void save_file(const char *fn, const char *image) {
+    int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    RING_LOG_EXPECT_NOT(fd, -1);
+    RING_LOG_EXPECT(write(fd, image, LOG_A_FILE_SIZE), LOG_A_FILE_SIZE);
+    close(fd);
+}
+
+static off_t ref_read_wrap(ref_log_t *ref, off_t off, char *p, size_t len) {
+    for (size_t i = 0; i < len || off < sizeof(v0_file_header_t); ) {
+        if (off >= sizeof(v0_file_header_t)) {
+            if (p != NULL) {
+                p[i] = ref->image[off];
+            }
+            i++;
+        }
+        off = (off + 1) % LOG_A_FILE_SIZE;
+    }
+    return off;
+}
+
+static void ref_evict_head(ref_log_t *ref) {
+    v0_entry_header_t entry_header;
+    off_t off = ref_read_wrap(ref, ref->file_header.head, (void *)&entry_header, sizeof(entry_header));
+    ref->file_header.head = ref_read_wrap(ref, off, NULL, entry_header.len);
+    memcpy(ref->image, &ref->file_header, sizeof(ref->file_header));
+}
+
+static off_t ref_write_wrap(ref_log_t *ref, int is_entry, off_t off, const char *p, size_t len) {
+    for (size_t i = 0; i < len; ) {
+        if (off >= sizeof(v0_file_header_t)) {
+            if (is_entry && off == ref->file_header.head && ref->file_header.head != ref->file_header.tail) {
+                ref_evict_head(ref);
+            }
+            ref->image[off] = p[i];
+            i++;
+        }
+        off = (off + 1) % LOG_A_FILE_SIZE;
+    }
+
+    // Like read_wrap, don't leave the offset pointing into the file header.
+    off = ref_read_wrap(ref, off, NULL, 0);
+
+    // Don't let the tail catch up with the head, the log would look empty.
+    if (is_entry && off == ref->file_header.head && ref->file_header.head != ref->file_header.tail) {
+        ref_evict_head(ref);
+    }
+
+    return off;
+}
+
+static void ref_write_tail(ref_log_t *ref, const char *p, size_t len) {
+    if (!ref->new_tail_started) {
+        ref->new_tail_header.len = 0;
+        ref->new_tail_started = 1;
+        ref->new_tail_end_offset = ref_write_wrap(ref, 1, ref->file_header.tail, (void *)&ref->new_tail_header, sizeof(ref->new_tail_header));
+    }
+    ref->new_tail_end_offset = ref_write_wrap(ref, 1, ref->new_tail_end_offset, p, len);
+    ref->new_tail_header.len += len;
+}
+
+static void ref_write_tail_complete(ref_log_t *ref) {
+    ref->new_tail_started = 0;
+    ref_write_wrap(ref, 0, ref->file_header.tail, (void *)&ref->new_tail_header, sizeof(ref->new_tail_header));
+    ref->file_header.tail = ref->new_tail_end_offset;
+    memcpy(ref->image, &ref->file_header, sizeof(ref->file_header));
+}
+
+void test_migrate_v0(int count) {
+    printf("  migrating %i entries from a version 0 file..\n", count);
+
+    // Start off from an empty version 0 file.
+    ref_log_t ref = { .new_tail_started = 0 };
+    ref.image = calloc(LOG_A_FILE_SIZE, 1);
+    RING_LOG_EXPECT_NOT(ref.image, NULL);
+    ref.file_header.head = ref.file_header.tail = sizeof(v0_file_header_t);
+
+    // Write entries of a sequence number followed by between 0 and 20 bytes,
+    // and sometimes consume the head entry.
+    char entry[sizeof(uint32_t) + 20];
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(entry, &i, sizeof(i));
+        for (int j = sizeof(i); j < sizeof(entry); j++) {
+            entry[j] = i + j;
+        }
+        ref_write_tail(&ref, entry, sizeof(i));
+        ref_write_tail(&ref, entry + sizeof(i), i % 21);
+        ref_write_tail_complete(&ref);
+        if (rand() % 3 == 0) {
+            ref_evict_head(&ref);
+        }
+    }
+    int v0_count = 0;
+    for (off_t off = ref.file_header.head; off != ref.file_header.tail; v0_count++) {
+        v0_entry_header_t entry_header;
+        off = ref_read_wrap(&ref, off, (void *)&entry_header, sizeof(entry_header));
+        off = ref_read_wrap(&ref, off, NULL, entry_header.len);
+    }
+    save_file("log_a", ref.image);
+    free(ref.image);
+
+    // The newest of those entries should make it into the new format, in the
+    // right order.
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    sanity_check_file_size("log_a");
+    sanity_check_index("log_a");
+    ring_log_handle_t log = ring_log_open("log_a");
+    int last_seq = -1;
+    int count_read = 0;
+    while (ring_log_has_unread_h(log)) {
+        size_t read_total = 0;
+        RING_LOG_EXPECT_NOT(ring_log_read_head_h(log, entry, sizeof(entry), &read_total), -1);
+        uint32_t seq;
+        memcpy(&seq, entry, sizeof(seq));
+        if (last_seq != -1) {
+            RING_LOG_EXPECT(seq - last_seq, 1);
+        }
+        last_seq = seq;
+        RING_LOG_EXPECT(read_total, sizeof(seq) + (seq % 21));
+        for (int j = sizeof(seq); j < read_total; j++) {
+            RING_LOG_EXPECT(entry[j], (char)(seq + j));
+        }
+        ring_log_read_head_success_h(log);
+        count_read++;
+    }
+    if (v0_count > 0) {
+        RING_LOG_EXPECT_NOT(count_read, 0);
+        RING_LOG_EXPECT(last_seq, count - 1);
+    }
+    if (count_read > v0_count) {
+        RING_LOG_ERROR("migrated more entries than there were");
+    }
+
+    printf("    .. read %i of %i entries back out\n", count_read, v0_count);
+}
+
 void test_write_and_read_entries(int count) {
     // Write `count` entries between 1 and 100 bytes in length + header.
     printf("  writing %i entries..\n", count);
@@ -87,8 +241,1417 @@ void test_write_and_read_entries(int count) {
     RING_LOG_EXPECT(last_seq, count - 1);
 
     printf("    .. read %i entries back out\n", count_read);
+
+    sanity_check_index("log_a");
+}
+
+void test_cursor(int count) {
+    printf("  reading %i entries with a cursor..\n", count);
+    ring_log_handle_t log = ring_log_open("log_a");
+
+    // Write entries of "0123.." of between 1 and 40 bytes.
+    char chars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCD";
+    for (int i = 0; i < count; i++) {
+        ring_log_write_tail_h(log, chars, 1 + (rand() % (sizeof(chars) - 1)));
+        ring_log_write_tail_complete_h(log);
+    }
+
+    // Read them back out a few bytes at a time.
+    ring_log_cursor_t cursor;
+    int count_read = 0;
+    while (ring_log_cursor_begin(log, &cursor)) {
+        RING_LOG_EXPECT_NOT(cursor.len, 0);
+        char s[10];
+        size_t read_total = 0;
+        int read_now;
+        while ((read_now = ring_log_cursor_read(&cursor, s, 1 + (rand() % sizeof(s))))) {
+            RING_LOG_EXPECT(memcmp(s, &chars[read_total], read_now), 0);
+            read_total += read_now;
+        }
+        RING_LOG_EXPECT(read_total, cursor.len);
+        ring_log_cursor_commit(&cursor);
+        count_read++;
+    }
+
+    printf("    .. read %i entries back out\n", count_read);
+
+    // If the entry gets evicted while it's being read, the cursor notices.
+    ring_log_write_tail_h(log, chars, 10);
+    ring_log_write_tail_complete_h(log);
+    RING_LOG_EXPECT(ring_log_cursor_begin(log, &cursor), 1);
+    for (int i = 0; i < LOG_A_FILE_SIZE; i += 10) {
+        ring_log_write_tail_h(log, chars, 10);
+        ring_log_write_tail_complete_h(log);
+    }
+    char s[10];
+    RING_LOG_EXPECT(ring_log_cursor_read(&cursor, s, sizeof(s)), -1);
+    while (ring_log_has_unread_h(log)) {
+        ring_log_read_head_success_h(log);
+    }
+}
+
+void test_batch(int count) {
+    printf("  reading %i entries in batches..\n", count);
+    ring_log_handle_t log = ring_log_open("log_a");
+
+    // Write entries of a sequence number followed by between 0 and 20 bytes.
+    char entry[sizeof(uint32_t) + 20];
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(entry, &i, sizeof(i));
+        for (int j = sizeof(i); j < sizeof(entry); j++) {
+            entry[j] = i + j;
+        }
+        ring_log_write_tail_h(log, entry, sizeof(i) + (i % 21));
+        ring_log_write_tail_complete_h(log);
+    }
+
+    // Read them back in batches of random sizes, and check that they're
+    // consecutive and have the right contents.
+    char buffer[200];
+    size_t entry_offsets[9];
+    int last_seq = -1;
+    int count_read = 0;
+    while (ring_log_has_unread_h(log)) {
+        int n = ring_log_read_batch(log, buffer, 40 + (rand() % (sizeof(buffer) - 40)), entry_offsets, 1 + (rand() % 8));
+        RING_LOG_EXPECT_NOT(n, -1);
+        RING_LOG_EXPECT_NOT(n, 0);
+        for (int i = 0; i < n; i++) {
+            uint32_t seq;
+            memcpy(&seq, &buffer[entry_offsets[i]], sizeof(seq));
+            if (last_seq != -1) {
+                RING_LOG_EXPECT(seq - last_seq, 1);
+            }
+            last_seq = seq;
+            RING_LOG_EXPECT(entry_offsets[i + 1] - entry_offsets[i], sizeof(seq) + (seq % 21));
+            for (int j = sizeof(seq); j < entry_offsets[i + 1] - entry_offsets[i]; j++) {
+                RING_LOG_EXPECT(buffer[entry_offsets[i] + j], (char)(seq + j));
+            }
+        }
+
+        // Sometimes only acknowledge some of the entries.
+        int acked = rand() % 2 ? n : 1 + (rand() % n);
+        ring_log_ack(log, acked);
+        count_read += acked;
+        last_seq -= n - acked;
+    }
+    RING_LOG_EXPECT(last_seq, count - 1);
+
+    printf("    .. read %i entries back out\n", count_read);
+
+    // If the entries get evicted before they're acknowledged, acknowledging
+    // them doesn't drop any of the newer entries.
+    uint32_t seq = 0;
+    ring_log_write_tail_h(log, &seq, sizeof(seq));
+    ring_log_write_tail_complete_h(log);
+    RING_LOG_EXPECT(ring_log_read_batch(log, buffer, sizeof(buffer), entry_offsets, 8), 1);
+    for (seq = 1; seq < LOG_A_FILE_SIZE; seq++) {
+        ring_log_write_tail_h(log, &seq, sizeof(seq));
+        ring_log_write_tail_complete_h(log);
+    }
+    size_t read_total = 0;
+    uint32_t head_seq;
+    RING_LOG_EXPECT(ring_log_read_head_h(log, &head_seq, sizeof(head_seq), &read_total), sizeof(head_seq));
+    ring_log_ack(log, 1);
+    read_total = 0;
+    RING_LOG_EXPECT(ring_log_read_head_h(log, &seq, sizeof(seq), &read_total), sizeof(seq));
+    RING_LOG_EXPECT(seq, head_seq);
+    while (ring_log_has_unread_h(log)) {
+        ring_log_read_head_success_h(log);
+    }
+}
+
+// read_writev_entry reads the head entry written by test_writev, checks it,
+// and returns its sequence number.
+static uint32_t read_writev_entry(ring_log_handle_t log) {
+    char entry[sizeof(test_entry_header_t) + 70 + 3];
+    size_t read_total = 0;
+    RING_LOG_EXPECT_NOT(ring_log_read_head_h(log, entry, sizeof(entry), &read_total), -1);
+    test_entry_header_t header;
+    memcpy(&header, entry, sizeof(header));
+    RING_LOG_EXPECT(read_total, sizeof(header) + header.len + 3);
+    for (int j = 0; j < header.len; j++) {
+        RING_LOG_EXPECT(entry[sizeof(header) + j], (char)(header.seq + j));
+    }
+    RING_LOG_EXPECT(memcmp(entry + sizeof(header) + header.len, "zzz", 3), 0);
+    ring_log_read_head_success_h(log);
+    return header.seq;
+}
+
+void test_writev(int count) {
+    printf("  writing %i entries with ring_log_writev..\n", count);
+    ring_log_handle_t log = ring_log_open("log_a");
+
+    // Write entries of a test_entry_header_t, between 1 and 70 bytes, and
+    // "zzz", some of which are too big for the staging buffer, and sometimes
+    // read the head entry.
+    char payload[70];
+    int last_seq = -1;
+    int count_read = 0;
+    uint64_t first_seq = log->file_header.tail_seq;
+    for (uint32_t i = 0; i < count; i++) {
+        test_entry_header_t header = {
+            .len = 1 + (rand() % sizeof(payload)),
+            .seq = i
+        };
+        for (int j = 0; j < header.len; j++) {
+            payload[j] = i + j;
+        }
+        struct iovec iov[] = {
+            { .iov_base = &header, .iov_len = sizeof(header) },
+            { .iov_base = payload, .iov_len = header.len },
+            { .iov_base = "zzz", .iov_len = 3 }
+        };
+        RING_LOG_EXPECT(ring_log_writev(log, iov, 3), 1);
+        sanity_check_index("log_a");
+        if (rand() % 3 == 0) {
+            uint64_t head_seq = log->file_header.head_seq;
+            uint32_t seq = read_writev_entry(log);
+            RING_LOG_EXPECT(seq, head_seq - first_seq);
+            last_seq = seq;
+            count_read++;
+        }
+    }
+    // The bigger entries take up most of log_a's ring, so entries can have
+    // been evicted since the last one read above: the first one left is the
+    // one at the head, and the rest follow it.
+    while (ring_log_has_unread_h(log)) {
+        uint64_t head_seq = log->file_header.head_seq;
+        uint32_t seq = read_writev_entry(log);
+        RING_LOG_EXPECT(seq, head_seq - first_seq);
+        RING_LOG_EXPECT((int)seq > last_seq, 1);
+        last_seq = seq;
+        count_read++;
+    }
+    RING_LOG_EXPECT(last_seq, count - 1);
+
+    printf("    .. read %i entries back out\n", count_read);
+
+    // An entry written in the middle of a staged tail entry goes in first, and
+    // leaves the tail entry alone.
+    test_entry_header_t header = { .len = 2, .seq = count };
+    struct iovec iov[] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = payload, .iov_len = 2 },
+        { .iov_base = "zzz", .iov_len = 3 }
+    };
+    payload[0] = count;
+    payload[1] = count + 1;
+    ring_log_write_tail_h(log, "tail", 4);
+    RING_LOG_EXPECT(ring_log_writev(log, iov, 3), 1);
+    ring_log_write_tail_h(log, " entry", 6);
+    ring_log_write_tail_complete_h(log);
+    RING_LOG_EXPECT(read_writev_entry(log), count);
+    char s[16];
+    size_t read_total = 0;
+    RING_LOG_EXPECT(ring_log_read_head_h(log, s, sizeof(s), &read_total), 10);
+    RING_LOG_EXPECT(memcmp(s, "tail entry", 10), 0);
+    ring_log_read_head_success_h(log);
+
+    // One that's too big to stage (with room for the longest entry header, 18
+    // bytes) is already in the file and in the way, though.
+    char big[50];
+    RING_LOG_EXPECT(logs[0].staging_size < 18 + sizeof(big), 1);
+    memset(big, 'b', sizeof(big));
+    ring_log_write_tail_h(log, big, sizeof(big));
+    RING_LOG_EXPECT(ring_log_writev(log, iov, 3), 0);
+    ring_log_write_tail_complete_h(log);
+    RING_LOG_EXPECT(ring_log_writev(log, iov, 3), 1);
+    read_total = 0;
+    while (ring_log_read_head_h(log, s, sizeof(s), &read_total) > 0) {
+    }
+    RING_LOG_EXPECT(read_total, sizeof(big));
+    ring_log_read_head_success_h(log);
+    RING_LOG_EXPECT(read_writev_entry(log), count);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+}
+
+// check_printf_entry reads the head entry, written by RING_LOG_PRINTF, and
+// checks that it formats to `expected`.
+static void check_printf_entry(ring_log_handle_t log, const char *expected) {
+    char entry[RING_LOG_PRINTF_MAX];
+    size_t read_total = 0;
+    while (ring_log_read_head_h(log, entry + read_total, sizeof(entry) - read_total, &read_total) > 0) {
+    }
+    ring_log_read_head_success_h(log);
+    RING_LOG_EXPECT(read_total < strlen(expected), 1);
+    char text[128];
+    RING_LOG_EXPECT(ring_log_format_entry(entry, read_total, text, sizeof(text)), strlen(expected));
+    RING_LOG_EXPECT(strcmp(text, expected), 0);
+
+    // Text that doesn't fit gets cut short, like with snprintf.
+    RING_LOG_EXPECT(ring_log_format_entry(entry, read_total, text, 8), strlen(expected));
+    RING_LOG_EXPECT(strncmp(text, expected, 7), 0);
+    RING_LOG_EXPECT(text[7], '\0');
+
+    // So does the entry, but then it can't be formatted.
+    RING_LOG_EXPECT(ring_log_format_entry(entry, read_total - 1, text, sizeof(text)), -1);
+}
+
+// Write an entry with RING_LOG_PRINTF, and check that it reads back the same
+// as it would have been printed.
+#define TEST_PRINTF(log, ...) \
+    do { \
+        char expected[128]; \
+        snprintf(expected, sizeof(expected), __VA_ARGS__); \
+        RING_LOG_PRINTF(log, __VA_ARGS__); \
+        check_printf_entry(log, expected); \
+    } while (0)
+
+void test_printf(int count) {
+    printf("  writing %i entries with RING_LOG_PRINTF..\n", count);
+    ring_log_handle_t log = ring_log_open("log_a");
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+
+    for (int i = 0; i < count; i++) {
+        int v = rand() - RAND_MAX / 2;
+        TEST_PRINTF(log, "sensor %d: temperature %.1fC, status %s (%u%%)", i % 8, v / 1e8, i % 3 ? "ok" : "degraded", (unsigned)i);
+        TEST_PRINTF(log, "%hhd %hu %ld %lld %jx %zu %td %c|%-5c|", (signed char)v, (unsigned short)v, (long)v, (long long)v * 1000,
+            (uintmax_t)v, (size_t)i, (ptrdiff_t)-i, 'a' + i % 26, 'z');
+        TEST_PRINTF(log, "[%*d] [%-*.*s] [%.3s] [%08.3e] [%#o] [%+i] [%g]", i % 12, v, 8, i % 5, "abcdefgh", "xyzzy", v * 1.5, i, v, 1.0 / (i + 1));
+    }
+    TEST_PRINTF(log, "no arguments at all");
+    // A NULL string comes out as "(null)", which snprintf can't be trusted
+    // to do.
+    char expected[128];
+    snprintf(expected, sizeof(expected), "(null), %p", (void *)&log);
+    RING_LOG_PRINTF(log, "%s, %p", (char *)NULL, (void *)&log);
+    check_printf_entry(log, expected);
+
+    // Entries that aren't RING_LOG_PRINTF entries don't get formatted.
+    char text[16];
+    RING_LOG_EXPECT(ring_log_format_entry("plain entry", 11, text, sizeof(text)), -1);
+}
+
+// The entries that test_async writes: which producer wrote it, its sequence
+// number, and then between 0 and 16 bytes of padding. Each producer writes
+// `count` of them.
+typedef struct {
+    uint32_t producer;
+    uint32_t seq;
+} async_entry_t;
+
+#define ASYNC_PRODUCERS 4
+
+typedef struct {
+    ring_log_handle_t log;
+    uint32_t producer;
+    int count;
+} async_producer_t;
+
+static void async_producer(void *arg) {
+    async_producer_t *producer = arg;
+    char padding[16];
+    memset(padding, 'p', sizeof(padding));
+    for (int i = 0; i < producer->count; i++) {
+        async_entry_t entry = { .producer = producer->producer, .seq = i };
+        struct iovec iov[] = {
+            { .iov_base = &entry, .iov_len = sizeof(entry) },
+            { .iov_base = padding, .iov_len = i % (sizeof(padding) + 1) }
+        };
+        RING_LOG_EXPECT(ring_log_writev(producer->log, iov, 2), 1);
+    }
+}
+
+// read_async_entry reads the head entry into `entry` (of up to `len` bytes),
+// and returns how long it is.
+static size_t read_async_entry(ring_log_handle_t log, void *entry, size_t len) {
+    size_t read_total = 0;
+    while (ring_log_read_head_h(log, (char *)entry + read_total, len - read_total, &read_total) > 0) {
+    }
+    ring_log_read_head_success_h(log);
+    return read_total;
+}
+
+typedef struct {
+    ring_log_handle_t log;
+    const char *tail;
+    size_t len;
+    int started;
+} async_tail_writer_t;
+
+// async_tail_writer writes a tail entry straight into the file, and completes
+// it a while after saying it's started.
+static void async_tail_writer(void *arg) {
+    async_tail_writer_t *writer = arg;
+    ring_log_write_tail_h(writer->log, writer->tail, writer->len);
+    __atomic_store_n(&writer->started, 1, __ATOMIC_RELEASE);
+    uint64_t until = ring_log_arch_now_ms() + 200;
+    while (ring_log_arch_now_ms() < until) {
+    }
+    ring_log_write_tail_complete_h(writer->log);
+}
+
+void test_async(int count) {
+    printf("  writing %i entries from each of %i tasks through an async queue..\n", count, ASYNC_PRODUCERS);
+    ring_log_handle_t log = ring_log_open("log_c");
+    log->async_full = RING_LOG_ASYNC_BLOCK;
+    uint64_t tail_seq = log->file_header.tail_seq;
+    uint64_t written = __atomic_load_n(&log->async_written, __ATOMIC_ACQUIRE);
+
+    // Read entries while the producers write them. Each producer's entries
+    // have to come out in order, but some can get evicted along the way (even
+    // the last few, by the other producers' entries).
+    async_producer_t producers[ASYNC_PRODUCERS];
+    void *threads[ASYNC_PRODUCERS];
+    for (int i = 0; i < ASYNC_PRODUCERS; i++) {
+        producers[i].log = log;
+        producers[i].producer = i;
+        producers[i].count = count;
+        threads[i] = ring_log_arch_start_thread(async_producer, &producers[i]);
+        RING_LOG_EXPECT_NOT(threads[i], NULL);
+    }
+    int64_t last_seq[ASYNC_PRODUCERS];
+    for (int i = 0; i < ASYNC_PRODUCERS; i++) {
+        last_seq[i] = -1;
+    }
+    int count_read = 0;
+    int done = 0;
+    while (!done) {
+        // Once the producers are done and everything's flushed, read out
+        // what's left.
+        if (__atomic_load_n(&log->async_written, __ATOMIC_ACQUIRE) == written + (uint64_t)ASYNC_PRODUCERS * count) {
+            ring_log_flush();
+            done = 1;
+        }
+        while (ring_log_has_unread_h(log)) {
+            char buffer[sizeof(async_entry_t) + 16];
+            size_t len = read_async_entry(log, buffer, sizeof(buffer));
+            async_entry_t entry;
+            memcpy(&entry, buffer, sizeof(entry));
+            RING_LOG_EXPECT(entry.producer < ASYNC_PRODUCERS, 1);
+            RING_LOG_EXPECT(entry.seq > last_seq[entry.producer], 1);
+            RING_LOG_EXPECT(len, sizeof(entry) + entry.seq % 17);
+            last_seq[entry.producer] = entry.seq;
+            count_read++;
+        }
+    }
+    for (int i = 0; i < ASYNC_PRODUCERS; i++) {
+        ring_log_arch_join_thread(threads[i]);
+    }
+    // With RING_LOG_ASYNC_BLOCK, none of them get dropped.
+    RING_LOG_EXPECT(log->file_header.tail_seq - tail_seq, ASYNC_PRODUCERS * count);
+
+    printf("    .. read %i entries back out\n", count_read);
+
+    // Hold up the flusher, and fill up the queue.
+    char s[40];
+    uint32_t seq = 0;
+    struct iovec iov = { .iov_base = &seq, .iov_len = sizeof(seq) };
+    ring_log_arch_take_mutex(log->mutex);
+    for (; seq < log->async_slots; seq++) {
+        RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 1);
+    }
+
+    // Entries that don't fit get dropped, and with
+    // RING_LOG_ASYNC_COUNT_AND_DROP, counted.
+    log->async_full = RING_LOG_ASYNC_DROP_NEWEST;
+    RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 0);
+    log->async_full = RING_LOG_ASYNC_COUNT_AND_DROP;
+    RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 0);
+    RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 0);
+    ring_log_arch_free_mutex(log->mutex);
+
+    // An entry too big for the queue goes in after the ones in the queue.
+    char big[log->async_entry_size + 1];
+    memset(big, 'b', sizeof(big));
+    struct iovec big_iov = { .iov_base = big, .iov_len = sizeof(big) };
+    RING_LOG_EXPECT(ring_log_writev(log, &big_iov, 1), 1);
+    ring_log_flush();
+
+    for (uint32_t i = 0; i < log->async_slots; i++) {
+        RING_LOG_EXPECT(read_async_entry(log, &seq, sizeof(seq)), sizeof(seq));
+        RING_LOG_EXPECT(seq, i);
+    }
+    size_t len = read_async_entry(log, s, sizeof(s));
+    RING_LOG_EXPECT(len, strlen("ring_log: dropped 2 entries"));
+    RING_LOG_EXPECT(memcmp(s, "ring_log: dropped 2 entries", len), 0);
+    RING_LOG_EXPECT(read_async_entry(log, s, sizeof(s)), sizeof(big));
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+    log->async_full = RING_LOG_ASYNC_BLOCK;
+
+    // A tail entry too big to stage holds up the flusher until it's complete.
+    // The task writing it doesn't wait for the flusher in the meantime, since
+    // it would never get there: an entry too big for the queue isn't written,
+    // one that finds the queue full is dropped, and ring_log_flush doesn't
+    // wait.
+    char tail[60], t[sizeof(tail)];
+    RING_LOG_EXPECT(log->staging_size < 18 + sizeof(tail), 1);
+    memset(tail, 't', sizeof(tail));
+    ring_log_write_tail_h(log, tail, sizeof(tail));
+    for (seq = 0; seq < log->async_slots; seq++) {
+        RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 1);
+    }
+    RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 0);
+    RING_LOG_EXPECT(ring_log_writev(log, &big_iov, 1), 0);
+    RING_LOG_EXPECT(ring_log_flush(), 0);
+    ring_log_write_tail_complete_h(log);
+    RING_LOG_EXPECT(ring_log_flush(), 1);
+    RING_LOG_EXPECT(read_async_entry(log, t, sizeof(t)), sizeof(tail));
+    RING_LOG_EXPECT(memcmp(t, tail, sizeof(tail)), 0);
+    for (uint32_t i = 0; i < log->async_slots; i++) {
+        RING_LOG_EXPECT(read_async_entry(log, &seq, sizeof(seq)), sizeof(seq));
+        RING_LOG_EXPECT(seq, i);
+    }
+    len = read_async_entry(log, s, sizeof(s));
+    RING_LOG_EXPECT(len, strlen("ring_log: dropped 1 entries"));
+    RING_LOG_EXPECT(memcmp(s, "ring_log: dropped 1 entries", len), 0);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+
+    // Another task's tail entry gets completed in the end, so an entry that
+    // finds the queue full waits for it.
+    async_tail_writer_t writer = { .log = log, .tail = tail, .len = sizeof(tail) };
+    void *thread = ring_log_arch_start_thread(async_tail_writer, &writer);
+    RING_LOG_EXPECT_NOT(thread, NULL);
+    while (!__atomic_load_n(&writer.started, __ATOMIC_ACQUIRE)) {
+    }
+    for (seq = 0; seq <= log->async_slots; seq++) {
+        RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 1);
+    }
+    ring_log_arch_join_thread(thread);
+    RING_LOG_EXPECT(ring_log_flush(), 1);
+    RING_LOG_EXPECT(read_async_entry(log, t, sizeof(t)), sizeof(tail));
+    RING_LOG_EXPECT(memcmp(t, tail, sizeof(tail)), 0);
+    for (uint32_t i = 0; i <= log->async_slots; i++) {
+        RING_LOG_EXPECT(read_async_entry(log, &seq, sizeof(seq)), sizeof(seq));
+        RING_LOG_EXPECT(seq, i);
+    }
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+
+    // ring_log_deinit doesn't wait for it either, and drops what's queued.
+    ring_log_write_tail_h(log, tail, sizeof(tail));
+    RING_LOG_EXPECT(ring_log_writev(log, &iov, 1), 1);
+    ring_log_deinit();
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+}
+
+typedef struct {
+    ring_log_handle_t log;
+    int count;
+    // make_entry makes entry `seq` in `entry` (which has room for 100 bytes),
+    // starting with `seq`, and returns how long it is.
+    size_t (*make_entry)(uint32_t seq, char *entry);
+    // If `lead` isn't 0, the writer stays no more than that many entries
+    // ahead of the `read` entries the reader has got through.
+    int lead;
+    int read;
+    int done;
+} spsc_writer_t;
+
+// spsc_entry makes entry `seq` of test_spsc: the sequence number, and up to
+// 79 bytes more, so some go straight into the file. It returns how long the
+// entry is.
+static size_t spsc_entry(uint32_t seq, char *entry) {
+    size_t len = sizeof(seq) + (seq * 7) % 80;
+    memcpy(entry, &seq, sizeof(seq));
+    for (int j = sizeof(seq); j < len; j++) {
+        entry[j] = seq + j;
+    }
+    return len;
+}
+
+static void spsc_writer(void *arg) {
+    spsc_writer_t *writer = arg;
+    char entry[100];
+    for (uint32_t i = 0; i < writer->count; i++) {
+        size_t len = writer->make_entry(i, entry);
+        while (writer->lead != 0 && i >= __atomic_load_n(&writer->read, __ATOMIC_ACQUIRE) + writer->lead) {
+        }
+        ring_log_write_tail_h(writer->log, entry, 2);
+        ring_log_write_tail_h(writer->log, entry + 2, len - 2);
+        ring_log_write_tail_complete_h(writer->log);
+    }
+    __atomic_store_n(&writer->done, 1, __ATOMIC_RELEASE);
+}
+
+// run_spsc writes `count` entries made with `make_entry`, up to `lead`
+// entries ahead of the reader (see spsc_writer_t), to the spsc `log` from one
+// task while reading them from this one, and returns how many were read.
+// Entries can get evicted before they're read, but the ones read come out
+// whole and in order.
+static int run_spsc(ring_log_handle_t log, int count, size_t (*make_entry)(uint32_t seq, char *entry), int lead) {
+    RING_LOG_EXPECT(log->spsc, 1);
+    while (ring_log_has_unread_h(log)) {
+        ring_log_read_head_success_h(log);
+    }
+
+    spsc_writer_t writer = { .log = log, .count = count, .make_entry = make_entry, .lead = lead, .read = 0, .done = 0 };
+    void *thread = ring_log_arch_start_thread(spsc_writer, &writer);
+    RING_LOG_EXPECT_NOT(thread, NULL);
+    int64_t last_seq = -1;
+    int count_read = 0;
+    int done = 0;
+    while (!done) {
+        done = __atomic_load_n(&writer.done, __ATOMIC_ACQUIRE);
+        while (ring_log_has_unread_h(log)) {
+            char entry[100], expected[100];
+            size_t read_total = 0;
+            RING_LOG_EXPECT_NOT(ring_log_read_head_h(log, entry, sizeof(entry), &read_total), -1);
+            ring_log_read_head_success_h(log);
+            uint32_t seq;
+            memcpy(&seq, entry, sizeof(seq));
+            RING_LOG_EXPECT(seq > last_seq && seq < count, 1);
+            RING_LOG_EXPECT(read_total, make_entry(seq, expected));
+            RING_LOG_EXPECT(memcmp(entry, expected, read_total), 0);
+            last_seq = seq;
+            count_read++;
+            __atomic_store_n(&writer.read, seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+    ring_log_arch_join_thread(thread);
+    RING_LOG_EXPECT(last_seq, count - 1);
+    return count_read;
+}
+
+// test_spsc writes entries to an spsc log (see log_t) from one task while
+// reading them from another.
+void test_spsc(int count) {
+    printf("  writing %i entries to an spsc log while reading them..\n", count);
+    ring_log_handle_t log = ring_log_open("log_c");
+    int count_read = run_spsc(log, count, spsc_entry, 0);
+    printf("    .. read %i entries back out\n", count_read);
+
+    // Checking for entries doesn't take a lock.
+    ring_log_stats_t before, after;
+    if (ring_log_get_stats(log, &before)) {
+        RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+        RING_LOG_EXPECT(ring_log_get_stats(log, &after), 1);
+        RING_LOG_EXPECT(after.lock_acquisitions, before.lock_acquisitions);
+    }
+
+    // The reader doesn't write the file header, but the head it got to is
+    // stored by the time the log is closed.
+    ring_log_deinit();
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+    RING_LOG_EXPECT(log->file_header.head_seq, log->file_header.tail_seq);
+}
+
+// compression_entry makes entry `seq` for test_compression: the sequence
+// number, followed by text that compresses well, bytes that don't, or text
+// that doesn't fit in the staging buffer. It returns how long the entry is.
+static size_t compression_entry(uint32_t seq, char *entry) {
+    static const char text[] = "temp 21.5C ";
+    size_t len;
+    memcpy(entry, &seq, sizeof(seq));
+    switch (seq % 3) {
+    case 0:
+        len = sizeof(seq) + 20 + (seq % 23);
+        break;
+    case 1:
+        len = sizeof(seq) + (seq % 40);
+        break;
+    default:
+        len = sizeof(seq) + 44 + (seq % 30);
+        break;
+    }
+    uint32_t x = seq + 1;
+    for (size_t i = sizeof(seq); i < len; i++) {
+        if (seq % 3 == 1) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            entry[i] = x;
+        } else {
+            entry[i] = text[i % (sizeof(text) - 1)];
+        }
+    }
+    return len;
+}
+
+// check_compression_entry checks that `entry` is entry `seq` for
+// test_compression, and that it comes right after entry `last_seq` (if any).
+static void check_compression_entry(const char *entry, size_t len, int64_t last_seq) {
+    char expected[200];
+    uint32_t seq;
+    RING_LOG_EXPECT_NOT(len < sizeof(seq), 1);
+    memcpy(&seq, entry, sizeof(seq));
+    if (last_seq != -1) {
+        RING_LOG_EXPECT(seq - last_seq, 1);
+    }
+    RING_LOG_EXPECT(len, compression_entry(seq, expected));
+    RING_LOG_EXPECT(memcmp(entry, expected, len), 0);
+}
+
+// drain_compressed reads all of the entries in log_b, with read_head (`way`
+// 0), a cursor (1) or in batches (2), checks them, and returns how many there
+// were. `*last_seq` is the sequence number of the last entry read.
+static int drain_compressed(ring_log_handle_t log, int way, int64_t *last_seq) {
+    char entry[200];
+    size_t entry_offsets[9];
+    ring_log_cursor_t cursor;
+    int64_t seq = -1;
+    int count_read = 0;
+    while (ring_log_has_unread_h(log)) {
+        size_t read_total = 0;
+        int read_now;
+        int n = 1;
+        if (way == 0) {
+            while ((read_now = ring_log_read_head_h(log, entry + read_total, 1 + (rand() % 16), &read_total))) {
+                RING_LOG_EXPECT_NOT(read_now, -1);
+            }
+            ring_log_read_head_success_h(log);
+            entry_offsets[0] = 0;
+            entry_offsets[1] = read_total;
+        } else if (way == 1) {
+            RING_LOG_EXPECT(ring_log_cursor_begin(log, &cursor), 1);
+            while ((read_now = ring_log_cursor_read(&cursor, entry + read_total, 1 + (rand() % 16)))) {
+                RING_LOG_EXPECT_NOT(read_now, -1);
+                read_total += read_now;
+            }
+            RING_LOG_EXPECT(read_total, cursor.len);
+            ring_log_cursor_commit(&cursor);
+            entry_offsets[0] = 0;
+            entry_offsets[1] = read_total;
+        } else {
+            n = ring_log_read_batch(log, entry, sizeof(entry), entry_offsets, 8);
+            RING_LOG_EXPECT_NOT(n, -1);
+            RING_LOG_EXPECT_NOT(n, 0);
+            ring_log_ack(log, n);
+        }
+        for (int i = 0; i < n; i++) {
+            check_compression_entry(&entry[entry_offsets[i]], entry_offsets[i + 1] - entry_offsets[i], seq);
+            uint32_t entry_seq;
+            memcpy(&entry_seq, &entry[entry_offsets[i]], sizeof(entry_seq));
+            seq = entry_seq;
+        }
+        count_read += n;
+    }
+    if (seq != -1) {
+        *last_seq = seq;
+    }
+    return count_read;
+}
+
+// spsc_compression_entry makes entry `seq` for test_spsc_compression: the
+// sequence number, bytes that don't compress, and then text that does, so that
+// it fills the staging buffer and only compresses to about half of that. It
+// returns how long the entry is.
+static size_t spsc_compression_entry(uint32_t seq, char *entry) {
+    static const char text[] = "temp 21.5C ";
+    size_t len = sizeof(seq) + 42;
+    memcpy(entry, &seq, sizeof(seq));
+    uint32_t x = seq + 1;
+    for (size_t i = sizeof(seq); i < len; i++) {
+        if (i < len / 2) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            entry[i] = x;
+        } else {
+            entry[i] = text[i % (sizeof(text) - 1)];
+        }
+    }
+    return len;
+}
+
+// The compress buffer for log_b while test_spsc_compression makes it an spsc
+// log, which needs three times the room of its staging buffer (see log_t).
+static char spsc_compress_buffer[3 * 64];
+
+// test_spsc_compression makes log_b an spsc log, and writes entries to it
+// from one task while reading them from another, so that the reader
+// decompresses entries while the writer compresses the next ones.
+void test_spsc_compression(int count) {
+    printf("  writing %i entries to a compressed spsc log while reading them..\n", count);
+    log_t *config = &logs[1];
+    RING_LOG_EXPECT(sizeof(spsc_compress_buffer) >= 3 * config->staging_size, 1);
+    char *compress_buffer = config->compress_buffer;
+    size_t compress_buffer_size = config->compress_buffer_size;
+    ring_log_deinit();
+    config->spsc = 1;
+    config->compress_buffer = spsc_compress_buffer;
+    config->compress_buffer_size = sizeof(spsc_compress_buffer);
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+
+    ring_log_handle_t log = ring_log_open("log_b");
+    // The writer stays just ahead of the reader, so that they keep running
+    // at the same time.
+    int count_read = run_spsc(log, count, spsc_compression_entry, 2);
+    printf("    .. read %i entries back out\n", count_read);
+
+    ring_log_deinit();
+    config->spsc = 0;
+    config->compress_buffer = compress_buffer;
+    config->compress_buffer_size = compress_buffer_size;
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+}
+
+void test_compression(int count) {
+    printf("  writing %i entries to a compressed log..\n", count);
+    ring_log_handle_t log = ring_log_open("log_b");
+    char entry[200];
+
+    // Write a few entries at a time, and read them back out each way.
+    for (int way = 0; way < 3; way++) {
+        int64_t last_seq = -1;
+        int count_read = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            ring_log_write_tail_h(log, entry, compression_entry(i, entry));
+            ring_log_write_tail_complete_h(log);
+            if (rand() % 3 == 0) {
+                count_read += drain_compressed(log, way, &last_seq);
+            }
+        }
+        count_read += drain_compressed(log, way, &last_seq);
+        RING_LOG_EXPECT(last_seq, count - 1);
+        printf("    .. read %i entries back out (way %i)\n", count_read, way);
+    }
+
+    // Compressed, more entries fit in the log than the log has room for raw
+    // (with entry headers of at least a byte of length, the sequence number
+    // and the CRC).
+    size_t len = compression_entry(45, entry);
+    int fit_raw = log->capacity / (len + 1 + 2 * sizeof(uint32_t));
+    for (int i = 0; i < 10; i++) {
+        ring_log_write_tail_h(log, entry, len);
+        ring_log_write_tail_complete_h(log);
+    }
+    int retained = 0;
+    while (ring_log_has_unread_h(log)) {
+        ring_log_read_head_success_h(log);
+        retained++;
+    }
+    printf("    .. %i entries of %zu bytes fit, raw %i would\n", retained, len, fit_raw);
+    RING_LOG_EXPECT(retained > fit_raw, 1);
+}
+
+// read_oversize reads the entry at the head of `log` into `entry` (which has
+// room for 100 bytes) in one of three ways, drops it, and returns how long it
+// was.
+static size_t read_oversize(ring_log_handle_t log, int way, char *entry) {
+    size_t read_total = 0;
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 1);
+    if (way == 0) {
+        // A few bytes at a time.
+        int read_now;
+        while ((read_now = ring_log_read_head_h(log, entry + read_total, 1 + (rand() % 10), &read_total))) {
+            RING_LOG_EXPECT_NOT(read_now, -1);
+        }
+        ring_log_read_head_success_h(log);
+    } else if (way == 1) {
+        ring_log_cursor_t cursor;
+        RING_LOG_EXPECT(ring_log_cursor_begin(log, &cursor), 1);
+        int read_now;
+        while ((read_now = ring_log_cursor_read(&cursor, entry + read_total, 1 + (rand() % 10))) > 0) {
+            read_total += read_now;
+        }
+        RING_LOG_EXPECT(read_total, cursor.len);
+        // It went through the pieces as it read them, and ended up in the
+        // last one.
+        RING_LOG_EXPECT(cursor.piece_seq + 1, log->file_header.tail_seq);
+        ring_log_cursor_commit(&cursor);
+    } else {
+        char buffer[300];
+        size_t entry_offsets[3];
+        RING_LOG_EXPECT(ring_log_read_batch(log, buffer, sizeof(buffer), entry_offsets, 2), 1);
+        read_total = entry_offsets[1] - entry_offsets[0];
+        memcpy(entry, buffer + entry_offsets[0], read_total);
+        ring_log_ack(log, 1);
+    }
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+    return read_total;
+}
+
+// test_oversize writes entries that are longer than the log's max_entry_size,
+// and checks that they come back out cut short with the marker, or whole from
+// their pieces.
+void test_oversize(const char *log_fn, int count) {
+    printf("  writing %i oversized entries to %s..\n", count, log_fn);
+    ring_log_handle_t log = ring_log_open(log_fn);
+    const char marker[] = RING_LOG_TRUNCATED_MARKER;
+    const size_t marker_len = sizeof(marker) - 1;
+    char entry[100], read[100];
+    while (ring_log_has_unread_h(log)) {
+        ring_log_read_head_success_h(log);
+    }
+
+    // Cut short, written bit by bit or in one go, unless it just fits.
+    log->max_entry_size = 16;
+    log->oversize = RING_LOG_OVERSIZE_TRUNCATE;
+    for (int i = 0; i < sizeof(entry); i++) {
+        entry[i] = 'a' + i % 26;
+    }
+    struct iovec iov[2] = {{ .iov_base = entry, .iov_len = 20 }, { .iov_base = entry + 20, .iov_len = 20 }};
+    for (int i = 0; i < 3 * 3; i++) {
+        if (i % 3 == 0) {
+            ring_log_write_tail_h(log, entry, 10);
+            ring_log_write_tail_h(log, entry + 10, 30);
+            ring_log_write_tail_complete_h(log);
+        } else if (i % 3 == 1) {
+            RING_LOG_EXPECT(ring_log_writev(log, iov, 2), 1);
+        } else {
+            ring_log_write_tail_h(log, entry, 16);
+            ring_log_write_tail_complete_h(log);
+        }
+        RING_LOG_EXPECT(read_oversize(log, i / 3, read), 16);
+        size_t cut = i % 3 == 2 ? 16 : 16 - marker_len;
+        RING_LOG_EXPECT(memcmp(read, entry, cut), 0);
+        RING_LOG_EXPECT(memcmp(read + cut, marker, 16 - cut), 0);
+    }
+
+    // In pieces of 16 bytes, up to as many as fit in the ring. The pieces of
+    // an entry that's still being written aren't there to read yet.
+    log->oversize = RING_LOG_OVERSIZE_FRAGMENT;
+    size_t longest = 0;
+    for (int i = 0; i < count; i++) {
+        size_t len = 1 + (rand() % 48);
+        for (int j = 0; j < len; j++) {
+            entry[j] = i + j % 7;
+        }
+        if (i % 2) {
+            for (size_t written = 0; written < len; ) {
+                size_t now = 1 + (rand() % 10);
+                now = now < len - written ? now : len - written;
+                ring_log_write_tail_h(log, entry + written, now);
+                written += now;
+                RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+            }
+            ring_log_write_tail_complete_h(log);
+        } else {
+            size_t half = rand() % len;
+            iov[0].iov_len = half;
+            iov[1].iov_base = entry + half;
+            iov[1].iov_len = len - half;
+            RING_LOG_EXPECT(ring_log_writev(log, iov, 2), 1);
+        }
+        RING_LOG_EXPECT(read_oversize(log, i % 3, read), len);
+        RING_LOG_EXPECT(memcmp(read, entry, len), 0);
+        longest = len > longest ? len : longest;
+    }
+    printf("    .. read them back out, the longest in %zu pieces\n", (longest + 15) / 16);
+
+    // Entries that would take more pieces than that get cut short.
+    for (int i = 0; i < sizeof(entry); i++) {
+        entry[i] = 'a' + i % 26;
+    }
+    ring_log_write_tail_h(log, entry, sizeof(entry));
+    ring_log_write_tail_complete_h(log);
+    size_t len = read_oversize(log, 0, read);
+    RING_LOG_EXPECT(len > marker_len && len < sizeof(entry), 1);
+    RING_LOG_EXPECT(memcmp(read, entry, len - marker_len), 0);
+    RING_LOG_EXPECT(memcmp(read + len - marker_len, marker, marker_len), 0);
+
+    // An entry whose last piece never got written is gone once the log is
+    // opened again.
+    ring_log_write_tail_h(log, entry, 40);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+    ring_log_deinit();
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+    RING_LOG_EXPECT(log->file_header.head_seq, log->file_header.tail_seq);
+
+    log->max_entry_size = 0;
+    log->oversize = RING_LOG_OVERSIZE_TRUNCATE;
+}
+
+// read_reserved_entry reads the head entry written by test_reserve, checks it,
+// and returns its sequence number.
+static uint32_t read_reserved_entry(ring_log_handle_t log) {
+    char entry[40];
+    size_t read_total = 0;
+    RING_LOG_EXPECT_NOT(ring_log_read_head_h(log, entry, sizeof(entry), &read_total), -1);
+    uint32_t seq;
+    memcpy(&seq, entry, sizeof(seq));
+    RING_LOG_EXPECT(read_total >= sizeof(seq), 1);
+    for (int j = sizeof(seq); j < read_total; j++) {
+        RING_LOG_EXPECT(entry[j], (char)(seq + j));
+    }
+    ring_log_read_head_success_h(log);
+    return seq;
+}
+
+// reserve_entry reserves an entry of `len` bytes in `log`, and fills it in
+// with `seq` and the bytes that go after it.
+static void reserve_entry(ring_log_handle_t log, uint32_t seq, size_t len, ring_log_resv_t *resv) {
+    char entry[40];
+    memcpy(entry, &seq, sizeof(seq));
+    for (int j = sizeof(seq); j < len; j++) {
+        entry[j] = seq + j;
+    }
+    RING_LOG_EXPECT_NOT(ring_log_reserve(log, len, resv), NULL);
+    RING_LOG_EXPECT(resv->len[0] + resv->len[1], len);
+    memcpy(resv->span[0], entry, resv->len[0]);
+    memcpy(resv->span[1], entry + resv->len[0], resv->len[1]);
+}
+
+// test_reserve fills in entries in place with ring_log_reserve, commits most
+// of them and abandons the rest, and checks that only the committed ones come
+// back out.
+void test_reserve(int count) {
+    printf("  reserving %i entries..\n", count);
+    ring_log_handle_t log = ring_log_open("log_a");
+    int mapped = ring_log_io_map(log, 0) != NULL;
+    while (ring_log_has_unread_h(log)) {
+        ring_log_read_head_success_h(log);
+    }
+
+    // Between 4 and 40 bytes, which all fit in the staging buffer, and
+    // sometimes read the head entry.
+    ring_log_resv_t resv, other;
+    int last_seq = -1;
+    int wrapped = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        reserve_entry(log, i, sizeof(uint32_t) + (rand() % 37), &resv);
+        wrapped += resv.len[1] > 0;
+        // There's only ever one reservation at a time, and giving up on one
+        // that failed leaves the other alone.
+        RING_LOG_EXPECT(ring_log_reserve(log, 1, &other), NULL);
+        ring_log_abandon(&other);
+        RING_LOG_EXPECT(ring_log_commit(&other), 0);
+        if (i % 5 == 4) {
+            ring_log_abandon(&resv);
+            RING_LOG_EXPECT(ring_log_commit(&resv), 0);
+        } else {
+            RING_LOG_EXPECT(ring_log_commit(&resv), 1);
+        }
+        sanity_check_index("log_a");
+        if (rand() % 3 == 0 && ring_log_has_unread_h(log)) {
+            uint32_t seq = read_reserved_entry(log);
+            RING_LOG_EXPECT(seq % 5 != 4 && (int)seq > last_seq, 1);
+            last_seq = seq;
+        }
+    }
+    while (ring_log_has_unread_h(log)) {
+        uint32_t seq = read_reserved_entry(log);
+        RING_LOG_EXPECT(seq % 5 != 4 && (int)seq > last_seq, 1);
+        last_seq = seq;
+    }
+    RING_LOG_EXPECT(last_seq, ((count - 1) % 5 == 4 ? count - 2 : count - 1));
+    printf("    .. %i of them wrapped around the end of the ring\n", wrapped);
+    if (mapped) {
+        RING_LOG_EXPECT(wrapped > 0, 1);
+    }
+
+    // Bigger than the staging buffer only works in the mapping, and never
+    // bigger than the ring has room for.
+    RING_LOG_EXPECT(ring_log_reserve(log, logs[0].staging_size, &resv) != NULL, mapped);
+    if (mapped) {
+        ring_log_abandon(&resv);
+    }
+    RING_LOG_EXPECT(ring_log_reserve(log, logs[0].capacity, &resv), NULL);
+
+    // While an entry is reserved in the mapping, it's in the way of any
+    // other, and a tail entry being written bit by bit can't be added to it
+    // either way.
+    reserve_entry(log, count, 10, &resv);
+    RING_LOG_EXPECT(ring_log_writev(log, &(struct iovec){ .iov_base = "zzzz", .iov_len = 4 }, 1), !mapped);
+    ring_log_write_tail_h(log, "tail", 4);
+    ring_log_write_tail_complete_h(log);
+    RING_LOG_EXPECT(ring_log_commit(&resv), 1);
+    if (!mapped) {
+        char s[4];
+        size_t read_total = 0;
+        RING_LOG_EXPECT(ring_log_read_head_h(log, s, sizeof(s), &read_total), 4);
+        ring_log_read_head_success_h(log);
+    }
+    RING_LOG_EXPECT(read_reserved_entry(log), count);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+
+    // An entry reserved but never committed is gone once the log is opened
+    // again, and the one before it can still be read in the meantime.
+    reserve_entry(log, count + 1, 20, &resv);
+    RING_LOG_EXPECT(ring_log_commit(&resv), 1);
+    reserve_entry(log, count + 2, 20, &resv);
+    RING_LOG_EXPECT(read_reserved_entry(log), count + 1);
+    uint64_t tail_seq = log->file_header.tail_seq;
+    ring_log_deinit();
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+    RING_LOG_EXPECT(log->file_header.tail_seq, tail_seq);
+}
+
+// disk_tail_seq returns the tail_seq in log_a's file header, as it is in the
+// file rather than in RAM.
+static uint64_t disk_tail_seq(void) {
+    file_header_t file_header;
+    int fd = open("log_a", O_RDONLY);
+    RING_LOG_EXPECT_NOT(fd, -1);
+    RING_LOG_EXPECT(read(fd, &file_header, sizeof(file_header)), sizeof(file_header));
+    close(fd);
+    return file_header.tail_seq;
+}
+
+void test_durability(void) {
+    // With group commits, the file header only gets written every
+    // group_entries entries, or when asked to.
+    puts("  group commits every 3 entries..");
+    logs[0].durability = RING_LOG_DURABILITY_GROUP;
+    logs[0].group_entries = 3;
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    ring_log_handle_t log = ring_log_open("log_a");
+    uint64_t first = disk_tail_seq();
+    for (int i = 1; i <= 7; i++) {
+        ring_log_write_tail_h(log, "x", 1);
+        ring_log_write_tail_complete_h(log);
+        RING_LOG_EXPECT(disk_tail_seq(), first + i / 3 * 3);
+    }
+    ring_log_sync_h(log);
+    RING_LOG_EXPECT(disk_tail_seq(), first + 7);
+
+    // ring_log_deinit commits whatever is left.
+    ring_log_write_tail_h(log, "x", 1);
+    ring_log_write_tail_complete_h(log);
+    RING_LOG_EXPECT(disk_tail_seq(), first + 7);
+    ring_log_deinit();
+    RING_LOG_EXPECT(disk_tail_seq(), first + 8);
+
+    // Otherwise, the file header is written for every entry.
+    ring_log_durability_t durabilities[] = {RING_LOG_DURABILITY_NONE, RING_LOG_DURABILITY_SYNC};
+    for (int i = 0; i < sizeof(durabilities) / sizeof(durabilities[0]); i++) {
+        printf("  durability %i..\n", durabilities[i]);
+        logs[0].durability = durabilities[i];
+        RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+        ring_log_write_tail_h(log, "x", 1);
+        ring_log_write_tail_complete_h(log);
+        RING_LOG_EXPECT(disk_tail_seq(), first + 9 + i);
+        while (ring_log_has_unread_h(log)) {
+            ring_log_read_head_success_h(log);
+        }
+        ring_log_deinit();
+    }
+    logs[0].durability = RING_LOG_DURABILITY_NONE;
+}
+
+// read_header_slot reads header slot `n` of log_a, as it is in the file.
+static void read_header_slot(int n, ring_log_header_slot_t *slot) {
+    int fd = open("log_a", O_RDONLY);
+    RING_LOG_EXPECT_NOT(fd, -1);
+    off_t off = RING_LOG_JOURNAL_OFF(logs[0].capacity, logs[0].program_page) + n * RING_LOG_HEADER_SLOT_SIZE(logs[0].program_page);
+    RING_LOG_EXPECT(lseek(fd, off, SEEK_SET), off);
+    RING_LOG_EXPECT(read(fd, slot, sizeof(*slot)), sizeof(*slot));
+    close(fd);
+}
+
+// test_journal writes `count` entries to log_a, which has a header journal
+// and a program page, and checks that the header slots take turns and that
+// ring_log_init goes by the newest one that checks out.
+void test_journal(int count) {
+    printf("  writing %i entries with a header journal..\n", count);
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    ring_log_handle_t log = ring_log_open("log_a");
+    char entry[sizeof(uint32_t) + 20];
+    for (uint32_t seq = 0; seq < count; seq++) {
+        memcpy(entry, &seq, sizeof(seq));
+        memset(entry + sizeof(seq), 'j', seq % 21);
+        // However many entries it evicts, the entry takes at most two header
+        // slots: one for the new head before it's written, one for the tail.
+        uint64_t header_seq = log->header_seq;
+        ring_log_write_tail_h(log, entry, sizeof(seq) + seq % 21);
+        ring_log_write_tail_complete_h(log);
+        RING_LOG_EXPECT(log->header_seq - header_seq <= 2, 1);
+        RING_LOG_EXPECT(log->file_header.tail % logs[0].program_page, 0);
+    }
+    sanity_check_index("log_a");
+
+    // The newest slot has the file header as it is in RAM, and the slots
+    // before it the ones before that.
+    int newest = -1;
+    uint64_t newest_seq = 0;
+    for (int i = 0; i < logs[0].header_slots; i++) {
+        ring_log_header_slot_t slot;
+        read_header_slot(i, &slot);
+        RING_LOG_EXPECT(slot.seq % logs[0].header_slots, i);
+        if (slot.seq > newest_seq) {
+            newest = i;
+            newest_seq = slot.seq;
+        }
+    }
+    RING_LOG_EXPECT(newest_seq >= count, 1);
+    ring_log_header_slot_t slot;
+    read_header_slot(newest, &slot);
+    RING_LOG_EXPECT(slot.file_header.tail_seq, log->file_header.tail_seq);
+    RING_LOG_EXPECT(slot.file_header.head, log->file_header.head);
+    ring_log_deinit();
+
+    // With the newest slot torn, the one before it wins, and the entry after
+    // it gets picked up by recovery.
+    slot.crc ^= 1;
+    int fd = open("log_a", O_WRONLY);
+    RING_LOG_EXPECT_NOT(fd, -1);
+    off_t off = RING_LOG_JOURNAL_OFF(logs[0].capacity, logs[0].program_page) + newest * RING_LOG_HEADER_SLOT_SIZE(logs[0].program_page);
+    RING_LOG_EXPECT(lseek(fd, off, SEEK_SET), off);
+    RING_LOG_EXPECT(write(fd, &slot, sizeof(slot)), sizeof(slot));
+    close(fd);
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    RING_LOG_EXPECT(log->file_header.tail_seq, slot.file_header.tail_seq);
+    int count_read = 0;
+    uint32_t last_seq = 0;
+    while (ring_log_has_unread_h(log)) {
+        size_t read_total = 0;
+        RING_LOG_EXPECT_NOT(ring_log_read_head_h(log, entry, sizeof(entry), &read_total), -1);
+        memcpy(&last_seq, entry, sizeof(last_seq));
+        RING_LOG_EXPECT(read_total, sizeof(last_seq) + last_seq % 21);
+        ring_log_read_head_success_h(log);
+        count_read++;
+    }
+    RING_LOG_EXPECT(last_seq, count - 1);
+    ring_log_deinit();
+
+    printf("    .. read %i entries back out\n", count_read);
+}
+
+// The consumers that test_consumers gives log_a.
+static ring_log_consumer_t log_a_consumers[] = {
+    { .name = "uploader" },
+    { .name = "viewer" }
+};
+
+// write_consumer_entry writes an entry of `seq` followed by between 0 and 20
+// bytes to log_a.
+static void write_consumer_entry(ring_log_handle_t log, uint32_t seq) {
+    char entry[sizeof(seq) + 20];
+    memcpy(entry, &seq, sizeof(seq));
+    for (int j = sizeof(seq); j < sizeof(entry); j++) {
+        entry[j] = seq + j;
+    }
+    ring_log_write_tail_h(log, entry, sizeof(seq) + seq % 21);
+    ring_log_write_tail_complete_h(log);
+}
+
+// read_consumer_entry reads the consumer's next entry a few bytes at a time,
+// checks it, moves the consumer past it, and returns its sequence number.
+static uint32_t read_consumer_entry(ring_log_consumer_t *consumer) {
+    char entry[sizeof(uint32_t) + 20];
+    size_t read_total = 0;
+    int read_now;
+    while ((read_now = ring_log_consumer_read(consumer, entry + read_total, 3, &read_total)) > 0) {
+    }
+    RING_LOG_EXPECT(read_now, 0);
+    uint32_t seq;
+    memcpy(&seq, entry, sizeof(seq));
+    RING_LOG_EXPECT(read_total, sizeof(seq) + seq % 21);
+    for (int j = sizeof(seq); j < read_total; j++) {
+        RING_LOG_EXPECT(entry[j], (char)(seq + j));
+    }
+    ring_log_consumer_success(consumer);
+    return seq;
+}
+
+// read_consumer_slot reads the slot of log_a's consumer `n`, as it is in the
+// file.
+static void read_consumer_slot(int n, ring_log_consumer_slot_t *slot) {
+    int fd = open("log_a", O_RDONLY);
+    RING_LOG_EXPECT_NOT(fd, -1);
+    off_t off = RING_LOG_CONSUMERS_OFF(logs[0].capacity, logs[0].header_slots, logs[0].program_page) +
+        n * RING_LOG_CONSUMER_SLOT_SIZE(logs[0].program_page);
+    RING_LOG_EXPECT(lseek(fd, off, SEEK_SET), off);
+    RING_LOG_EXPECT(read(fd, slot, sizeof(*slot)), sizeof(*slot));
+    close(fd);
 }
 
+// test_consumers writes `count` entries to log_a, which has two consumers:
+// an uploader that keeps up, and a viewer that doesn't. It checks that each
+// sees every entry in order, but for the ones the viewer is told it lost,
+// that the writer never writes their slots, that the head moves on once
+// both have passed it, and that they pick up where they left off after
+// ring_log_init.
+void test_consumers(int count) {
+    printf("  reading %i entries with two consumers..\n", count);
+    logs[0].consumers = log_a_consumers;
+    logs[0].n_consumers = sizeof(log_a_consumers) / sizeof(log_a_consumers[0]);
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    sanity_check_file_size("log_a");
+    ring_log_handle_t log = ring_log_open("log_a");
+    RING_LOG_EXPECT(ring_log_consumer_open(log, "nobody"), NULL);
+    ring_log_consumer_t *uploader = ring_log_consumer_open(log, "uploader");
+    ring_log_consumer_t *viewer = ring_log_consumer_open(log, "viewer");
+    RING_LOG_EXPECT(uploader, &log_a_consumers[0]);
+    RING_LOG_EXPECT(viewer, &log_a_consumers[1]);
+    RING_LOG_EXPECT(ring_log_consumer_has_unread(uploader), 0);
+
+    uint32_t uploader_next = 0, viewer_next = 0;
+    uint64_t viewer_lost = 0;
+    int viewer_read = 0;
+    for (uint32_t seq = 0; seq < count; seq++) {
+        write_consumer_entry(log, seq);
+        while (ring_log_consumer_has_unread(uploader)) {
+            RING_LOG_EXPECT(read_consumer_entry(uploader), uploader_next);
+            uploader_next++;
+        }
+        // The viewer falls behind, and gets lapped every so often.
+        if (seq % 7 == 6 && ring_log_consumer_has_unread(viewer)) {
+            uint32_t got = read_consumer_entry(viewer);
+            RING_LOG_EXPECT(got >= viewer_next, 1);
+            RING_LOG_EXPECT(viewer->lost - viewer_lost, got - viewer_next);
+            viewer_lost = viewer->lost;
+            viewer_next = got + 1;
+            viewer_read++;
+        }
+    }
+    RING_LOG_EXPECT(uploader_next, count);
+    RING_LOG_EXPECT(uploader->lost, 0);
+    RING_LOG_EXPECT(viewer->lost > 0, 1);
+
+    // The entries that the uploader has read, but the viewer hasn't, are
+    // still there.
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 1);
+    RING_LOG_EXPECT(log->file_header.head_seq < uploader->seq, 1);
+
+    // Writing entries doesn't touch the consumers' slots.
+    ring_log_consumer_slot_t before, after;
+    read_consumer_slot(1, &before);
+    for (uint32_t seq = count; seq < count + 3; seq++) {
+        write_consumer_entry(log, seq);
+    }
+    read_consumer_slot(1, &after);
+    RING_LOG_EXPECT(memcmp(&before, &after, sizeof(before)), 0);
+    RING_LOG_EXPECT(after.seq, viewer->seq);
+    RING_LOG_EXPECT(after.lost, viewer->lost);
+
+    // The uploader reads one of those, and both pick up where they were.
+    RING_LOG_EXPECT(read_consumer_entry(uploader), count);
+    // If the writer has lapped the viewer since it last looked, it starts
+    // from the head, and counts what it missed.
+    uint64_t viewer_seq = viewer->seq > log->file_header.head_seq ? viewer->seq : log->file_header.head_seq;
+    uint64_t lost = viewer->lost + (viewer_seq - viewer->seq);
+    ring_log_deinit();
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    RING_LOG_EXPECT(ring_log_consumer_open(log, "uploader"), uploader);
+    RING_LOG_EXPECT(uploader->lost, 0);
+    RING_LOG_EXPECT(viewer->lost, lost);
+    RING_LOG_EXPECT(viewer->seq, viewer_seq);
+    RING_LOG_EXPECT(read_consumer_entry(uploader), count + 1);
+    RING_LOG_EXPECT(read_consumer_entry(uploader), count + 2);
+
+    // Once the viewer catches up too, the entries are gone.
+    while (ring_log_consumer_has_unread(viewer)) {
+        uint32_t got = read_consumer_entry(viewer);
+        RING_LOG_EXPECT(viewer->lost - viewer_lost, got - viewer_next);
+        viewer_lost = viewer->lost;
+        viewer_next = got + 1;
+        viewer_read++;
+    }
+    RING_LOG_EXPECT(viewer_next, count + 3);
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+
+    // If the entry gets evicted while it's being read, the consumer notices,
+    // and carries on from the head.
+    write_consumer_entry(log, count + 3);
+    RING_LOG_EXPECT(read_consumer_entry(uploader), count + 3);
+    char s[3];
+    size_t read_total = 0;
+    RING_LOG_EXPECT(ring_log_consumer_read(viewer, s, sizeof(s), &read_total), sizeof(s));
+    for (int i = 0; i < LOG_A_FILE_SIZE; i += 10) {
+        write_consumer_entry(log, count + 4);
+    }
+    RING_LOG_EXPECT(ring_log_consumer_read(viewer, s, sizeof(s), &read_total), -1);
+    RING_LOG_EXPECT(viewer->seq, log->file_header.head_seq);
+    while (ring_log_consumer_has_unread(uploader)) {
+        RING_LOG_EXPECT(read_consumer_entry(uploader), count + 4);
+    }
+    while (ring_log_consumer_has_unread(viewer)) {
+        RING_LOG_EXPECT(read_consumer_entry(viewer), count + 4);
+    }
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+    ring_log_deinit();
+    logs[0].consumers = NULL;
+    logs[0].n_consumers = 0;
+
+    printf("    .. the viewer read %i entries, and lost %llu\n", viewer_read, (unsigned long long)viewer_lost);
+}
+
+#ifdef RING_LOG_TEST_FAULTS
+
+// The test is linked with -Wl,--wrap=pwrite, so every pwrite comes through
+// here. Once `writes_until_crash` runs out, a write stops at a random point,
+// and none of the writes after it make it into the file, as if the machine had
+// crashed. Writes of the file header are taken to be atomic: they either make
+// it into the file or they don't.
+static int writes_until_crash;
+static int crashed;
+
+ssize_t __real_pwrite(int, const void *, size_t, off_t);
+
+ssize_t __wrap_pwrite(int fd, const void *p, size_t len, off_t off) {
+    if (crashed) {
+        return len;
+    }
+    if (writes_until_crash > 0 && --writes_until_crash == 0) {
+        crashed = 1;
+        size_t len_now = off == 0 ? (rand() % 2) * len : rand() % len;
+        if (len_now > 0) {
+            RING_LOG_EXPECT(__real_pwrite(fd, p, len_now, off), len_now);
+        }
+        return len;
+    }
+    return __real_pwrite(fd, p, len, off);
+}
+
+void test_recovery(int count) {
+    printf("  crashing %i times..\n", count);
+    ring_log_durability_t durabilities[] = {RING_LOG_DURABILITY_NONE, RING_LOG_DURABILITY_SYNC, RING_LOG_DURABILITY_GROUP};
+    double max_secs = 0;
+    int count_read = 0;
+    char entry[sizeof(uint32_t) + 50];
+    for (int i = 0; i < count; i++) {
+        logs[0].durability = durabilities[i % 3];
+        logs[0].group_entries = 5;
+        RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+        ring_log_handle_t log = ring_log_open("log_a");
+
+        // Write entries of a sequence number followed by between 0 and 50
+        // bytes, until the crash.
+        writes_until_crash = 1 + (rand() % 100);
+        uint32_t last_complete = 0;
+        for (uint32_t seq = 1; !crashed; seq++) {
+            memcpy(entry, &seq, sizeof(seq));
+            for (int j = sizeof(seq); j < sizeof(entry); j++) {
+                entry[j] = seq + j;
+            }
+            size_t len = sizeof(seq) + (seq % 51);
+            size_t half = len / 2;
+            ring_log_write_tail_h(log, entry, half);
+            ring_log_write_tail_h(log, entry + half, len - half);
+            ring_log_write_tail_complete_h(log);
+            if (!crashed) {
+                last_complete = seq;
+            }
+        }
+        ring_log_deinit();
+        crashed = 0;
+        writes_until_crash = 0;
+
+        // Every entry that was complete before the crash should be there (as
+        // far as they fit), maybe followed by the one that was being written.
+        clock_t start = clock();
+        RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        max_secs = secs > max_secs ? secs : max_secs;
+        sanity_check_index("log_a");
+        uint32_t last_seq = 0;
+        while (ring_log_has_unread_h(log)) {
+            size_t read_total = 0;
+            RING_LOG_EXPECT_NOT(ring_log_read_head_h(log, entry, sizeof(entry), &read_total), -1);
+            uint32_t seq;
+            memcpy(&seq, entry, sizeof(seq));
+            if (last_seq != 0) {
+                RING_LOG_EXPECT(seq - last_seq, 1);
+            }
+            last_seq = seq;
+            RING_LOG_EXPECT(read_total, sizeof(seq) + (seq % 51));
+            for (int j = sizeof(seq); j < read_total; j++) {
+                RING_LOG_EXPECT(entry[j], (char)(seq + j));
+            }
+            ring_log_read_head_success_h(log);
+            count_read++;
+        }
+        // The entry that was being written might also have evicted all of
+        // the complete ones.
+        size_t evicting = 2 * (9 + sizeof(uint32_t)) + (last_complete % 51) + ((last_complete + 1) % 51);
+        int all_evicted = last_seq == 0 && evicting > logs[0].capacity;
+        if (!all_evicted && last_seq != last_complete && last_seq != last_complete + 1) {
+            RING_LOG_ERROR("lost entries that were complete before the crash");
+        }
+        ring_log_deinit();
+    }
+    logs[0].durability = RING_LOG_DURABILITY_NONE;
+
+    printf("    .. read %i entries back out, recovering took at most %.0f us\n", count_read, max_secs * 1e6);
+}
+
+#endif
+
 void test(void) {
     RING_LOG_EXPECT_NOT(ring_log_init(), 0);
 
@@ -103,13 +1666,35 @@ void test(void) {
 
     sanity_check_file_size("log_a");
 
+    test_cursor(1000);
+
+    test_batch(1000);
+
+    test_writev(1000);
+
+    test_printf(300);
+
+    test_async(1000);
+
+    test_spsc(10000);
+
+    test_compression(300);
+
+    test_spsc_compression(10000);
+
+    test_oversize("log_a", 300);
+    test_oversize("log_b", 300);
+
+    test_reserve(1000);
+
     // Write an entry and check that it's there for reading.
     RING_LOG_EXPECT(ring_log_has_unread("log_a"), 0);
     ring_log_write_tail("log_a", "hello", 5);
     ring_log_write_tail_complete("log_a");
     RING_LOG_EXPECT_NOT(ring_log_has_unread("log_a"), 0);
 
-    // Write a huge entry that wipes out the entry we wrote above.
+    // Write a huge entry that wipes out the entry we wrote above, and gets cut
+    // short to what the ring can hold.
     char garbage[] = "Garbage";
     int written = 0;
     while (written < logs_partition_size) {
@@ -119,17 +1704,20 @@ void test(void) {
     ring_log_write_tail_complete("log_a");
     printf("  wrote huge entry with %i bytes\n", written);
 
-    // Read in the (corrupted) huge entry.
+    // Read in the huge entry, which ends with the marker.
     RING_LOG_EXPECT_NOT(ring_log_has_unread("log_a"), 0);
     size_t read_total = 0;
-    char buffer[8];
+    char buffer[200];
     int read_now;
-    while ((read_now = ring_log_read_head("log_a", &buffer, sizeof(buffer), &read_total))) {
-        //printf("%.*s", read_now, &buffer);
+    while ((read_now = ring_log_read_head("log_a", buffer + read_total, 8, &read_total))) {
+        //printf("%.*s", read_now, buffer + read_total - read_now);
     };
     ring_log_read_head_success("log_a");
     printf("  read out huge entry with %zi bytes\n", read_total);
     RING_LOG_EXPECT(ring_log_has_unread("log_a"), 0);
+    RING_LOG_EXPECT(read_total < logs[0].capacity, 1);
+    const char marker[] = RING_LOG_TRUNCATED_MARKER;
+    RING_LOG_EXPECT(memcmp(buffer + read_total - (sizeof(marker) - 1), marker, sizeof(marker) - 1), 0);
 
     // Is the structure still functional after that?
     for (int i = 0; i < sizeof(entry_counts) / sizeof(entry_counts[0]); i++) {
@@ -139,17 +1727,107 @@ void test(void) {
     ring_log_deinit();
 }
 
+// print_stats prints the counters of each log. If the logs started out empty,
+// every entry written has to have been read, evicted, or still be there.
+static void print_stats(int started_empty) {
+    for (int i = 0; i < n_logs; i++) {
+        ring_log_stats_t stats;
+        if (!ring_log_get_stats(&logs[i], &stats)) {
+            return;
+        }
+        printf("  %s: %llu written (%llu bytes), %llu read, %llu evicted, %llu dropped, %llu failed, "
+               "%llu I/O calls, %llu locks (%llu us waiting), max fill %llu bytes/%llu entries\n",
+               logs[i].fn,
+               (unsigned long long)stats.entries_written, (unsigned long long)stats.bytes_written,
+               (unsigned long long)stats.entries_read, (unsigned long long)stats.entries_evicted,
+               (unsigned long long)stats.entries_dropped,
+               (unsigned long long)stats.tails_failed, (unsigned long long)stats.io_calls,
+               (unsigned long long)stats.lock_acquisitions, (unsigned long long)stats.lock_wait_us,
+               (unsigned long long)stats.max_fill_bytes, (unsigned long long)stats.max_fill_entries);
+        RING_LOG_EXPECT(stats.max_fill_bytes <= logs[i].capacity, 1);
+        if (started_empty) {
+            RING_LOG_EXPECT(stats.entries_written - stats.entries_read - stats.entries_evicted,
+                            logs[i].file_header.tail_seq - logs[i].file_header.head_seq);
+        }
+    }
+}
+
 int main(void) {
     srand(10);
 
     // First time, start with a fresh ring log file.
     puts("pass 1: using a fresh ring log file");
     unlink("log_a");
+    unlink("log_b");
+    unlink("log_c");
     test();
+    print_stats(1);
 
     // Second time, try with an existing ring log file.
     puts("pass 2: using the old/existing ring log file");
     test();
+    print_stats(0);
+
+    // Third time, start with a ring log file in the old format.
+    puts("pass 3: migrating a version 0 ring log file");
+    unlink("log_a");
+    test_migrate_v0(1000);
+    test_write_and_read_entries(1000);
+    ring_log_deinit();
+    print_stats(0);
+
+    puts("durability: using the existing ring log file");
+    test_durability();
+    print_stats(0);
+
+#ifdef RING_LOG_TEST_FAULTS
+    puts("recovery: using the existing ring log file");
+    test_recovery(300);
+    print_stats(0);
+#endif
+
+    // Ring log files that get sized without writing every byte should work
+    // the same.
+    ring_log_provision_t provisions[] = {RING_LOG_PROVISION_FALLOCATE, RING_LOG_PROVISION_SPARSE};
+    for (int i = 0; i < sizeof(provisions) / sizeof(provisions[0]); i++) {
+        printf("provisioning %i: using a fresh ring log file\n", provisions[i]);
+        unlink("log_a");
+        logs[0].provision = provisions[i];
+        RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+        sanity_check_file_size("log_a");
+        test_write_and_read_entries(1000);
+        ring_log_deinit();
+        print_stats(0);
+    }
+    logs[0].provision = RING_LOG_PROVISION_FILL;
+
+    // With a header journal, the file header isn't rewritten in place, and
+    // with a program page, entries start on page boundaries.
+    puts("header journal: using a fresh ring log file");
+    unlink("log_a");
+    logs[0].header_slots = 4;
+    logs[0].program_page = 16;
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    sanity_check_file_size("log_a");
+    test_write_and_read_entries(1000);
+    ring_log_deinit();
+    test_journal(1000);
+    print_stats(0);
+#ifdef RING_LOG_TEST_FAULTS
+    // Header slots can be torn by a crash, unlike the file header.
+    logs[0].program_page = 0;
+    unlink("log_a");
+    test_recovery(100);
+    print_stats(0);
+#endif
+    logs[0].header_slots = 0;
+    logs[0].program_page = 0;
+
+    // With consumers, each reads log_a at its own pace.
+    puts("consumers: using a fresh ring log file");
+    unlink("log_a");
+    test_consumers(1000);
+    print_stats(0);
 
     puts("success");
 
@@ -0,0 +1,105 @@
+// pread/pwrite are POSIX.1-2008.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ring_log.h"
+
+extern log_t logs[];
+
+// Entry lengths that take 1, 2, 3 bytes of header, and more than 16 bits.
+static const size_t entry_lens[] = {1, 127, 128, 16383, 16384, 70000, 1000000, 3};
+#define N_ENTRIES (sizeof(entry_lens) / sizeof(entry_lens[0]))
+
+static char chunk[4096];
+
+// write_entries writes out entries of entry_lens, a chunk at a time, with
+// contents that depend on their position in the entry.
+static void write_entries(ring_log_handle_t log) {
+    for (int i = 0; i < N_ENTRIES; i++) {
+        for (size_t off = 0; off < entry_lens[i]; off += sizeof(chunk)) {
+            size_t len = entry_lens[i] - off < sizeof(chunk) ? entry_lens[i] - off : sizeof(chunk);
+            for (size_t j = 0; j < len; j++) {
+                chunk[j] = i + (off + j) * 7;
+            }
+            ring_log_write_tail_h(log, chunk, len);
+        }
+        ring_log_write_tail_complete_h(log);
+    }
+}
+
+// read_entries reads the entries back out with a cursor, and checks their
+// lengths, contents and sequence numbers.
+static void read_entries(ring_log_handle_t log, uint64_t first_seq) {
+    ring_log_cursor_t cursor;
+    for (int i = 0; i < N_ENTRIES; i++) {
+        RING_LOG_EXPECT(ring_log_cursor_begin(log, &cursor), 1);
+        RING_LOG_EXPECT(cursor.len, entry_lens[i]);
+        RING_LOG_EXPECT(cursor.seq, first_seq + i);
+        size_t off = 0;
+        int read_now;
+        while ((read_now = ring_log_cursor_read(&cursor, chunk, sizeof(chunk))) > 0) {
+            for (int j = 0; j < read_now; j++) {
+                RING_LOG_EXPECT(chunk[j], (char)(i + (off + j) * 7));
+            }
+            off += read_now;
+        }
+        RING_LOG_EXPECT(read_now, 0);
+        RING_LOG_EXPECT(off, entry_lens[i]);
+        ring_log_cursor_commit(&cursor);
+    }
+    RING_LOG_EXPECT(ring_log_has_unread_h(log), 0);
+}
+
+int main(void) {
+    srand(10);
+    printf("using a %lld byte ring log file\n", (long long)RING_LOG_FILE_SIZE(logs[0].capacity));
+
+    // Write and read a few entries in a fresh file.
+    puts("pass 1: using a fresh ring log file");
+    unlink(logs[0].fn);
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    sanity_check_file_size(logs[0].fn);
+    ring_log_handle_t log = ring_log_open(logs[0].fn);
+    write_entries(log);
+    sanity_check_index(logs[0].fn);
+    read_entries(log, 0);
+    ring_log_deinit();
+
+    // Move the (empty) log to just before the end of the file, more than
+    // 4 GB in, and past 32-bit sequence numbers, so that the entries wrap.
+    puts("pass 2: wrapping around the end of the file");
+    int fd = open(logs[0].fn, O_RDWR);
+    RING_LOG_EXPECT_NOT(fd, -1);
+    file_header_t file_header;
+    RING_LOG_EXPECT(pread(fd, &file_header, sizeof(file_header), 0), sizeof(file_header));
+    RING_LOG_EXPECT(file_header.magic, RING_LOG_MAGIC);
+    RING_LOG_EXPECT(file_header.version, RING_LOG_VERSION);
+    file_header.head = file_header.tail = RING_LOG_FILE_SIZE(logs[0].capacity) - 300000;
+    file_header.head_seq = file_header.tail_seq = 5000000000ULL;
+    RING_LOG_EXPECT(pwrite(fd, &file_header, sizeof(file_header), 0), sizeof(file_header));
+    close(fd);
+
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    log = ring_log_open(logs[0].fn);
+    write_entries(log);
+    RING_LOG_EXPECT(log->file_header.tail < log->file_header.head, 1);
+    ring_log_deinit();
+
+    // The entries should still be there after opening the file again.
+    RING_LOG_EXPECT_NOT(ring_log_init(), 0);
+    log = ring_log_open(logs[0].fn);
+    sanity_check_index(logs[0].fn);
+    read_entries(log, 5000000000ULL);
+    ring_log_deinit();
+
+    unlink(logs[0].fn);
+
+    puts("success");
+
+    return 0;
+}
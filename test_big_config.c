@@ -0,0 +1,31 @@
+#include "ring_log.h"
+
+// test_big.c runs a single log that is several GB big, in a sparse file on
+// tmpfs, so that it doesn't actually take up that much room. Its capacity is a
+// power of two, and test_big is built with RING_LOG_POW2_CAPACITY.
+#define LOG_BIG_CAPACITY (8LL * 1024 * 1024 * 1024)
+
+static char log_big_staging[4096];
+static ring_log_index_entry_t log_big_index[64];
+
+log_t logs[] = {
+    {
+        .fn = "/dev/shm/ring_log_big",
+        .capacity = LOG_BIG_CAPACITY,
+        .provision = RING_LOG_PROVISION_SPARSE,
+        .staging = log_big_staging, .staging_size = sizeof(log_big_staging),
+        .index = log_big_index, .index_size = sizeof(log_big_index) / sizeof(log_big_index[0])
+    }
+};
+
+#define LOGS_PARTITION_SIZE (10304LL * 1024 * 1024)
+const off_t logs_partition_size = LOGS_PARTITION_SIZE;
+
+#define N_LOGS (sizeof(logs) / sizeof(logs[0]))
+const int n_logs = N_LOGS;
+
+RING_LOG_STATIC_ASSERT(RING_LOG_FILE_SIZE(LOG_BIG_CAPACITY) <= LOGS_PARTITION_SIZE * 8 / 10, logs_fit_in_partition);
+
+const int provision_in_parallel = 0;
+
+const ring_log_msync_t msync_policy = RING_LOG_MSYNC_NONE;